@@ -26,6 +26,50 @@ SOFTWARE.
 
 namespace Hap
 {
+	EventSignal eventSignal;
+
+	bool EventSignal::Add(Hook fn, void* ctx)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+
+		for (auto& h : _hook)
+		{
+			if (h.fn == nullptr)
+			{
+				h.fn = fn;
+				h.ctx = ctx;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void EventSignal::Remove(Hook fn, void* ctx)
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+
+		for (auto& h : _hook)
+		{
+			if (h.fn == fn && h.ctx == ctx)
+			{
+				h.fn = nullptr;
+				h.ctx = nullptr;
+			}
+		}
+	}
+
+	void EventSignal::operator()()
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+
+		for (auto& h : _hook)
+		{
+			if (h.fn != nullptr)
+				h.fn(h.ctx);
+		}
+	}
+
 	const char* Config::key[] = 
 	{
 		"name",
@@ -33,26 +33,79 @@ SOFTWARE.
 
 #include <utility>
 #include <functional>
+#include <mutex>
+#include <atomic>
 
 extern "C" void t_random(unsigned char* data, unsigned size);
 
 namespace Hap
 {
-	extern bool debug;
+	// Log levels
+	//	Log messages are written at Info level, Dbg and DbgHex at Debug level;
+	//	sites above HAP_LOG_LEVEL are compiled out, the rest are filtered by logLevel at run time
+	enum LogLevel : uint8_t
+	{
+		LogNone = 0,
+		LogInfo = 1,
+		LogDebug = 2,
+	};
+
+	#ifndef HAP_LOG_LEVEL
+	#define HAP_LOG_LEVEL 2
+	#endif
+
+	extern uint8_t logLevel;
 
 	// Logging functions
 	void Log(const char* f, ...);
 	void Hex(const char* Header, const void* Buffer, size_t Length);
-	#define Dbg if(debug)Log
+	#define LogOn(level) ((level) <= HAP_LOG_LEVEL && (level) <= Hap::logLevel)
+	#define Dbg if(LogOn(Hap::LogDebug))Hap::Log
+	#define DbgHex if(LogOn(Hap::LogDebug))Hap::Hex
+
+	// Event signal
+	//	called by DB when characteristic value change makes events pending for some sessions,
+	//	may be called from any thread; each network task adds its own hook to wake itself up
+	//	and deliver the events without waiting for next periodic Poll
+	//	hooks are called under the lock, so they must not Add or Remove hooks
+	class EventSignal
+	{
+	public:
+		using Hook = void (*)(void* ctx);
+		static constexpr uint8_t MaxHooks = 4;
+
+		// returns false when all hook slots are taken
+		bool Add(Hook fn, void* ctx);
+
+		// the hook is not called once Remove returns
+		void Remove(Hook fn, void* ctx);
+
+		// call all hooks
+		void operator()();
+
+	private:
+		std::mutex _lock;
+		struct
+		{
+			Hook fn;
+			void* ctx;
+		} _hook[MaxHooks] = {};
+	};
+
+	extern EventSignal eventSignal;
 
 	// global constants
 	constexpr uint8_t MaxPairings = 10 /*16*/;				// max number of pairings the accessory supports (4.11 Add pairing)
 															//	10 for now, until > 1024 byte frames are supported	TODO: fix
 	constexpr uint8_t MaxHttpSessions = 8;					// max HTTP sessions (5.2.3 TCP requirements)
+	constexpr uint8_t MaxHttpThreads = 4;					// max network threads calling HTTP server concurrently
 	constexpr uint8_t MaxHttpHeaders = 20;					// max number of HTTP headers in request
 	constexpr uint8_t MaxHttpTlv = 10;						// max num of items in incoming TLV
 	constexpr uint16_t MaxHttpBlock = 1024;					// max size of encrypted block (5.5.2 Session securiry)
 	constexpr uint16_t MaxHttpFrame = MaxHttpBlock + 2 + 16;// max HTTP frame 
+	constexpr uint16_t MaxHttpReq = MaxHttpFrame * 2;		// default request buffer size
+	constexpr uint16_t MaxHttpRsp = MaxHttpFrame * 4;		// default response buffer size
+	constexpr uint16_t MaxHttpJson = MaxHttpReq / 8;		// max number of JSON tokens in characteristics write request
 
 	constexpr uint16_t DefString = 64;		// default length of a string characteristic
 	constexpr uint16_t MaxString = 64;		// max string length
@@ -207,6 +260,7 @@ namespace Hap
 #include "HapTlv.h"
 #include "HapHttp.h"
 #include "HapTcp.h"
+#include "HapLoopback.h"
 #include "HapDb.h"
 #include "HapAppleCharacteristics.h"
 #include "HapAppleServices.h"
@@ -57,78 +57,333 @@ namespace Hap
 {
 	namespace Crypt
 	{
-		void aead(Action action,
+		// pad MACed data to 16 bytes
+		static void macPad(poly1305_context* ctx, size_t len)
+		{
+			static const uint8_t zero[16] = {};
+
+			if (len % 16)
+				poly1305_update(ctx, zero, 16 - (len % 16));
+		}
+
+		// MAC data lengths and get the tag
+		static void macFinish(poly1305_context* ctx, uint64_t aad_size, uint64_t msg_size, uint8_t* tag)
+		{
+			union
+			{
+				uint8_t b[8];
+				uint64_t u;
+			} num;
+
+			num.u = aad_size;
+			poly1305_update(ctx, num.b, 8);
+
+			num.u = msg_size;
+			poly1305_update(ctx, num.b, 8);
+
+			poly1305_finish(ctx, tag);
+		}
+
+		// compare tags in constant time
+		static bool tagEqual(const uint8_t* a, const uint8_t* b)
+		{
+			uint8_t d = 0;
+
+			for (uint16_t i = 0; i < TagSize; i++)
+				d |= a[i] ^ b[i];
+
+			return d == 0;
+		}
+
+		bool aead(Action action,
 			uint8_t* out,
 			uint8_t* tag,
 			const uint8_t* key,
 			const uint8_t* nonce,
-			const uint8_t* msg,
-			uint16_t msg_size,
+			const Hap::Buf<const uint8_t*>* msg,
+			uint8_t cnt,
 			const uint8_t* aad,
 			uint16_t aad_size
 		)
 		{
-			uint8_t otk[64];
-			uint8_t zero[16];
-			union
-			{
-				uint8_t b[8];
-				uint64_t u;
-			} num;
-			size_t l;
+			// encrypted data is MACed chunk by chunk while it is still in cache,
+			//	chunk is a multiple of chacha and poly1305 blocks
+			constexpr size_t Chunk = 512;
 
-			memset(zero, 0, sizeof(zero));
+			uint8_t otk[64];
+			size_t msg_size = 0;
+			uint8_t* o;
+			uint8_t i;
 
+			// first keystream block is the Poly1305 key, data is encrypted from the next one
 			chacha20_block(otk, key, nonce);
 
-			chacha20_encrypt(out, msg, msg_size, key, nonce);
+			chacha_ctx chacha;
+			chacha20_init(&chacha, key, nonce);
 
 			poly1305_context ctx;
 			poly1305_init(&ctx, otk);
 			if (aad_size > 0)
 			{
-				l = aad_size;
-				poly1305_update(&ctx, aad, l);
-				if (l % 16)
-					poly1305_update(&ctx, zero, 16 - (l % 16));
+				poly1305_update(&ctx, aad, aad_size);
+				macPad(&ctx, aad_size);
 			}
 
-			l = msg_size;
 			if (action == Encrypt)
-				poly1305_update(&ctx, out, l);
-			else
-				poly1305_update(&ctx, msg, l);
-			if (l % 16)
-				poly1305_update(&ctx, zero, 16 - (l % 16));
+			{
+				o = out;
+				for (i = 0; i < cnt; i++)
+				{
+					const uint8_t* p = msg[i].ptr();
+					size_t len = msg[i].len();
 
-			num.u = aad_size;
-			poly1305_update(&ctx, num.b, 8);
+					while (len > 0)
+					{
+						size_t l = len < Chunk ? len : Chunk;
 
-			num.u = msg_size;
-			poly1305_update(&ctx, num.b, 8);
+						chacha20_update(&chacha, o, p, l);
+						poly1305_update(&ctx, o, l);
+
+						o += l;
+						p += l;
+						len -= l;
+					}
+
+					msg_size += msg[i].len();
+				}
+
+				macPad(&ctx, msg_size);
+				macFinish(&ctx, aad_size, msg_size, tag);
+
+				return true;
+			}
+
+			// decrypt only authenticated data, the check also keeps
+			//	the source intact until it is done when decrypting in place
+			for (i = 0; i < cnt; i++)
+			{
+				poly1305_update(&ctx, msg[i].ptr(), msg[i].len());
+				msg_size += msg[i].len();
+			}
+
+			uint8_t calc[TagSize];
+			macPad(&ctx, msg_size);
+			macFinish(&ctx, aad_size, msg_size, calc);
+
+			if (!tagEqual(calc, tag))
+				return false;
+
+			o = out;
+			for (i = 0; i < cnt; i++)
+			{
+				chacha20_update(&chacha, o, msg[i].ptr(), msg[i].len());
+				o += msg[i].len();
+			}
 
-			poly1305_finish(&ctx, tag);
+			return true;
 		}
 
-		void hkdf(
-			const unsigned char *salt, size_t salt_len,
-			const unsigned char *key, size_t key_len,
+		bool aead(Action action,
+			uint8_t* out,
+			uint8_t* tag,
+			const uint8_t* key,
+			const uint8_t* nonce,
+			const uint8_t* msg,
+			uint16_t msg_size,
+			const uint8_t* aad,
+			uint16_t aad_size
+		)
+		{
+			Hap::Buf<const uint8_t*> m(msg, msg_size);
+
+			return aead(action, out, tag, key, nonce, &m, 1, aad, aad_size);
+		}
+
+		bool aead(Action action,
+			uint8_t* buf,
+			uint16_t size,
+			uint8_t* tag,
+			const uint8_t* key,
+			const uint8_t* nonce,
+			const uint8_t* aad,
+			uint16_t aad_size
+		)
+		{
+			Hap::Buf<const uint8_t*> m(buf, size);
+
+			return aead(action, buf, tag, key, nonce, &m, 1, aad, aad_size);
+		}
+
+		// make 96-bit frame nonce from sequence number
+		static void frameNonce(uint8_t* nonce, uint64_t seq)
+		{
+			memset(nonce, 0, 4);
+			memcpy(nonce + 4, &seq, 8);
+		}
+
+		uint16_t encryptFrame(
+			uint8_t* frame,
+			const uint8_t* key,
+			uint64_t seq,
+			const Hap::Buf<const uint8_t*>* msg,
+			uint8_t cnt
+		)
+		{
+			uint16_t len = 0;
+			for (uint8_t i = 0; i < cnt; i++)
+				len += (uint16_t)msg[i].len();
+
+			uint8_t nonce[12];
+			frameNonce(nonce, seq);
+
+			// data length, also AAD for encryption
+			frame[0] = len & 0xFF;
+			frame[1] = (len >> 8) & 0xFF;
+
+			aead(Encrypt,
+				frame + 2, frame + 2 + len,			// output data and tag positions
+				key, nonce,
+				msg, cnt,							// data to encrypt
+				frame, 2							// aad
+			);
+
+			return FrameOverhead + len;
+		}
+
+		uint16_t encryptFrame(
+			uint8_t* frame,
+			const uint8_t* key,
+			uint64_t seq,
+			const uint8_t* msg,
+			uint16_t len
+		)
+		{
+			Hap::Buf<const uint8_t*> m(msg, len);
+
+			return encryptFrame(frame, key, seq, &m, 1);
+		}
+
+		bool decryptFrame(
+			uint8_t* out,
+			const uint8_t* key,
+			uint64_t seq,
+			const uint8_t* frame,
+			uint16_t len
+		)
+		{
+			uint8_t nonce[12];
+			frameNonce(nonce, seq);
+
+			// the frame tag is past the output so it is intact, and it is only read on Decrypt
+			return aead(Decrypt,
+				out, const_cast<uint8_t*>(frame + 2 + len),	// output data and received tag
+				key, nonce,
+				frame + 2, len,						// encrypted data
+				frame, 2							// aad
+			);
+		}
+
+		bool hkdfExpand(
+			const unsigned char *prk,
 			const unsigned char *info, size_t info_len,
 			unsigned char *okm, unsigned int okm_len
 		)
 		{
-			unsigned char prk[64];
+			unsigned char t[PrkSize];
 			hmac_sha512_ctx ctx;
 			uint8_t ctr = 1;
 
-			hmac_sha512(salt, salt_len, key, key_len, prk, 64);
+			// one byte block counter
+			if (okm_len > MaxOkmSize)
+				return false;
+
+			hmac_sha512_init(&ctx, prk, PrkSize);
+
+			// T(n) = HMAC(PRK, T(n-1) | info | n)
+			while (okm_len > 0)
+			{
+				if (ctr > 1)
+				{
+					hmac_sha512_reinit(&ctx);
+					hmac_sha512_update(&ctx, t, PrkSize);
+				}
+				hmac_sha512_update(&ctx, info, (unsigned)info_len);
+				hmac_sha512_update(&ctx, &ctr, 1);
+				hmac_sha512_final(&ctx, t, PrkSize);
+
+				unsigned int l = okm_len < PrkSize ? okm_len : PrkSize;
+				memcpy(okm, t, l);
+				okm += l;
+				okm_len -= l;
+				ctr++;
+			}
+
+			return true;
+		}
+
+		bool hkdf(
+			const unsigned char *salt, size_t salt_len,
+			const unsigned char *key, size_t key_len,
+			const unsigned char *info, size_t info_len,
+			unsigned char *okm, unsigned int okm_len
+		)
+		{
+			unsigned char prk[PrkSize];
+
+			hmac_sha512(salt, (unsigned)salt_len, key, (unsigned)key_len, prk, PrkSize);
+
+			return hkdfExpand(prk, info, info_len, okm, okm_len);
+		}
+
+		// HMAC states keyed with constant salts, built on first use
+		static const hmac_sha512_ctx& saltCtx(Salt salt)
+		{
+			static const struct SaltTable
+			{
+				hmac_sha512_ctx ctx[SaltCount];
+
+				SaltTable()
+				{
+					static const char* const salts[SaltCount] =
+					{
+						"Pair-Setup-Encrypt-Salt",
+						"Pair-Setup-Accessory-Sign-Salt",
+						"Pair-Verify-Encrypt-Salt",
+						"Control-Salt",
+					};
+
+					for (int i = 0; i < SaltCount; i++)
+						hmac_sha512_init(&ctx[i], (const unsigned char*)salts[i], (unsigned)strlen(salts[i]));
+				}
+			} table;
+
+			return table.ctx[salt];
+		}
+
+		void hkdfExtract(
+			Salt salt,
+			const unsigned char *key, size_t key_len,
+			unsigned char *prk
+		)
+		{
+			hmac_sha512_ctx ctx = saltCtx(salt);
+
+			hmac_sha512_update(&ctx, key, (unsigned)key_len);
+			hmac_sha512_final(&ctx, prk, PrkSize);
+		}
+
+		bool hkdf(
+			Salt salt,
+			const unsigned char *key, size_t key_len,
+			const unsigned char *info, size_t info_len,
+			unsigned char *okm, unsigned int okm_len
+		)
+		{
+			unsigned char prk[PrkSize];
 
-			hmac_sha512_init(&ctx, prk, 64);
-			hmac_sha512_update(&ctx, info, info_len);
-			hmac_sha512_update(&ctx, &ctr, 1);
-			hmac_sha512_final(&ctx, prk, 64);
+			hkdfExtract(salt, key, key_len, prk);
 
-			memcpy(okm, prk, okm_len);
+			return hkdfExpand(prk, info, info_len, okm, okm_len);
 		}
 
 		void Curve25519::Init()
@@ -39,7 +39,12 @@ namespace Hap
 			Decrypt = 1
 		};
 
-		void aead(Action action,
+		// ChaCha20-Poly1305 AEAD, tag is calculated over encrypted data
+		//	Encrypt writes the tag, Decrypt verifies the received tag first and
+		//	decrypts only if it matches, returns false when it does not
+		//	out may be the same as msg, or below msg when the buffers overlap
+		//	(decrypted data is written behind the encrypted data it was read from)
+		bool aead(Action action,
 			uint8_t* out,
 			uint8_t* tag,
 			const uint8_t* key,
@@ -50,13 +55,108 @@ namespace Hap
 			uint16_t aad_size = 0
 		);
 
-		void hkdf(
+		// in place - data in buf is replaced by encrypted or decrypted data
+		bool aead(Action action,
+			uint8_t* buf,
+			uint16_t size,
+			uint8_t* tag,
+			const uint8_t* key,
+			const uint8_t* nonce,
+			const uint8_t* aad = nullptr,
+			uint16_t aad_size = 0
+		);
+
+		// scatter-gather - message is passed in cnt segments, result is written contiguously into out
+		//	out may be the same as the first segment when cnt is 1
+		bool aead(Action action,
+			uint8_t* out,
+			uint8_t* tag,
+			const uint8_t* key,
+			const uint8_t* nonce,
+			const Hap::Buf<const uint8_t*>* msg,
+			uint8_t cnt,
+			const uint8_t* aad = nullptr,
+			uint16_t aad_size = 0
+		);
+
+		// session frame (5.5.2 Session Security)
+		//	2-byte little endian data length which is also the AAD, encrypted data, tag;
+		//	nonce is 64-bit little endian frame sequence number preceded by four zero bytes
+		constexpr static uint16_t FrameOverhead = 2 + TagSize;
+
+		// encrypt data segments into frame, total data length must not exceed MaxHttpBlock
+		//	data may be encrypted in place at frame + 2
+		//	returns frame length
+		uint16_t encryptFrame(
+			uint8_t* frame,
+			const uint8_t* key,
+			uint64_t seq,
+			const Hap::Buf<const uint8_t*>* msg,
+			uint8_t cnt
+		);
+
+		uint16_t encryptFrame(
+			uint8_t* frame,
+			const uint8_t* key,
+			uint64_t seq,
+			const uint8_t* msg,
+			uint16_t len
+		);
+
+		// decrypt complete frame of given data length into out
+		//	out may be at or below frame + 2 (in place, or over the frame length)
+		//	returns false if the tag does not match, out is not written then
+		bool decryptFrame(
+			uint8_t* out,
+			const uint8_t* key,
+			uint64_t seq,
+			const uint8_t* frame,
+			uint16_t len
+		);
+
+		// HKDF-SHA512 (RFC 5869), okm_len up to MaxOkmSize
+		//	returns false if okm_len is over the limit, okm is not written then
+		constexpr static uint16_t PrkSize = 64;
+		constexpr static unsigned int MaxOkmSize = 255 * PrkSize;
+
+		bool hkdf(
 			const unsigned char *salt, size_t salt_len,
 			const unsigned char *key, size_t key_len,
 			const unsigned char *info, size_t info_len,
 			unsigned char *okm, unsigned int okm_len
 		);
 
+		// constant HKDF salts used by HAP,
+		//	HMAC is keyed with each of them once and the keyed state is reused
+		enum Salt
+		{
+			PairSetupEncryptSalt = 0,
+			PairSetupAccessorySignSalt,
+			PairVerifyEncryptSalt,
+			ControlSalt,
+			SaltCount
+		};
+
+		bool hkdf(
+			Salt salt,
+			const unsigned char *key, size_t key_len,
+			const unsigned char *info, size_t info_len,
+			unsigned char *okm, unsigned int okm_len
+		);
+
+		// HKDF steps, several keys may be expanded from one PRK
+		void hkdfExtract(
+			Salt salt,
+			const unsigned char *key, size_t key_len,
+			unsigned char *prk
+		);
+
+		bool hkdfExpand(
+			const unsigned char *prk,
+			const unsigned char *info, size_t info_len,
+			unsigned char *okm, unsigned int okm_len
+		);
+
 		class Curve25519
 		{
 		public:
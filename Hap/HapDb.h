@@ -412,11 +412,11 @@ namespace Hap
 			iid_t iid = null_id;
 
 			bool val_present = false;	// value member is present
-			uint8_t val_ind = 0;		// value token index in rq
+			int16_t val_ind = 0;		// value token index in rq
 			bool ev_present = false;	// event member is present
 			bool ev_value = false;		// event member value
 			bool auth_present = false;	// authData member is present 
-			uint8_t auth_ind = 0;		// authData token index in rq
+			int16_t auth_ind = 0;		// authData token index in rq
 			bool remote_present = false;// remote member is present
 			bool remote_value = false;	// remote member value
 
@@ -637,6 +637,186 @@ namespace Hap
 		ObjArrayStatic() : ObjArrayBase(_obj, Count) {}
 	};
 
+	// DbCache - serialized structure of accessory database
+	//	the database is serialized once, values and per-session ev flags are not written
+	//	into the cache, their positions are recorded instead and the properties write them
+	//	when the cache is read; the cache is rebuilt when config->configNum changes
+	//	- does not allocate storage, use DbCacheStatic for statically allocated cache
+	//	- all access must be externally serialized, same as access to Db
+	class DbCache
+	{
+	public:
+		struct Splice
+		{
+			uint32_t off;		// position in the cache
+			Obj* obj;			// property which writes its value at this position
+		};
+
+		struct Acc
+		{
+			uint32_t off;		// start of the accessory in the cache
+			uint16_t splice;	// first splice of the accessory
+		};
+
+	private:
+		char* _buf;
+		uint32_t _size;
+		uint32_t _len = 0;
+		Splice* _splice;
+		uint16_t _spliceMax;
+		uint16_t _spliceCnt = 0;
+		Acc* _acc;				// accessory positions, entry after the last accessory marks the end
+		uint8_t _accMax;
+		uint8_t _accCnt = 0;
+
+		uint32_t _configNum = 0;	// config number the cache was built for
+		bool _built = false;		// build was attempted for _configNum
+		bool _valid = false;		// cache content is valid
+		bool _overflow;
+
+		// cache being built
+		static DbCache*& building()
+		{
+			static DbCache* cache = nullptr;
+			return cache;
+		}
+
+		bool build(ObjArrayBase& acc)
+		{
+			_len = 0;
+			_spliceCnt = 0;
+			_accCnt = 0;
+			_overflow = false;
+
+			if (acc.size() > _accMax)
+				return false;
+
+			building() = this;
+
+			for (int i = 0; i < acc.size() && !_overflow; i++)
+			{
+				_acc[i] = { _len, _spliceCnt };
+
+				Obj* obj = acc.get(i);
+				if (obj == nullptr)
+					continue;
+
+				// sid is not used, per-session properties are spliced
+				int l = obj->getDb(_buf + _len, int(_size - _len), 0);
+				if (l >= int(_size - _len))
+					_overflow = true;
+				else
+					_len += l;
+			}
+
+			building() = nullptr;
+
+			_accCnt = acc.size();
+			_acc[_accCnt] = { _len, _spliceCnt };
+
+			return !_overflow;
+		}
+
+	public:
+		DbCache(char* buf, uint32_t size, Splice* splice, uint16_t spliceMax, Acc* acc, uint8_t accMax)
+			: _buf(buf), _size(size), _splice(splice), _spliceMax(spliceMax), _acc(acc), _accMax(accMax)
+		{}
+
+		// called from getDb of properties which are not cached
+		//	returns true when the cache is being built, the property must not write anything then
+		static bool Record(Obj* obj, const char* s)
+		{
+			DbCache* c = building();
+			if (c == nullptr)
+				return false;
+
+			if (c->_spliceCnt < c->_spliceMax)
+				c->_splice[c->_spliceCnt++] = { uint32_t(s - c->_buf), obj };
+			else
+				c->_overflow = true;
+
+			return true;
+		}
+
+		// force rebuild, for structure changes that do not change config number
+		void Invalidate()
+		{
+			_built = false;
+			_valid = false;
+		}
+
+		// check that the cache matches the database, rebuild it if config number has changed
+		bool Valid(ObjArrayBase& acc)
+		{
+			uint32_t configNum = config != nullptr ? config->configNum : 0;
+
+			if (!_built || _configNum != configNum)
+			{
+				_configNum = configNum;
+				_built = true;
+				_valid = build(acc);
+
+				if (_valid)
+					Log("Db: cache built, %d bytes, %d splices\n", _len, _spliceCnt);
+				else
+					Log("Db: cache is too small, database is not cached\n");
+			}
+
+			return _valid;
+		}
+
+		// write JSON representation of accessory i
+		//	returns num of characters written, a value >= max means the accessory does not fit
+		int getDb(int i, char* str, int max, sid_t sid) const
+		{
+			char* s = str;
+			uint32_t off = _acc[i].off;
+			uint16_t k = _acc[i].splice;
+
+			// cached text up to next splice, then the property
+			while (true)
+			{
+				uint32_t end = k < _acc[i + 1].splice ? _splice[k].off : _acc[i + 1].off;
+				int l = int(end - off);
+
+				if (l >= max)
+					return int(s - str) + max;
+
+				memcpy(s, _buf + off, l);
+				s += l;
+				max -= l;
+				off = end;
+
+				if (k == _acc[i + 1].splice)
+					break;
+
+				l = _splice[k++].obj->getDb(s, max, sid);
+				if (l >= max)
+					return int(s - str) + max;
+
+				s += l;
+				max -= l;
+			}
+
+			return int(s - str);
+		}
+	};
+
+	// statically allocated cache
+	//	Size - cache size in bytes, Splices - number of uncached properties (value and ev of characteristics)
+	template<int AccCount, uint32_t Size, uint16_t Splices>
+	class DbCacheStatic : public DbCache
+	{
+	private:
+		char _buf[Size];
+		Splice _splice[Splices];
+		Acc _acc[AccCount + 1];
+	public:
+		DbCacheStatic()
+			: DbCache(_buf, Size, _splice, Splices, _acc, AccCount)
+		{}
+	};
+
 	namespace Property
 	{
 		// Hap::Property::Obj - base class of Properties
@@ -679,6 +859,10 @@ namespace Hap
 				char* s = str;
 				int l;
 
+				// characteristic value is not cached
+				if (Key == KeyId::value && DbCache::Record(this, s))
+					return 0;
+
 				if (max <= 0) goto Ret;
 
 				l = snprintf(s, max, "\"%s\":", key());
@@ -849,9 +1033,15 @@ namespace Hap
 
 			void SetEvent(bool e = true)
 			{
+				bool pending = false;
+
 				for (unsigned i = 0; i < sizeofarr(_e); i++)
 					if (_v[i])
-						_e[i] = true;
+						pending = _e[i] = true;
+
+				// wake up network task so the events get delivered right away
+				if (pending)
+					eventSignal();
 			}
 			
 			bool GetAndClearEvent(sid_t sid)
@@ -879,6 +1069,10 @@ namespace Hap
 				char* s = str;
 				int l;
 
+				// per-session value is not cached
+				if (DbCache::Record(this, s))
+					return 0;
+
 				if (max <= 0) goto Ret;
 
 				l = snprintf(s, max, "\"%s\":", key());
@@ -1674,6 +1868,7 @@ namespace Hap
 	{
 	private:
 		ObjArrayBase& _acc;		// array of accessories
+		DbCache* _cache = nullptr;	// serialized database, optional
 
 	protected:
 		void AddAcc(Obj* acc) {	_acc.set(acc); }
@@ -1684,6 +1879,14 @@ namespace Hap
 			: _acc(acc)
 		{}
 
+		// attach cache used by GET /accessories
+		void Cache(DbCache* cache)
+		{
+			_cache = cache;
+			if (_cache != nullptr)
+				_cache->Invalidate();
+		}
+
 		void Open(sid_t sid)
 		{
 			// propagate Open down to accessories
@@ -1730,6 +1933,63 @@ namespace Hap
 			return s - str;
 		}
 
+		// get JSON-formatted database in portions of whole accessories
+		//	pos must be 0 on first call, it is advanced past the written data
+		//	and set back to 0 when the database is complete
+		//	returns num of characters written to str, -1 when next accessory does not fit into max
+		int getDb(sid_t sid, char* str, int max, int& pos)
+		{
+			static const char head[] = "{\"accessories\":[";
+			char* s = str;
+
+			if (pos == 0)
+			{
+				if (max < int(sizeof(head) - 1))
+					return -1;
+
+				memcpy(s, head, sizeof(head) - 1);
+				s += sizeof(head) - 1;
+				max -= sizeof(head) - 1;
+				pos = 1;
+			}
+
+			bool cached = _cache != nullptr && _cache->Valid(_acc);
+
+			// pos - 1 is index of next accessory, comma is needed if any accessory precedes it
+			bool comma = false;
+			for (int i = 0; i < pos - 1 && !comma; i++)
+				comma = _acc.get(i) != nullptr;
+
+			for (; pos <= _acc.size(); pos++)
+			{
+				Obj* acc = _acc.get(pos - 1);
+				if (acc == nullptr)
+					continue;
+
+				int c = comma ? 1 : 0;
+				int l = cached ? _cache->getDb(pos - 1, s + c, max - c, sid) : acc->getDb(s + c, max - c, sid);
+				if (l >= max - c)
+					goto Ret;	// accessory does not fit, it goes to next portion
+
+				if (comma)
+					*s = ',';
+				s += c + l;
+				max -= c + l;
+				comma = true;
+			}
+
+			if (max < 2)
+				goto Ret;
+
+			*s++ = ']';
+			*s++ = '}';
+			pos = 0;
+		Ret:
+			if (s == str)
+				return -1;
+			return s - str;
+		}
+
 		// collect events
 		//	returns HTTP status and JSON-formatted body for HTTP EVENT
 		//	the rsp_size must be initially set to size of the rsp buffer;
@@ -1777,10 +2037,10 @@ namespace Hap
 		Http::Status Write(sid_t sid, const char* req, int req_length, char* rsp, int& rsp_size)
 		{
 			int l, max = rsp_size;
-			Hap::Json::Parser<> wr;
+			Hap::Json::Parser<MaxHttpJson> wr;
 			int rc = wr.parse(req, req_length);
 
-			Log("parse = %d\n", rc);
+			Dbg("parse = %d\n", rc);
 
 			rsp_size = 0;
 
@@ -1806,11 +2066,12 @@ namespace Hap
 			}
 
 			int cnt = wr.tk(om[0].i)->size;
-			Log("Request contains %d characteristics\n", cnt);
+			Dbg("Request contains %d characteristics\n", cnt);
 
 			// prepare response
 			char* s = rsp;
 			bool comma = false;
+			bool full = false;
 			int errcnt = 0;
 
 			l = snprintf(s, max, "{\"characteristics\":[");
@@ -1897,15 +2158,15 @@ namespace Hap
 					p.remote_present = wr.is_bool(om[5].i, p.remote_value);
 				}
 
-				Log("Characteristic %d:  aid %u  iid %u\n", i, p.aid, p.iid);
+				Dbg("Characteristic %d:  aid %u  iid %u\n", i, p.aid, p.iid);
 				if (p.val_present)
-					Log("      value: '%.*s'\n", wr.length(p.val_ind), wr.start(p.val_ind));
+					Dbg("      value: '%.*s'\n", wr.length(p.val_ind), wr.start(p.val_ind));
 				if (p.ev_present)
-					Log("         ev: %s\n", p.ev_value ? "true" : "false");
+					Dbg("         ev: %s\n", p.ev_value ? "true" : "false");
 				if (p.auth_present)
-					Log("   authData: '%.*s'\n", wr.length(p.auth_ind), wr.start(p.auth_ind));
+					Dbg("   authData: '%.*s'\n", wr.length(p.auth_ind), wr.start(p.auth_ind));
 				if (p.remote_present)
-					Log("         ev: %s\n", p.remote_value ? "true" : "false");
+					Dbg("         ev: %s\n", p.remote_value ? "true" : "false");
 
 				// find accessory by aid
 				auto acc = GetAcc(p.aid);
@@ -1922,12 +2183,20 @@ namespace Hap
 				if (p.status != Hap::Status::Success)
 					errcnt++;
 
+				// statuses are only needed when some write fails,
+				//	so a full response buffer does not stop the remaining writes
+				if (full)
+					continue;
+
 				if (comma)
 				{
 					*s++ = ',';
 					max--;
 					if (max <= 0)
-						return Http::HTTP_500;	// Internal error
+					{
+						full = true;
+						continue;
+					}
 				}
 
 				l = snprintf(s, max, "{\"aid\":%d,\"iid\":%d,\"status\":%s}",
@@ -1935,23 +2204,26 @@ namespace Hap
 				s += l;
 				max -= l;
 				if (max <= 0)
-					return Http::HTTP_500;	// Internal error
+					full = true;
 				comma = true;
 
 			}
 
-			l = snprintf(s, max, "]}");
-			s += l;
-			max -= l;
-			if (max <= 0)
-				return Http::HTTP_500;	// Internal error
-
 			if (errcnt == 0)
 			{
 				rsp_size = 0;
 				return Http::HTTP_204;	// No content
 			}
 
+			if (full)
+				return Http::HTTP_500;	// Internal error
+
+			l = snprintf(s, max, "]}");
+			s += l;
+			max -= l;
+			if (max <= 0)
+				return Http::HTTP_500;	// Internal error
+
 			rsp_size = s - rsp;
 
 			if (cnt == errcnt)		// all writes completed with error
@@ -2084,7 +2356,7 @@ namespace Hap
 				l--;
 			}
 
-			Log("Read: '%.*s' meta %d  perms %d  type %d  ev %d\n", id_length, id, p.meta, p.perms, p.type, p.ev);
+			Dbg("Read: '%.*s' meta %d  perms %d  type %d  ev %d\n", id_length, id, p.meta, p.perms, p.type, p.ev);
 
 			if (id_length == 0)
 				return Http::HTTP_400;	// id mus be present
@@ -2135,7 +2407,7 @@ namespace Hap
 					id_length--;
 					read_aid = true;
 
-					Log("Read: aid %d iid %d\n", p.aid, p.iid);
+					Dbg("Read: aid %d iid %d\n", p.aid, p.iid);
 
 					if (acccnt > 0)
 					{
@@ -31,587 +31,1217 @@ namespace Hap
 	namespace Http
 	{
 
-		const char* ContentTypeJson = "application/hap+json";
-		const char* ContentTypeTlv8 = "application/pairing+tlv8";
-
 		// current pairing session - only one simultaneous pairing is allowed
 		SRP* srp = NULL;					// !NULL = pairing in progress, only one pairing at a time
 		uint8_t srp_shared_secret[64];		// SRP shared secret
 		sid_t srp_owner = sid_invalid;		// session owning the srp
 		uint8_t srp_auth_count = 0;			// auth attempts counter
 
+		// response for 'too many sessions' condition, sent without building it in session buffers
+		static const char Rsp503[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+
+		// Route table
+		//	maps method and path to request handler, each route declares required session security
+		//	and content type which the dispatcher validates before the handler is called
+		enum class Handler : uint8_t
+		{
+			Identify,
+			PairSetup,
+			PairVerify,
+			Pairings,
+			GetAccessories,
+			GetCharacteristics,
+			PutCharacteristics,
+		};
+
+		struct Route
+		{
+			const char* method;
+			const char* path;			// path without query
+			bool query;					// path must be followed by query (path?query)
+			bool secured;				// session must be secured
+			const char* contentType;	// required content type and length, nullptr if not required
+			Handler handler;
+		};
+
+		static constexpr Route routes[] =
+		{
+			{ "POST", "/identify", false, false, nullptr, Handler::Identify },
+			{ "POST", "/pair-setup", false, false, ContentTypeTlv8, Handler::PairSetup },
+			{ "POST", "/pair-verify", false, false, ContentTypeTlv8, Handler::PairVerify },
+			{ "POST", "/pairings", false, true, ContentTypeTlv8, Handler::Pairings },
+			{ "GET", "/accessories", false, true, nullptr, Handler::GetAccessories },
+			{ "GET", "/characteristics", true, true, nullptr, Handler::GetCharacteristics },
+			{ "PUT", "/characteristics", false, true, ContentTypeJson, Handler::PutCharacteristics },
+		};
+
+		static constexpr uint8_t RouteSlots = 16;	// size of route hash table, power of 2
+
+		static constexpr uint16_t routeLen(const char* s)
+		{
+			uint16_t l = 0;
+			while (s[l] != 0)
+				l++;
+			return l;
+		}
+
+		// route hash - first letter of method, last letter and length of path
+		static constexpr uint8_t routeHash(char m, char p, uint16_t len)
+		{
+			return (uint8_t)((m + p + len) & (RouteSlots - 1));
+		}
+
+		static constexpr uint8_t routeHash(const Route& r)
+		{
+			return routeHash(r.method[0], r.path[routeLen(r.path) - 1], routeLen(r.path));
+		}
+
+		// hash table - route index for each slot, 0xFF for empty slot
+		struct RouteTable
+		{
+			uint8_t slot[RouteSlots];
+		};
+
+		static constexpr RouteTable routeTable()
+		{
+			RouteTable t = {};
+			for (uint8_t i = 0; i < RouteSlots; i++)
+				t.slot[i] = 0xFF;
+			for (uint8_t i = 0; i < sizeofarr(routes); i++)
+				t.slot[routeHash(routes[i])] = i;
+			return t;
+		}
+
+		static constexpr bool routeHashPerfect()
+		{
+			for (uint8_t i = 0; i < sizeofarr(routes); i++)
+				for (uint8_t k = i + 1; k < sizeofarr(routes); k++)
+					if (routeHash(routes[i]) == routeHash(routes[k]))
+						return false;
+			return true;
+		}
+
+		static_assert(routeHashPerfect(), "Http: route hash collision, adjust routeHash or RouteSlots");
+
+		static constexpr RouteTable routeSlots = routeTable();
+
+		// find route for method and path, query that follows the path is not part of route
+		static const Route* findRoute(const char* m, size_t mlen, const char* p, size_t plen)
+		{
+			const char* q = (const char*)memchr(p, '?', plen);
+			if (q != nullptr)
+				plen = q - p;
+
+			if (mlen == 0 || plen == 0)
+				return nullptr;
+
+			uint8_t i = routeSlots.slot[routeHash(m[0], p[plen - 1], (uint16_t)plen)];
+			if (i == 0xFF)
+				return nullptr;
+
+			const Route* r = &routes[i];
+			if (strncmp(r->method, m, mlen) != 0 || r->method[mlen] != 0 ||
+				strncmp(r->path, p, plen) != 0 || r->path[plen] != 0 ||
+				r->query != (q != nullptr))
+				return nullptr;
+
+			return r;
+		}
+
+		// Pool
+		bool Pool::Lease(Hap::Buf<char*>& buf, uint16_t size)
+		{
+			uint16_t n = (size + MaxHttpFrame - 1) / MaxHttpFrame;	// chunks needed
+			if (n == 0)
+				return false;
+
+			std::lock_guard<std::mutex> lock(_lock);
+
+			if (n > _free)
+				return false;
+
+			// first fit - find n contiguous free chunks
+			uint16_t run = 0;
+			for (uint16_t i = 0; i < _chunks; i++)
+			{
+				if (_map[i / 32] & (1u << (i % 32)))
+				{
+					run = 0;
+					continue;
+				}
+
+				if (++run < n)
+					continue;
+
+				uint16_t first = i + 1 - n;
+				for (uint16_t k = first; k <= i; k++)
+					_map[k / 32] |= 1u << (k % 32);
+				_free -= n;
+
+				buf = makeBuf(_slab + first * MaxHttpFrame, n * MaxHttpFrame);
+				return true;
+			}
+
+			return false;
+		}
+
+		void Pool::Release(Hap::Buf<char*>& buf)
+		{
+			if (buf.ptr() == nullptr)
+				return;
+
+			uint16_t first = (uint16_t)((buf.ptr() - _slab) / MaxHttpFrame);
+			uint16_t n = (uint16_t)((buf.len() + MaxHttpFrame - 1) / MaxHttpFrame);
+
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+
+				for (uint16_t k = first; k < first + n; k++)
+					_map[k / 32] &= ~(1u << (k % 32));
+				_free += n;
+			}
+
+			buf = makeBuf<char*>(nullptr, 0);
+		}
+
 		// Open
 		//	returns new session ID, 0..sid_max, or sid_invalid
 		sid_t Server::Open()
 		{
-			for (sid_t sid = 0; sid < sizeofarr(_sess); sid++)
+			std::lock_guard<std::mutex> lock(_lock);
+
+			for (sid_t sid = 0; sid <= sid_max; sid++)
 			{
 				if (_sess[sid].isOpen())
 					continue;
 
-				// open session - use same buffers for all sessions
-				_sess[sid].Open(sid, &_buf);
+				// open session - buffers are leased when request arrives
+				_sess[sid].Open(sid);
 
 				// open database
 				_db.Open(sid);
 
 				return sid;
 			}
-
-			return sid_invalid;
+
+			// too many sessions - the overflow slot is shared by all rejected connections
+			//	and never opened, the request is rejected in Process
+			return MaxHttpSessions;
+		}
+
+		// Close
+		//	returns true if opened session was closed
+		bool Server::Close(sid_t sid)
+		{
+			if (sid > sid_max)
+				return false;
+
+			std::lock_guard<std::mutex> lock(_lock);
+
+			if (!_sess[sid].isOpen())
+				return false;
+
+			_db.Close(sid);
+
+			// return buffers of partially received request and outbound queue
+			_sess[sid].Release(_pool);
+			_sess[sid].ReleaseTx(_pool);
+
+			_sess[sid].Close();
+
+			// cancel current pairing if any
+			if (srp != NULL && srp_owner == sid)
+			{
+				SRP_free(srp);
+				srp = NULL;
+				srp_owner = sid_invalid;
+			}
+
+			return true;
+		}
+
+		bool Server::Process(sid_t sid, Recv recv, Send send, SendV sendv)
+		{
+			if (sid > MaxHttpSessions)	// invalid sid
+				return false;
+
+			if (sid == MaxHttpSessions)	// too many sessions
+			{
+				_reject(sid, recv, send);
+				return false;
+			}
+
+			Session* sess = &_sess[sid];
+
+			Dbg("Http::Process Ses %d  secured %d  %s\n", sid, sess->secured, sess->ios ? (sess->ios->perm == Hap::Controller::Admin ? "admin" : "user") : "?");
+
+			// backpressure - do not read more requests until the outbound queue is flushed
+			if (sess->Pending())
+				return true;
+
+			// streamed response is not complete - continue it before next request
+			if (sess->Streaming())
+			{
+				if (!_resume(sess, send, sendv))
+					return false;
+
+				if (sess->Pending())
+					return true;
+			}
+
+			// lease request buffer when the first portion of a request arrives
+			if (!sess->LeaseReq(_pool, _reqSize))
+			{
+				Log("Http: no buffers for Ses %d\n", sid);
+				stats.noBuffers++;
+				_reject(sid, recv, send);
+				return false;
+			}
+
+			// pipelined request may be already buffered, otherwise read whatever is available
+			int rc = 0;
+			if (sess->reqLen > 0 || sess->rxLen > 0)
+				rc = _decrypt(sess) ? _parse(sess) : -1;
+			if (rc == 0)
+				rc = _recv(sess, recv);
+
+			if (rc == 0)	// request incomplete, keep the buffer until more data arrives
+			{
+				// nothing received - do not hold the buffer
+				if (sess->rxLen == 0 && sess->reqLen == 0)
+					sess->Release(_pool);
+				return true;
+			}
+
+			// process all complete requests, responses to pipelined requests are sent in one batch
+			Batch batch;
+			while (rc > 0)
+			{
+				if (!sess->LeaseRsp(_pool, _rspSize))
+				{
+					Log("Http: no buffers for Ses %d response\n", sid);
+					stats.noBuffers++;
+					rc = -1;
+					break;
+				}
+
+				bool secured = sess->secured;
+				bool more = sess->reqLen > sess->req.length();	// pipelined data follows the request
+
+				if (!_process(sess, send, sendv, batch, more))
+				{
+					rc = -1;
+					break;
+				}
+
+				sess->ReleaseRsp(_pool);
+				sess->Next();
+
+				// the data that follows pair verify is encrypted, it must not be buffered as plain text
+				if (sess->secured != secured && sess->reqLen > 0)
+				{
+					Log("Http: Ses %d unexpected data after pair verify\n", sid);
+					rc = -1;
+					break;
+				}
+
+				// outbound queue is not empty - buffered requests are processed after it is flushed
+				if (sess->Pending())
+					break;
+
+				if (!_makeRoom(sess, send, sendv, batch))
+				{
+					rc = -1;
+					break;
+				}
+
+				if (sess->Pending())
+					break;
+
+				rc = _decrypt(sess) ? _parse(sess) : -1;
+			}
+
+			// send responses collected so far, on error just drop them
+			if (rc >= 0 && batch.cnt > 0 && !_sendBatch(sess, send, sendv, batch, nullptr, 0))
+				rc = -1;
+
+			if (rc < 0)
+			{
+				_releaseBatch(batch);
+				sess->Release(_pool);
+				return false;
+			}
+
+			// keep request buffer while pipelined data is buffered
+			if (sess->rxLen == 0 && sess->reqLen == 0)
+				sess->Release(_pool);
+
+			// deliver events that were held while the request was being received
+			if (sess->eventsHeld)
+				Poll(sid, send, sendv);
+
+			return true;
+		}
+
+		// reject request - drain what has arrived and send precomputed 503
+		//	neither session buffers nor DB are touched; secured session gets the 503
+		//	in an encrypted frame built on the stack, the connection is closed afterwards
+		void Server::_reject(sid_t sid, Recv& recv, Send& send)
+		{
+			char tmp[128];
+			int total = 0;
+
+			// read until the socket has no more data (or would block), bounded
+			while (total < MaxHttpFrame)
+			{
+				int l = recv(sid, tmp, sizeof(tmp));
+				if (l <= 0)
+					break;
+
+				total += l;
+
+				if (l < (int)sizeof(tmp))
+					break;
+			}
+
+			stats.rejected++;
+			Dbg("Http: reject Ses %d, %d bytes drained, %d rejected\n", sid, total, (int)stats.rejected);
+
+			if (sid <= sid_max && _sess[sid].secured)
+			{
+				uint8_t frame[sizeof(Rsp503) - 1 + Hap::Crypt::FrameOverhead];
+				uint16_t l = _encrypt(&_sess[sid], frame, (const uint8_t*)Rsp503, sizeof(Rsp503) - 1);
+				send(sid, (char*)frame, l);
+				return;
+			}
+
+			send(sid, (char*)Rsp503, sizeof(Rsp503) - 1);
+		}
+
+		// read and parse next portion of HTTP request
+		//	returns 1 when the request is complete, 0 when more data is needed,
+		//	-1 on error (connection must be closed)
+		int Server::_recv(Session* sess, Recv& recv)
+		{
+			sid_t sid = sess->Sid();
+
+			while (true)
+			{
+				// data is received into request buffer after the data received so far,
+				//	encrypted data is decrypted there in place
+				uint16_t off = sess->reqLen + sess->rxLen;
+				uint8_t* req = (uint8_t*)sess->req.buf() + off;		// where to read next portion of the request
+				uint16_t req_len = sess->req.size() - off;			// space available
+
+				if (req_len == 0)
+				{
+					Log("Http: request is too big\n");
+					return -1;
+				}
+
+				// read next portion of the request
+				int l = recv(sid, (char*)req, req_len);
+				if (l == RecvAgain)	// no more data now
+				{
+					return 0;
+				}
+				if (l < 0)	// read error
+				{
+					Log("Http: Read Error\n");
+					return -1;
+				}
+				if (l == 0)
+				{
+					Log("Http: Read EOF\n");
+					return -1;
+				}
+
+				if (sess->secured)
+				{
+					sess->rxLen += l;
+					if (!_decrypt(sess))
+						return -1;
+				}
+				else
+				{
+					sess->reqLen += l;
+				}
+
+				int rc = _parse(sess);
+				if (rc != 0)
+					return rc;
+
+				// request incomplete - try reading more data
+			}
+		}
+
+		// decrypt complete frames received into request buffer, frames are decrypted in place
+		//	and decrypted data is appended to the request data, so each frame is moved down by
+		//	the length and tag fields of preceding frames; incomplete frame stays after request data
+		//	returns false on decryption error
+		bool Server::_decrypt(Session* sess)
+		{
+			if (!sess->secured)
+				return true;
+
+			uint8_t* b = (uint8_t*)sess->req.buf() + sess->reqLen;	// end of request data
+			uint8_t* f = b;											// next frame
+			uint16_t len = sess->rxLen;
+
+			while (len >= 2)	// wait fot at least two bytes of data length 
+			{
+				uint16_t aad = f[0] + ((uint16_t)(f[1]) << 8);	// data length, also serves as AAD for decryption
+
+				if (aad > MaxHttpBlock)
+				{
+					Log("Http: encrypted block size is too big: %d\n", aad);
+					return false;
+				}
+
+				if (len < aad + Hap::Crypt::FrameOverhead)	// wait for complete encrypted block
+					break;
+
+				// decrypt in place, b is at or below f so the frame tag is not overwritten
+				if (!Hap::Crypt::decryptFrame(b, sess->ControllerToAccessoryKey, sess->recvSeq++, f, aad))
+				{
+					Log("Http: decrypt error\n");
+					return false;
+				}
+
+				sess->reqLen += aad;
+				b += aad;
+				f += aad + Hap::Crypt::FrameOverhead;
+				len -= aad + Hap::Crypt::FrameOverhead;
+			}
+
+			// move incomplete frame next to request data
+			if (f != b && len > 0)
+				memmove(b, f, len);
+			sess->rxLen = len;
+
+			return true;
+		}
+
+		// parse request data received so far
+		//	returns 1 when the request is complete, 0 when more data is needed, -1 on error
+		int Server::_parse(Session* sess)
+		{
+			if (sess->reqLen == 0)
+				return 0;
+
+			auto status = sess->req.parse(sess->reqLen);
+			if (status == sess->req.Error)	// parser error
+			{
+				Log("Http: request parse error\n");
+				return -1;
+			}
+
+			if (status == sess->req.Success)
+				return 1;
+
+			return 0;
+		}
+
+		// process complete HTTP request and send response
+		bool Server::_process(Session* sess, Send& send, SendV& sendv, Batch& batch, bool more)
+		{
+			sid_t sid = sess->Sid();
+			bool secured = sess->secured;
+
+			auto m = sess->req.method();
+			Dbg("Method: '%.*s'\n", m.len(), m.ptr());
+
+			auto p = sess->req.path();
+			Dbg("Path: '%.*s'\n", p.len(), p.ptr());
+
+			for (size_t i = 0; i < sess->req.hdr_count(); i++)
+			{
+				auto n = sess->req.hdr_name(i);
+				auto v = sess->req.hdr_value(i);
+				Dbg("%.*s: '%.*s'\n", n.len(), n.ptr(), v.len(), v.ptr());
+			}
+
+			const Route* r = findRoute(m.ptr(), m.len(), p.ptr(), p.len());
+			if (r == nullptr)
+			{
+				Log("Http: Unknown path %.*s\n", p.len(), p.ptr());
+				sess->rsp.start(HTTP_400);
+				sess->rsp.end();
+			}
+			else if (r->secured && !sess->secured)
+			{
+				Log("Http: Authorization required\n");
+				sess->rsp.start(HTTP_470);
+				sess->rsp.end();
+			}
+			else if (r->contentType != nullptr && !sess->req.hdr(ContentType, r->contentType))
+			{
+				Log("Http: Unknown or missing ContentType\n");
+				sess->rsp.start(HTTP_400);
+				sess->rsp.end();
+			}
+			else if (r->contentType != nullptr && sess->req.contentLength() < 0)
+			{
+				Log("Http: Unknown or missing ContentLength\n");
+				sess->rsp.start(HTTP_400);
+				sess->rsp.end();
+			}
+			else
+			{
+				switch (r->handler)
+				{
+				case Handler::Identify:
+					_identify(sess);
+					break;
+
+				case Handler::PairSetup:
+					_pairSetup(sess);
+					break;
+
+				case Handler::PairVerify:
+					secured = _pairVerify(sess);
+					break;
+
+				case Handler::Pairings:
+					_pairingsMethod(sess);
+					break;
+
+				case Handler::GetAccessories:
+					_getAccessories(sess);
+					break;
+
+				case Handler::GetCharacteristics:
+					_getCharacteristics(sess);
+					break;
+
+				case Handler::PutCharacteristics:
+					_putCharacteristics(sess);
+					break;
+				}
+			}
+
+			// streamed response continues after its first portion
+			if (!_send(sess, send, sendv, batch, more || sess->Streaming()) || !_stream(sess, send, sendv, batch, more))
+				return false;
+
+			sess->secured = secured;
+			Dbg("Http::Process exit Ses %d  secured %d\n", sid, sess->secured);
+
+			return true;
+		}
+
+		// POST /identify
+		void Server::_identify(Session* sess)
+		{
+			std::lock_guard<std::mutex> lock(_lock);
+
+			if (_pairings.Count() == 0)
+			{
+				Log("Http: Exec unpaired identify\n");
+				sess->rsp.start(HTTP_204);
+				sess->rsp.end();
+			}
+			else
+			{
+				Log("Http: Unpaired identify prohibited when paired\n");
+				sess->rsp.start(HTTP_400);
+				sess->rsp.add(ContentType, ContentTypeJson);
+				sess->rsp.end("{\"status\":-70401}");
+			}
+		}
+
+		// POST /pair-setup
+		void Server::_pairSetup(Session* sess)
+		{
+			auto d = sess->req.data();
+
+			sess->tlvi.parse(d.ptr(), d.len());
+			Dbg("PairSetup: TLV item count %d\n", sess->tlvi.count());
+
+			Tlv::State state;
+			if (!sess->tlvi.get(Tlv::Type::State, state))
+			{
+				Log("PairSetup: State not found\n");
+				return;
+			}
+
+			// only one pairing at a time, serialize access to SRP state and pairings
+			std::lock_guard<std::mutex> lock(_lock);
+
+			switch (state)
+			{
+			case Tlv::State::M1:
+				_pairSetup1(sess);
+				break;
+
+			case Tlv::State::M3:
+				_pairSetup3(sess);
+				break;
+
+			case Tlv::State::M5:
+				_pairSetup5(sess);
+				break;
+
+			default:
+				Log("PairSetup: Unknown state %d\n", (int)state);
+			}
+		}
+
+		// POST /pair-verify
+		//	returns session secured state after the response is sent
+		bool Server::_pairVerify(Session* sess)
+		{
+			auto d = sess->req.data();
+
+			sess->tlvi.parse(d.ptr(), d.len());
+			Dbg("PairVerify: TLV item count %d\n", sess->tlvi.count());
+
+			Tlv::State state;
+			if (!sess->tlvi.get(Tlv::Type::State, state))
+			{
+				Log("PairVerify: State not found\n");
+				return sess->secured;
+			}
+
+			switch (state)
+			{
+			case Tlv::State::M1:
+				_pairVerify1(sess);
+				break;
+
+			case Tlv::State::M3:
+				{
+					std::lock_guard<std::mutex> lock(_lock);
+					_pairVerify3(sess);
+					return sess->ios != nullptr;
+				}
+
+			default:
+				Log("PairVerify: Unknown state %d\n", (int)state);
+			}
+
+			return sess->secured;
+		}
+
+		// POST /pairings
+		void Server::_pairingsMethod(Session* sess)
+		{
+			auto d = sess->req.data();
+
+			sess->tlvi.parse(d.ptr(), d.len());
+			Dbg("Pairings: TLV item count %d\n", sess->tlvi.count());
+
+			Tlv::State state;
+			if (!sess->tlvi.get(Tlv::Type::State, state))
+			{
+				Log("Pairings: State not found\n");
+				sess->rsp.start(HTTP_400);
+				sess->rsp.end();
+				return;
+			}
+
+			if (state != Tlv::State::M1)
+			{
+				Log("Pairings: Invalid State\n");
+				sess->rsp.start(HTTP_400);
+				sess->rsp.end();
+				return;
+			}
+
+			Tlv::Method method;
+			if (!sess->tlvi.get(Tlv::Type::Method, method))
+			{
+				Log("Pairings: Method not found\n");
+				sess->rsp.start(HTTP_400);
+				sess->rsp.end();
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(_lock);
+
+			switch (method)
+			{
+			case Tlv::Method::AddPairing:
+				_pairingAdd(sess);
+				break;
+
+			case Tlv::Method::RemovePairing:
+				_pairingRemove(sess);
+				break;
+
+			case Tlv::Method::ListPairing:
+				_pairingList(sess);
+				break;
+
+			default:
+				Log("Pairings: Unknown method\n");
+				sess->rsp.start(HTTP_400);
+				sess->rsp.end();
+			}
+		}
+
+		// GET /accessories
+		//	the first portion is serialized as a chunk of whole accessories, when it turns out
+		//	to hold the whole database it is sent with Content-Length instead,
+		//	otherwise the rest is streamed in chunks; the database is serialized once
+		void Server::_getAccessories(Session* sess)
+		{
+			sess->rsp.start(HTTP_200);
+			sess->rsp.add(ContentType, ContentTypeJson);
+			sess->rsp.add(TransferEncoding, "chunked");
+			sess->rsp.end();
+
+			sess->dbPos = 0;
+			char* db = sess->rsp.chunkData();
+			int len;
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				len = _db.getDb(sess->Sid(), db, sess->rsp.chunkSize(), sess->dbPos);
+			}
+
+			if (len < 0)
+			{
+				Log("Http: Ses %d accessory does not fit into response buffer\n", sess->Sid());
+				sess->dbPos = 0;
+				sess->rsp.start(HTTP_500);
+				sess->rsp.end();
+				return;
+			}
+
+			Dbg("Db: '%.*s'\n", len, db);
+
+			if (sess->Streaming())
+			{
+				sess->rsp.chunk((uint16_t)len, false);
+				return;
+			}
+
+			// Content-Length headers are shorter than the chunked ones and the chunk size line,
+			//	the data moves towards them
+			sess->rsp.start(HTTP_200);
+			sess->rsp.add(ContentType, ContentTypeJson);
+			sess->rsp.add(ContentLength, 0);
+			sess->rsp.end();
+
+			memmove(sess->rsp.data(), db, len);
+			sess->rsp.setContentLength((uint16_t)len);
+		}
+
+		// serialize next chunk of streamed GET /accessories response into rsp
+		bool Server::_getAccessoriesChunk(Session* sess)
+		{
+			int len;
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				len = _db.getDb(sess->Sid(), sess->rsp.chunkData(), sess->rsp.chunkSize(), sess->dbPos);
+			}
+
+			if (len < 0)
+			{
+				Log("Http: Ses %d accessory does not fit into response buffer\n", sess->Sid());
+				sess->dbPos = 0;
+				return false;
+			}
+
+			Dbg("Db: '%.*s'\n", len, sess->rsp.chunkData());
+
+			return sess->rsp.chunk((uint16_t)len, !sess->Streaming());
+		}
+
+		// GET /characteristics?query
+		void Server::_getCharacteristics(Session* sess)
+		{
+			auto p = sess->req.path();
+			const char* q = (const char*)memchr(p.ptr(), '?', p.len()) + 1;
+
+			int len = sess->sizeofdata();
+			Status status;
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				status = _db.Read(sess->Sid(), q, int(p.ptr() + p.len() - q), (char*)sess->data(), len);
+			}
+
+			Dbg("Read: Status %d  '%.*s'\n", status, len, sess->data());
+
+			sess->rsp.start(status);
+			if (len > 0)
+			{
+				sess->rsp.add(ContentType, ContentTypeJson);
+				sess->rsp.end((const char*)sess->data(), len);
+			}
+			else
+			{
+				sess->rsp.end();
+			}
 		}
 
-		// Close
-		//	returns true if opened session was closed
-		bool Server::Close(sid_t sid)
+		// PUT /characteristics
+		void Server::_putCharacteristics(Session* sess)
 		{
-			if (sid > sid_max)
-				return false;
+			auto d = sess->req.data();
 
-			if (!_sess[sid].isOpen())
-				return false;
+			Dbg("Http: %.*s\n", d.len(), d.ptr());
 
-			_db.Close(sid);
+			int len = sess->sizeofdata();
+			Status status;
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				status = _db.Write(sess->Sid(), (const char*)d.ptr(), d.len(), (char*)sess->data(), len);
+			}
 
-			_sess[sid].Close();
+			Dbg("Write: Status %d  '%.*s'\n", status, len, sess->data());
 
-			// cancel current pairing if any
-			if (srp != NULL && srp_owner == sid)
+			sess->rsp.start(status);
+			if (len > 0)
 			{
-				SRP_free(srp);
-				srp = NULL;
-				srp_owner = sid_invalid;
+				sess->rsp.add(ContentType, ContentTypeJson);
+				sess->rsp.end((const char*)sess->data(), len);
+			}
+			else
+			{
+				sess->rsp.end();
 			}
-
-			return true;
 		}
 
-		bool Server::Process(sid_t sid, Recv recv, Send send)
+		void Server::Poll(sid_t sid, Send send, SendV sendv)
 		{
-			if (sid > MaxHttpSessions)	// invalid sid
-				return false;
+			if (sid > sid_max)
+				return;
 
 			Session* sess = &_sess[sid];
-			bool secured = sess->secured;
-
-			Log("Http::Process Ses %d  secured %d  %s\n", sid, sess->secured, sess->ios ? (sess->ios->perm == Hap::Controller::Admin ? "admin" : "user") : "?");
+			if (!sess->secured)
+				return;
 
-			if (sid == MaxHttpSessions)	// too many sessions
+			// request is being received or previous message is not sent yet - hold events,
+			//	pending DB events are coalesced until then so only latest values are sent
+			if (sess->Receiving() || sess->Pending() || sess->Streaming())
 			{
-				// TODO: read request, create error response
-				send(sid, sess->rsp.buf(), sess->rsp.len());
-				return false;
+				sess->eventsHeld = true;
+				return;
 			}
 
-			// prepare for request parsing
-			sess->Init();
+			sess->eventsHeld = false;
 
-			// read and parse the HTTP request
-			uint16_t len = 0;		// total len of valid data received so far
-			uint16_t http_len;		// length of http request
-			while (true)
+			if (!sess->LeaseRsp(_pool, _rspSize))
 			{
-				uint8_t* req = sess->data() + len;
-				uint16_t req_len = sess->sizeofdata() - len;
-				
-				// read next portion of the request
-				int l = recv(sid, (char*)req, req_len);
-				if (l < 0)	// read error
-				{
-					Log("Http: Read Error\n");
-					return false;
-				}
-				if (l == 0)
-				{
-					Log("Http: Read EOF\n");
-					return false;
-				}
+				Log("Http: no buffers for Ses %d events\n", sid);
+				return;
+			}
 
-				len += l;
+			_poll(sess, send, sendv);
 
-				if (sess->secured)
-				{
-					// it session is secured, decrypt the block - when the whole block is received
-					//	max length of http data that can be processed is defined by MaxHttpFrame/MaxHttpBlock
+			sess->Release(_pool);
+		}
 
-					if (len < 2)	// wait fot at least two bytes of data length 
-						continue;
-					
-					uint8_t *p = sess->data();
-					uint16_t aad = p[0] + ((uint16_t)(p[1]) << 8);	// data length, also serves as AAD for decryption
+		void Server::_poll(Session* sess, Send& send, SendV& sendv)
+		{
+			sid_t sid = sess->Sid();
 
-					if (aad > MaxHttpBlock)
-					{
-						Log("Http: encrypted block size is too big: %d\n", aad);
-						return false;
-					}
+			int len = sess->sizeofdata();
+			Status status;
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				status = _db.getEvents(sid, (char*)sess->data(), len);
+			}
 
-					if (len < 2 + aad + 16)	// wait for complete encrypted block
-						continue;
+			if (status != Http::Status::HTTP_200)
+				return;
 
-					// make 96-bit nonce from receive sequential number
-					uint8_t nonce[12];
-					memset(nonce, 0, sizeof(nonce));
-					memcpy(nonce + 4, &sess->recvSeq, 8);
+			if (len == 0)
+				return;
 
-					// decrypt into request buffer
-					uint8_t* b = (uint8_t*)sess->req.buf();
+			Dbg("Events: sid %d  '%.*s'\n", sid, len, sess->data());
 
-					Hap::Crypt::aead(Hap::Crypt::Decrypt,
-						b, b + aad,							// output data and tag positions
-						sess->ControllerToAccessoryKey,		// decryption key
-						nonce,
-						p + 2, aad,							// encrypted data
-						p, 2								// aad
-					);
+			sess->rsp.event(status);
+			sess->rsp.add(ContentType, ContentTypeJson);
+			sess->rsp.end((const char*)sess->data(), len);
 
-					sess->recvSeq++;
+			Batch batch;
+			_send(sess, send, sendv, batch, false);
+		}
 
-					// compare passed in and calculated tags
-					if (memcmp(b + aad, p + 2 + aad, 16) != 0)
-					{
-						Log("Http: decrypt error\n");
-						return false;
-					}
+		bool Server::Flush(sid_t sid, Send send)
+		{
+			if (sid > sid_max)
+				return false;
 
-					http_len = aad;
-				}
-				else
-				{
-					// otherwise copy received data into request buffer as is
-					memcpy(sess->req.buf(), sess->data(), len);
+			Session* sess = &_sess[sid];
+			if (!sess->Pending())
+				return true;
 
-					http_len = len;
-				}
+			int rc = send(sid, sess->txData() + sess->txOff, sess->txLen - sess->txOff);
+			if (rc == SendAgain)
+				return true;
 
-				// try parsing HTTP request
-				auto status = sess->req.parse(http_len);
-				if (status == sess->req.Error)	// parser error
-				{
-					// TODO: make response Internal server error
-					send(sid, sess->rsp.buf(), sess->rsp.len());
-					return false;
-				}
+			if (rc < 0)
+			{
+				Log("Http: Ses %d send error\n", sid);
+				return false;
+			}
 
-				if (status == sess->req.Success)
-					// request parsed, stop reading 
-					break;
+			sess->txOff += rc;
+			if (!sess->Pending())
+				sess->ReleaseTx(_pool);
 
-				if (sess->secured)
-				{
-					// if session is sequred then whole request must fit into single frame
-					// TODO: support multiple frames
-					Log("Http: request doesn not fit into single frame\n");
-					return false;
-				}
+			return true;
+		}
 
-				// request incomplete - try reading more data
-			}
+		bool Server::Pending(sid_t sid)
+		{
+			if (sid > sid_max)
+				return false;
 
-			auto m = sess->req.method();
-			Log("Method: '%.*s'\n", m.len(), m.ptr());
+			return _sess[sid].Pending();
+		}
 
-			auto p = sess->req.path();
-			Log("Path: '%.*s'\n", p.len(), p.ptr());
+		// encrypt one frame of response data into b, returns frame length
+		uint16_t Server::_encrypt(Session* sess, uint8_t* b, const uint8_t* p, uint16_t len)
+		{
+			if (len > MaxHttpBlock)
+				len = MaxHttpBlock;
 
-			auto d = sess->req.data();
+			return Hap::Crypt::encryptFrame(b, sess->AccessoryToControllerKey, sess->sendSeq++, p, len);
+		}
 
-			for (size_t i = 0; i < sess->req.hdr_count(); i++)
+		// transport did not take whole batch - queue what was not sent and the rest of the response
+		bool Server::_spill(Session* sess, const Hap::Buf<char*>* frame, uint8_t cnt, int rc, const uint8_t* p, uint16_t len)
+		{
+			if (rc < 0 && rc != SendAgain)
 			{
-				auto n = sess->req.hdr_name(i);
-				auto v = sess->req.hdr_value(i);
-				Log("%.*s: '%.*s'\n", n.len(), n.ptr(), v.len(), v.ptr());
+				Log("Http: Ses %d send error\n", sess->Sid());
+				return false;
 			}
 
-			if (m.len() == 4 && strncmp(m.ptr(), "POST", 4) == 0)
-			{
-				// POST
-				//		/identify
-				//		/pair-setup
-				//		/pair-verify
-				//		/pairings
+			size_t sent = rc > 0 ? rc : 0;
+			size_t size = (len + MaxHttpBlock - 1) / MaxHttpBlock * (MaxHttpFrame - MaxHttpBlock) + len;
+			for (uint8_t i = 0; i < cnt; i++)
+				size += frame[i].len();
 
-				if (p.len() == 9 && strncmp(p.ptr(), "/identify", 9) == 0)
-				{
-					if (_pairings.Count() == 0)
-					{
-						Log("Http: Exec unpaired identify\n");
-						sess->rsp.start(HTTP_204);
-						sess->rsp.end();
-					}
-					else
-					{
-						Log("Http: Unpaired identify prohibited when paired\n");
-						sess->rsp.start(HTTP_400);
-						sess->rsp.add(ContentType, ContentTypeJson);
-						sess->rsp.end("{\"status\":-70401}");
-					}
-				}
-				else if (p.len() == 11 && strncmp(p.ptr(), "/pair-setup", 11) == 0)
-				{
-					int len;
-					if (!sess->req.hdr(ContentType, ContentTypeTlv8))
-					{
-						Log("Http: Unknown or missing ContentType\n");
-						sess->rsp.start(HTTP_400);
-						sess->rsp.end();
-					}
-					else if (!sess->req.hdr(ContentLength, len))
-					{
-						Log("Http: Unknown or missing ContentLength\n");
-						sess->rsp.start(HTTP_400);
-						sess->rsp.end();
-					}
-					else
-					{
-						sess->tlvi.parse(d.ptr(), d.len());
-						Log("PairSetup: TLV item count %d\n", sess->tlvi.count());
-
-						Tlv::State state;
-						if (!sess->tlvi.get(Tlv::Type::State, state))
-						{
-							Log("PairSetup: State not found\n");
-						}
-						else
-						{
-							switch (state)
-							{
-							case Tlv::State::M1:
-								_pairSetup1(sess);
-								break;
-
-							case Tlv::State::M3:
-								_pairSetup3(sess);
-								break;
-
-							case Tlv::State::M5:
-								_pairSetup5(sess);
-								break;
-
-							default:
-								Log("PairSetup: Unknown state %d\n", (int)state);
-							}
-						}
-					}
-				}
-				else if (p.len() == 12 && strncmp(p.ptr(), "/pair-verify", 12) == 0)
-				{
-					int len;
-					if (!sess->req.hdr(ContentType, ContentTypeTlv8))
-					{
-						Log("Http: Unknown or missing ContentType\n");
-						sess->rsp.start(HTTP_400);
-						sess->rsp.end();
-					}
-					else if (!sess->req.hdr(ContentLength, len))
-					{
-						Log("Http: Unknown or missing ContentLength\n");
-						sess->rsp.start(HTTP_400);
-						sess->rsp.end();
-					}
-					else
-					{
-						sess->tlvi.parse(d.ptr(), d.len());
-						Log("PairVerify: TLV item count %d\n", sess->tlvi.count());
-
-						Tlv::State state;
-						if (!sess->tlvi.get(Tlv::Type::State, state))
-						{
-							Log("PairVerify: State not found\n");
-						}
-						else
-						{
-							switch (state)
-							{
-							case Tlv::State::M1:
-								_pairVerify1(sess);
-								break;
-
-							case Tlv::State::M3:
-								_pairVerify3(sess);
-								secured = sess->ios != nullptr;
-								break;
-
-							default:
-								Log("PairVerify: Unknown state %d\n", (int)state);
-							}
-						}
-					}
-				}
-				else if (p.len() == 9 && strncmp(p.ptr(), "/pairings", 9) == 0)
-				{
-					int len;
-					if (!sess->secured)
-					{
-						Log("Http: Authorization required\n");
-						sess->rsp.start(HTTP_470);
-						sess->rsp.end();
-					}
-					else if (!sess->req.hdr(ContentType, ContentTypeTlv8))
-					{
-						Log("Http: Unknown or missing ContentType\n");
-						sess->rsp.start(HTTP_400);
-						sess->rsp.end();
-					}
-					else if (!sess->req.hdr(ContentLength, len))
-					{
-						Log("Http: Unknown or missing ContentLength\n");
-						sess->rsp.start(HTTP_400);
-						sess->rsp.end();
-					}
-					else
-					{
-						sess->tlvi.parse(d.ptr(), d.len());
-						Log("Pairings: TLV item count %d\n", sess->tlvi.count());
-
-						Tlv::State state;
-						if (!sess->tlvi.get(Tlv::Type::State, state))
-						{
-							Log("Pairings: State not found\n");
-							sess->rsp.start(HTTP_400);
-							sess->rsp.end();
-						}
-						else
-						{
-							if(state != Tlv::State::M1)
-							{
-								Log("Pairings: Invalid State\n");
-								sess->rsp.start(HTTP_400);
-								sess->rsp.end();
-							}
-							else
-							{
-								Tlv::Method method;
-								if (!sess->tlvi.get(Tlv::Type::Method, method))
-								{
-									Log("Pairings: Method not found\n");
-									sess->rsp.start(HTTP_400);
-									sess->rsp.end();
-								}
-								else
-								{
-									switch (method)
-									{
-									case Tlv::Method::AddPairing:
-										_pairingAdd(sess);
-										break;
-
-									case Tlv::Method::RemovePairing:
-										_pairingRemove(sess);
-										break;
-
-									case Tlv::Method::ListPairing:
-										_pairingList(sess);
-										break;
-
-									default:
-										Log("Pairings: Unknown method\n");
-										sess->rsp.start(HTTP_400);
-										sess->rsp.end();
-									}
-								}
-							}
-						}
-					}
-				}
-				else
-				{
-					Log("Http: Unknown path %.*s\n", p.len(), p.ptr());
-					sess->rsp.start(HTTP_400);
-					sess->rsp.end();
-				}
+			if (!sess->LeaseTx(_pool, (uint16_t)(size - sent)))
+			{
+				Log("Http: no buffers for Ses %d outbound queue\n", sess->Sid());
+				stats.noBuffers++;
+				return false;
 			}
-			else if (m.len() == 3 && strncmp(m.ptr(), "GET", 3) == 0)
+
+			char* q = sess->txData();
+
+			for (uint8_t i = 0; i < cnt; i++)
 			{
-				// GET
-				//		/accessories
-				//		/characteristics
-				if (!sess->secured)
+				if (sent >= frame[i].len())
 				{
-					Log("Http: Authorization required\n");
-					sess->rsp.start(HTTP_470);
-					sess->rsp.end();
+					sent -= frame[i].len();
+					continue;
 				}
-				else if (p.len() == 12 && strncmp(p.ptr(), "/accessories", 12) == 0)
-				{
-					sess->rsp.start(HTTP_200);
-					sess->rsp.add(ContentType, ContentTypeJson);
-					sess->rsp.add(ContentLength, 0);
-					sess->rsp.end();
 
-					int len = _db.getDb(sess->Sid(), sess->rsp.data(), sess->rsp.size());
+				size_t l = frame[i].len() - sent;
+				memcpy(q, frame[i].ptr() + sent, l);
+				q += l;
+				sent = 0;
+			}
 
-					Log("Db: '%.*s'\n", len, sess->rsp.data());
+			while (len > 0)
+			{
+				uint16_t l = _encrypt(sess, (uint8_t*)q, p, len);
+				len -= l - Hap::Crypt::FrameOverhead;
+				p += l - Hap::Crypt::FrameOverhead;
+				q += l;
+			}
 
-					sess->rsp.setContentLength(len);
-				}
-				else if(strncmp(p.ptr(), "/characteristics?", 17) == 0)
-				{
+			sess->txLen = (uint16_t)(q - sess->txData());
+			sess->txOff = 0;
 
-					int len = sess->sizeofdata();
-					auto status = _db.Read(sess->Sid(), p.ptr() + 17, p.len() - 17, (char*)sess->data(), len);
+			Dbg("Http: Ses %d queued %d bytes\n", sess->Sid(), sess->txLen);
 
-					Log("Read: Status %d  '%.*s'\n", status, len, sess->data());
+			return true;
+		}
 
-					sess->rsp.start(status);
-					if (len > 0)
-					{
-						sess->rsp.add(ContentType, ContentTypeJson);
-						sess->rsp.end((const char*)sess->data(), len);
-					}
-					else
-					{
-						sess->rsp.end();
-					}
-				}
-				else
+		// send response
+		//	encrypted frames are collected in the batch and sent with one vectored call
+		//	when the batch is full or there are no more responses to send (more is false)
+		bool Server::_send(Session* sess, Send& send, SendV& sendv, Batch& batch, bool more)
+		{
+			const uint8_t *p = (uint8_t*)sess->rsp.buf();
+			uint16_t len = sess->rsp.len();				// data length
+
+			if (sess->secured)
+			{
+				// without sendv each frame is sent separately
+				if (sendv == nullptr)
+					more = false;
+
+				// single-frame response that is sent right away is encrypted in place,
+				//	frame length goes into response headroom, tag after the response
+				if (!more && len <= MaxHttpBlock && (batch.cnt < MaxSendFrames && (batch.cnt == 0 || sendv != nullptr)) &&
+					sess->rsp.headroom() >= 2 && sess->rsp.size() >= Hap::Crypt::TagSize)
 				{
-					Log("Http: Unknown path %.*s\n", p.len(), p.ptr());
-					sess->rsp.start(HTTP_400);
-					sess->rsp.end();
+					uint8_t* b = (uint8_t*)p - 2;
+					uint16_t l = _encrypt(sess, b, p, len);
+
+					batch.leased[batch.cnt] = false;
+					batch.frame[batch.cnt++] = makeBuf((char*)b, l);
+					batch.total += l;
+
+					return _sendBatch(sess, send, sendv, batch, nullptr, 0);
 				}
-			}
-			else if (m.len() == 3 && strncmp(m.ptr(), "PUT", 3) == 0)
-			{
-				// PUT
-				//		/characteristics
-				if (p.len() == 16 && strncmp(p.ptr(), "/characteristics", 16) == 0)
+
+				// frames are encrypted into sess->data or chunks leased from the pool,
+				//	sess->data can only hold the first frame of last response in the batch
+				while (len > 0)
 				{
-					int len;
-					if (!sess->secured)
-					{
-						Log("Http: Authorization required\n");
-						sess->rsp.start(HTTP_470);
-						sess->rsp.end();
-					}
-					else if (!sess->req.hdr(ContentType, ContentTypeJson))
+					uint8_t* b = nullptr;
+					bool leased = false;
+
+					if (batch.cnt == MaxSendFrames || (batch.cnt > 0 && sendv == nullptr))
+						;
+					else if (batch.cnt == 0 && !more)
+						b = sess->data();		// must be >= MaxHttpFrame
+					else if (_pool.Lease(batch.frame[batch.cnt], MaxHttpFrame))
 					{
-						Log("Http: Unknown or missing ContentType\n");
-						sess->rsp.start(HTTP_400);
-						sess->rsp.end();
+						b = (uint8_t*)batch.frame[batch.cnt].ptr();
+						leased = true;
 					}
-					else if (!sess->req.hdr(ContentLength, len))
+					else if (batch.cnt == 0)
 					{
-						Log("Http: Unknown or missing ContentLength\n");
-						sess->rsp.start(HTTP_400);
-						sess->rsp.end();
+						b = sess->data();
+						more = false;
 					}
-					else
+
+					// batch is full or no buffers - send what is collected
+					if (b == nullptr)
 					{
-						Log("Http: %.*s\n", d.len(), d.ptr());
-
-						int len = sess->sizeofdata();
-						auto status = _db.Write(sess->Sid(), (const char*)d.ptr(), d.len(), (char*)sess->data(), len);
-
-						Log("Write: Status %d  '%.*s'\n", status, len, sess->data());
-
-						sess->rsp.start(status);
-						if (len > 0)
-						{
-							sess->rsp.add(ContentType, ContentTypeJson);
-							sess->rsp.end((const char*)sess->data(), len);
-						}
-						else
-						{
-							sess->rsp.end();
-						}
+						if (!_sendBatch(sess, send, sendv, batch, p, len))
+							return false;
+
+						if (sess->Pending())	// rest of the response is queued
+							return true;
+
+						continue;
 					}
+
+					uint16_t l = _encrypt(sess, b, p, len);
+
+					batch.leased[batch.cnt] = leased;
+					batch.frame[batch.cnt++] = makeBuf((char*)b, l);
+					batch.total += l;
+
+					len -= l - Hap::Crypt::FrameOverhead;
+					p += l - Hap::Crypt::FrameOverhead;
 				}
-				else
+
+				if (!more && batch.cnt > 0)
+					return _sendBatch(sess, send, sendv, batch, nullptr, 0);
+			}
+			else
+			{
+				//send response as is
+				int rc = send(sess->Sid(), (char*)p, len);
+				if (rc != len)
 				{
-					Log("Http: Unknown path %.*s\n", p.len(), p.ptr());
-					sess->rsp.start(HTTP_400);
-					sess->rsp.end();
+					Hap::Buf<char*> frame = makeBuf((char*)p, len);
+					return _spill(sess, &frame, 1, rc, nullptr, 0);
 				}
 			}
 
-			if (!_send(sess, send))
-				return false;
-
-			sess->secured = secured;
-			Log("Http::Process exit Ses %d  secured %d\n", sid, sess->secured);
-
 			return true;
 		}
 
-		void Server::Poll(sid_t sid, Send send)
+		// send the rest of streamed response portion by portion,
+		//	stops when the outbound queue is not empty, Process resumes it after the queue is flushed
+		bool Server::_stream(Session* sess, Send& send, SendV& sendv, Batch& batch, bool more)
 		{
-			Session* sess = &_sess[sid];
-			if (!sess->secured)
-				return;
-
-			int len = sess->sizeofdata();
-			auto status = _db.getEvents(sid, (char*)sess->data(), len);
+			while (sess->Streaming() && !sess->Pending())
+			{
+				if (!_makeRoom(sess, send, sendv, batch))
+					return false;
 
-			if (status != Http::Status::HTTP_200)
-				return;
+				if (sess->Pending())
+					break;
 
-			if (len == 0)
-				return;
+				sess->ContinueRsp();
 
-			Log("Events: sid %d  '%.*s'\n", sid, len, sess->data());
+				if (!_getAccessoriesChunk(sess))
+					return false;
 
-			sess->rsp.event(status);
-			sess->rsp.add(ContentType, ContentTypeJson);
-			sess->rsp.end((const char*)sess->data(), len);
+				if (!_send(sess, send, sendv, batch, more || sess->Streaming()))
+					return false;
+			}
 
-			_send(sess, send);
+			return true;
 		}
 
-		bool Server::_send(Session* sess, Send& send)
+		// continue streamed response when the outbound queue is flushed
+		bool Server::_resume(Session* sess, Send& send, SendV& sendv)
 		{
-			if (sess->secured)
+			if (!sess->LeaseRsp(_pool, _rspSize))
 			{
-				// session secured - encrypt data
-				const uint8_t *p = (uint8_t*)sess->rsp.buf();
-				uint16_t len = sess->rsp.len();				// data length
-				
-				while (len > 0)
-				{
-					uint16_t aad = len;		// block length, and AAD for encryption
+				Log("Http: no buffers for Ses %d response\n", sess->Sid());
+				stats.noBuffers++;
+				sess->Release(_pool);
+				return false;
+			}
+
+			Batch batch;
+			if (!_stream(sess, send, sendv, batch, false))
+			{
+				_releaseBatch(batch);
+				sess->Release(_pool);
+				return false;
+			}
+
+			sess->ReleaseRsp(_pool);
+
+			// keep request buffer while pipelined data is buffered
+			if (sess->rxLen == 0 && sess->reqLen == 0)
+				sess->Release(_pool);
 
-					if (aad > MaxHttpBlock)
-						aad = MaxHttpBlock;
+			return true;
+		}
 
-					// make 96-bit nonce from send sequential number
-					uint8_t nonce[12];
-					memset(nonce, 0, sizeof(nonce));
-					memcpy(nonce + 4, &sess->sendSeq, 8);
+		// send encrypted frames collected in the batch,
+		//	if transport does not take whole batch, the rest and response data (p, len) are queued
+		bool Server::_sendBatch(Session* sess, Send& send, SendV& sendv, Batch& batch, const uint8_t* p, uint16_t len)
+		{
+			int rc;
+			if (sendv != nullptr)
+				rc = sendv(sess->Sid(), batch.frame, batch.cnt);
+			else
+				rc = send(sess->Sid(), batch.frame[0].ptr(), (uint16_t)batch.frame[0].len());
 
-					// encrypt into sess->data buffer which must be >= MaxHttpFrame
-					uint8_t* b = sess->data();
+			bool ok = true;
+			if (rc != batch.total)
+				ok = _spill(sess, batch.frame, batch.cnt, rc, p, len);
 
-					// copy data length into output buffer
-					b[0] = aad & 0xFF;
-					b[1] = (aad >> 8) & 0xFF;
+			_releaseBatch(batch);
 
-					Hap::Crypt::aead(Hap::Crypt::Encrypt,
-						b + 2, b + 2 + aad,					// output data and tag positions
-						sess->AccessoryToControllerKey,		// encryption key
-						nonce,
-						p, aad,								// data to encrypt
-						b, 2								// aad
-					);
+			return ok;
+		}
 
-					sess->sendSeq++;
+		// send the batch before next response when the transport might not take both
+		//	and the rest would not fit into the outbound queue (QueueChunks)
+		bool Server::_makeRoom(Session* sess, Send& send, SendV& sendv, Batch& batch)
+		{
+			if (batch.cnt == 0 || batch.total + Encrypted(_rspSize) <= QueueChunks(_rspSize) * MaxHttpFrame)
+				return true;
 
-					// send encrypted block
-					send(sess->Sid(), (char*)b, 2 + aad + 16);
+			return _sendBatch(sess, send, sendv, batch, nullptr, 0);
+		}
 
-					len -= aad;
-					p += aad;
-				}
-			}
-			else
+		// return frames leased for the batch to the pool
+		void Server::_releaseBatch(Batch& batch)
+		{
+			for (uint8_t i = 0; i < batch.cnt; i++)
 			{
-				//send response as is
-				send(sess->Sid(), sess->rsp.buf(), sess->rsp.len());
+				if (batch.leased[i])
+					_pool.Release(batch.frame[i]);
+				else
+					batch.frame[i] = makeBuf<char*>(nullptr, 0);
 			}
 
-			return true;
+			batch.cnt = 0;
+			batch.total = 0;
 		}
 
-
 		void Server::_pairSetup1(Session* sess)
 		{
 			int rc;
@@ -684,7 +1314,7 @@ namespace Hap
 				goto RetErr;
 			}
 
-			Hex("Username", srp->username->data, srp->username->length);
+			DbgHex("Username", srp->username->data, srp->username->length);
 
 			uint8_t salt[16];
 			t_random(salt, 16);
@@ -699,9 +1329,9 @@ namespace Hap
 				goto RetErr;
 			}
 
-			Hex("Modulus", srp_modulus, sizeof_srp_modulus);
-			Hex("Generator", srp_generator, sizeof_srp_generator);
-			Hex("Salt", salt, sizeof(salt));
+			DbgHex("Modulus", srp_modulus, sizeof_srp_modulus);
+			DbgHex("Generator", srp_generator, sizeof_srp_generator);
+			DbgHex("Salt", salt, sizeof(salt));
 
 			rc = SRP_set_auth_password(srp, Hap::config->setupCode);
 			if (rc != SRP_SUCCESS)
@@ -710,7 +1340,7 @@ namespace Hap
 				goto RetErr;
 			}
 
-			Hex("Username", Hap::config->setupCode, strlen(Hap::config->setupCode));
+			DbgHex("Username", Hap::config->setupCode, strlen(Hap::config->setupCode));
 
 			rc = SRP_gen_pub(srp, &pub);
 			if (rc != SRP_SUCCESS)
@@ -719,7 +1349,7 @@ namespace Hap
 				goto RetErr;
 			}
 
-			Hex("ServerKey", pub->data, pub->length);
+			DbgHex("ServerKey", pub->data, pub->length);
 
 			sess->tlvo.add(Hap::Tlv::Type::PublicKey, pub->data, (uint16_t)pub->length);
 			sess->tlvo.add(Hap::Tlv::Type::Salt, salt, sizeof(salt));
@@ -779,7 +1409,7 @@ namespace Hap
 				goto RetErr;
 			}
 
-			Hex("iosKey", iosKey, iosKey_size);
+			DbgHex("iosKey", iosKey, iosKey_size);
 
 			size = iosProof_size;
 			if (!sess->tlvi.get(Tlv::Type::Proof, iosProof, iosProof_size))
@@ -788,7 +1418,7 @@ namespace Hap
 				goto RetErr;
 			}
 
-			Hex("iosProof", iosProof, iosProof_size);
+			DbgHex("iosProof", iosProof, iosProof_size);
 
 			rc = SRP_compute_key(srp, &key, iosKey, iosKey_size);
 			if (rc != SRP_SUCCESS)
@@ -800,12 +1430,12 @@ namespace Hap
 			memcpy(srp_shared_secret, key->data, key->length);
 
 			Hap::Crypt::hkdf(
-				(const uint8_t*)"Pair-Setup-Encrypt-Salt", sizeof("Pair-Setup-Encrypt-Salt") - 1,
+				Hap::Crypt::PairSetupEncryptSalt,
 				srp_shared_secret, sizeof(srp_shared_secret),
 				(const uint8_t*)"Pair-Setup-Encrypt-Info", sizeof("Pair-Setup-Encrypt-Info") - 1,
 				sess->key, sizeof(sess->key));
 
-			Hex("SessKey", sess->key, sizeof(sess->key));
+			DbgHex("SessKey", sess->key, sizeof(sess->key));
 
 			rc = SRP_verify(srp, iosProof, size);
 			if (rc != SRP_SUCCESS)
@@ -822,7 +1452,7 @@ namespace Hap
 				goto RetErr;
 			}
 
-			Hex("Response", rsp->data, rsp->length);
+			DbgHex("Response", rsp->data, rsp->length);
 
 			sess->tlvo.add(Hap::Tlv::Type::Proof, rsp->data, (uint16_t)rsp->length);
 
@@ -852,7 +1482,6 @@ namespace Hap
 			uint8_t* iosEncrypted;	// encrypted tata from iOS with tag attached
 			uint8_t* iosTag;		// pointer to iOS tag
 			uint8_t* iosTlv;		// decrypted TLV
-			uint8_t* srvTag;		// calculated tag
 			uint16_t iosTlv_size;
 
 			Log("PairSetupM5\n");
@@ -892,25 +1521,21 @@ namespace Hap
 				iosTlv = iosEncrypted + iosTlv_size;	// decrypted TLV
 				iosTlv_size -= 16;						// strip off tag
 				iosTag = iosEncrypted + iosTlv_size;	// iOS tag location
-				srvTag = iosTlv + iosTlv_size;			// place for our tag
-
-				// decrypt iOS data using session key
-				Hap::Crypt::aead(Hap::Crypt::Decrypt, iosTlv, srvTag,
-					sess->key, (const uint8_t *)"\x00\x00\x00\x00PS-Msg05", 
-					iosEncrypted, iosTlv_size);
 
-				Hex("iosTlv", iosTlv, iosTlv_size);
-				Hex("iosTag", iosTag, 16);
-				Hex("srvTlv", srvTag, 16);
+				DbgHex("iosTag", iosTag, 16);
 
-				// compare calculated tag with passed in one
-				if (memcmp(iosTag, srvTag, 16) != 0)
+				// verify iOS tag and decrypt iOS data using session key
+				if (!Hap::Crypt::aead(Hap::Crypt::Decrypt, iosTlv, iosTag,
+					sess->key, (const uint8_t *)"\x00\x00\x00\x00PS-Msg05", 
+					iosEncrypted, iosTlv_size))
 				{
 					Log("PairSetupM5: authTag does not match\n");
 					sess->tlvo.add(Hap::Tlv::Type::Error, Hap::Tlv::Error::Authentication);
 					goto Ret;
 				}
 
+				DbgHex("iosTlv", iosTlv, iosTlv_size);
+
 				// parse decrypted TLV - 3 items expected
 				Hap::Tlv::Parse<3> tlv(iosTlv, iosTlv_size);
 				Log("PairSetupM5: TLV item count %d\n", tlv.count());
@@ -921,21 +1546,21 @@ namespace Hap
 					Log("PairSetupM5: Identifier not found\n");
 					goto RetErr;
 				}
-				Hex("iosPairingId:", id.val(), id.len());
+				DbgHex("iosPairingId:", id.val(), id.len());
 
 				if (!tlv.get(Hap::Tlv::Type::PublicKey, ltpk))
 				{
 					Log("PairSetupM5: PublicKey not found\n");
 					goto RetErr;
 				}
-				Hex("iosLTPK:", ltpk.val(), ltpk.len());
+				DbgHex("iosLTPK:", ltpk.val(), ltpk.len());
 
 				if (!tlv.get(Hap::Tlv::Type::Signature, sign))
 				{
 					Log("PairSetupM5: Signature not found\n");
 					goto RetErr;
 				}
-				Hex("iosSignature:", sign.val(), sign.len());
+				DbgHex("iosSignature:", sign.val(), sign.len());
 
 				// TODO: build iOSDeviceInfo and verify iOS device signature
 
@@ -954,7 +1579,7 @@ namespace Hap
 
 				// add AccessoryX
 				Hap::Crypt::hkdf(
-					(const uint8_t*)"Pair-Setup-Accessory-Sign-Salt", sizeof("Pair-Setup-Accessory-Sign-Salt") - 1,
+					Hap::Crypt::PairSetupAccessorySignSalt,
 					srp_shared_secret, sizeof(srp_shared_secret),
 					(const uint8_t*)"Pair-Setup-Accessory-Sign-Info", sizeof("Pair-Setup-Accessory-Sign-Info") - 1,
 					p, 32);
@@ -996,7 +1621,7 @@ namespace Hap
 				);
 
 				l -= subTlv.length() + 16;
-				Log("PairSetupM5: sess->data unused: %d\n", l);
+				Dbg("PairSetupM5: sess->data unused: %d\n", l);
 
 				// add encryped info and tag to output TLV
 				sess->tlvo.add(Hap::Tlv::Type::EncryptedData, p, subTlv.length() + 16);
@@ -1056,7 +1681,7 @@ namespace Hap
 
 			// create session key from shared secret
 			Hap::Crypt::hkdf(
-				(const uint8_t*)"Pair-Verify-Encrypt-Salt", sizeof("Pair-Verify-Encrypt-Salt") - 1,
+				Hap::Crypt::PairVerifyEncryptSalt,
 				sharedSecret, sess->curve.KeySize,
 				(const uint8_t*)"Pair-Verify-Encrypt-Info", sizeof("Pair-Verify-Encrypt-Info") - 1,
 				sess->key, sizeof(sess->key));
@@ -1104,7 +1729,7 @@ namespace Hap
 			);
 
 			l -= subTlv.length() + 16;
-			Log("PairVerifyM1: sess->data unused: %d\n", l);
+			Dbg("PairVerifyM1: sess->data unused: %d\n", l);
 
 			// add Accessory public key to output TLV
 			sess->tlvo.add(Hap::Tlv::Type::PublicKey, sess->curve.getPublicKey(), sess->curve.KeySize);
@@ -1127,7 +1752,6 @@ namespace Hap
 			uint8_t* iosEncrypted;	// encrypted tata from iOS with tag attached
 			uint8_t* iosTag;		// pointer to iOS tag
 			uint8_t* iosTlv;		// decrypted TLV
-			uint8_t* srvTag;		// calculated tag
 			uint16_t iosTlv_size;
 
 			Log("PairVerifyM3\n");
@@ -1159,25 +1783,21 @@ namespace Hap
 				iosTlv = iosEncrypted + iosTlv_size;	// decrypted TLV
 				iosTlv_size -= 16;						// strip off tag
 				iosTag = iosEncrypted + iosTlv_size;	// iOS tag location
-				srvTag = iosTlv + iosTlv_size;			// place for our tag
-
-														// decrypt iOS data using session key
-				Hap::Crypt::aead(Hap::Crypt::Decrypt, iosTlv, srvTag,
-					sess->key, (const uint8_t *)"\x00\x00\x00\x00PV-Msg03",
-					iosEncrypted, iosTlv_size);
 
-				Hex("iosTlv", iosTlv, iosTlv_size);
-				Hex("iosTag", iosTag, 16);
-				Hex("srvTlv", srvTag, 16);
+				DbgHex("iosTag", iosTag, 16);
 
-				// compare calculated tag with passed in one
-				if (memcmp(iosTag, srvTag, 16) != 0)
+				// verify iOS tag and decrypt iOS data using session key
+				if (!Hap::Crypt::aead(Hap::Crypt::Decrypt, iosTlv, iosTag,
+					sess->key, (const uint8_t *)"\x00\x00\x00\x00PV-Msg03",
+					iosEncrypted, iosTlv_size))
 				{
 					Log("PairVerifyM3: authTag does not match\n");
 					sess->tlvo.add(Hap::Tlv::Type::Error, Hap::Tlv::Error::Authentication);
 					goto Ret;
 				}
 
+				DbgHex("iosTlv", iosTlv, iosTlv_size);
+
 				// parse decrypted TLV - 2 items expected
 				Hap::Tlv::Parse<2> tlv(iosTlv, iosTlv_size);
 				Log("PairVerifyM3: TLV item count %d\n", tlv.count());
@@ -1188,14 +1808,14 @@ namespace Hap
 					Log("PairVerifyM3: Identifier not found\n");
 					goto RetErr;
 				}
-				Hex("iosPairingId:", id.val(), id.len());
+				DbgHex("iosPairingId:", id.val(), id.len());
 
 				if (!tlv.get(Hap::Tlv::Type::Signature, sign))
 				{
 					Log("PairVerifyM3: Signature not found\n");
 					goto RetErr;
 				}
-				Hex("iosSignature:", sign.val(), sign.len());
+				DbgHex("iosSignature:", sign.val(), sign.len());
 
 				// lookup iOS id in pairing database
 				auto ios = _pairings.Get(id);
@@ -1208,16 +1828,16 @@ namespace Hap
 
 				// TODO: construct iOSDeviceInfo and verify signature
 
-				// create session encryption keys
-				Hap::Crypt::hkdf(
-					(const uint8_t*)"Control-Salt", sizeof("Control-Salt") - 1,
-					sess->curve.getSharedSecret(), sess->curve.KeySize,
+				// create session encryption keys, both are expanded from the same PRK
+				uint8_t prk[Hap::Crypt::PrkSize];
+				Hap::Crypt::hkdfExtract(Hap::Crypt::ControlSalt,
+					sess->curve.getSharedSecret(), sess->curve.KeySize, prk);
+
+				Hap::Crypt::hkdfExpand(prk,
 					(const uint8_t*)"Control-Read-Encryption-Key", sizeof("Control-Read-Encryption-Key") - 1,
 					sess->AccessoryToControllerKey, sizeof(sess->AccessoryToControllerKey));
 
-				Hap::Crypt::hkdf(
-					(const uint8_t*)"Control-Salt", sizeof("Control-Salt") - 1,
-					sess->curve.getSharedSecret(), sess->curve.KeySize,
+				Hap::Crypt::hkdfExpand(prk,
 					(const uint8_t*)"Control-Write-Encryption-Key", sizeof("Control-Write-Encryption-Key") - 1,
 					sess->ControllerToAccessoryKey, sizeof(sess->ControllerToAccessoryKey));
 
@@ -1268,14 +1888,14 @@ namespace Hap
 				Log("PairingAdd: Identifier not found\n");
 				goto RetErr;
 			}
-			Hex("PairingAdd: Identifier", id.val(), id.len());
+			DbgHex("PairingAdd: Identifier", id.val(), id.len());
 
 			if (!sess->tlvi.get(Tlv::Type::PublicKey, key))
 			{
 				Log("PairingAdd: PublicKey not found\n");
 				goto RetErr;
 			}
-			Hex("PairingAdd: PublicKey", key.val(), key.len());
+			DbgHex("PairingAdd: PublicKey", key.val(), key.len());
 
 			if (!sess->tlvi.get(Tlv::Type::Permissions, perm))
 			{
@@ -1346,7 +1966,7 @@ namespace Hap
 				Log("PairingRemove: Identifier not found\n");
 				goto RetErr;
 			}
-			Hex("PairingRemove: Identifier", id.val(), id.len());
+			DbgHex("PairingRemove: Identifier", id.val(), id.len());
 
 			if (!_pairings.Remove(id))
 			{
@@ -45,44 +45,67 @@ namespace Hap
 			HTTP_500,
 			HTTP_503
 		};
-		static const char* StatusStr(Status c)
+
+		// string literal with its length
+		struct Literal
+		{
+			const char* str;
+			uint8_t len;
+		};
+		#define HTTP_LITERAL(s) { s, sizeof(s) - 1 }
+
+		static const Literal& StatusLit(Status c)
 		{
-			static const char* const str[] =
-			{
-				"200 OK",
-				"204 No Content",
-				"207 Multi-Status",
-				"400 Bad Request",
-				"404 Not Found",
-				"405 Method Not Allowed",
-				"422 Unprocessable Entry",
-				"429 Too Many requests",
-				"470 Connection Authorization Required",
-				"500 Internal Server Error",
-				"503 Service Unavailable",
+			static const Literal str[] =
+			{
+				HTTP_LITERAL("200 OK"),
+				HTTP_LITERAL("204 No Content"),
+				HTTP_LITERAL("207 Multi-Status"),
+				HTTP_LITERAL("400 Bad Request"),
+				HTTP_LITERAL("404 Not Found"),
+				HTTP_LITERAL("405 Method Not Allowed"),
+				HTTP_LITERAL("422 Unprocessable Entry"),
+				HTTP_LITERAL("429 Too Many requests"),
+				HTTP_LITERAL("470 Connection Authorization Required"),
+				HTTP_LITERAL("500 Internal Server Error"),
+				HTTP_LITERAL("503 Service Unavailable"),
 			};
 			return str[int(c)];
 		}
+		inline const char* StatusStr(Status c)
+		{
+			return StatusLit(c).str;
+		}
 
 		enum Header
 		{
 			ContentType,
 			ContentLength,
+			Connection,
+			Host,
+			TransferEncoding,
 
 			HeaderMax
 		};
-		static const char* HeaderStr(Header h)
+		static const Literal& HeaderLit(Header h)
 		{
-			static const char* const str[] =
+			static const Literal str[] =
 			{
-				"Content-Type",
-				"Content-Length"
+				HTTP_LITERAL("Content-Type"),
+				HTTP_LITERAL("Content-Length"),
+				HTTP_LITERAL("Connection"),
+				HTTP_LITERAL("Host"),
+				HTTP_LITERAL("Transfer-Encoding"),
 			};
 			return str[int(h)];
 		}
+		inline const char* HeaderStr(Header h)
+		{
+			return HeaderLit(h).str;
+		}
 
-		extern const char* ContentTypeJson;
-		extern const char* ContentTypeTlv8;
+		constexpr const char* ContentTypeJson = "application/hap+json";
+		constexpr const char* ContentTypeTlv8 = "application/pairing+tlv8";
 
 		// Http request parser
 		template<int MaxHeaders>
@@ -99,8 +122,11 @@ namespace Hap
 			size_t _path_len;
 			size_t _data_len;
 			size_t _num_headers;
+			int8_t _slot[HeaderMax];	// index of known headers in _headers, -1 if not present
 			size_t _buflen;
 			size_t _prevbuflen;
+			size_t _hdrlen;				// length of request line and headers, 0 until parsed
+			int _contentlen;			// value of Content-Length header, -1 if not present
 			int _minor_version;
 
 		public:
@@ -120,6 +146,9 @@ namespace Hap
 				_num_headers = 0;
 				_buflen = 0;
 				_prevbuflen = 0;
+				_hdrlen = 0;
+				_contentlen = -1;
+				memset(_slot, -1, sizeof(_slot));
 			}
 
 			char* buf()
@@ -134,27 +163,73 @@ namespace Hap
 
 			// parse buffer, maybe called multiple times as more data is read into the buffer
 			//	the buflen must indicate current length of valid data in the buffer
+			//	the request is complete when headers and Content-Length bytes of data are received
 			Status parse(size_t buflen)
 			{
 				_prevbuflen = _buflen;
 				_buflen = buflen;
-				_num_headers = sizeofarr(_headers);
 
-				int rc = phr_parse_request(_buf, _buflen, 
-					&_method, &_method_len, &_path, &_path_len,
-					&_minor_version, _headers, &_num_headers, _prevbuflen);
-
-				if (rc > 0)
+				if (_hdrlen == 0)
 				{
+					_num_headers = sizeofarr(_headers);
+
+					int rc = phr_parse_request(_buf, _buflen,
+						&_method, &_method_len, &_path, &_path_len,
+						&_minor_version, _headers, &_num_headers, _prevbuflen);
+
+					if (rc == -1)
+						return Error;
+
+					if (rc < 0)
+						return Incomplete;
+
+					// index known headers, first occurrence is used
+					for (size_t i = 0; i < _num_headers; i++)
+					{
+						if (_headers[i].name == nullptr)	// continuation line
+							continue;
+
+						Header h = classify(_headers[i].name, _headers[i].name_len);
+						if (h == HeaderMax)
+							continue;
+
+						if (_slot[h] < 0)
+							_slot[h] = (int8_t)i;
+						else if (h == ContentLength)
+						{
+							Log("Http: duplicate Content-Length\n");
+							return Error;
+						}
+					}
+
+					// decode Content-Length once
+					int len = -1;
+					if (_slot[ContentLength] >= 0)
+					{
+						if (!number(_headers[_slot[ContentLength]], len))
+						{
+							Log("Http: invalid Content-Length\n");
+							return Error;
+						}
+
+						if (rc + len > _size)
+						{
+							Log("Http: request data is too big: %d\n", len);
+							return Error;
+						}
+					}
+
+					_hdrlen = rc;
+					_contentlen = len;
 					_data = (uint8_t*)_buf + rc;
-					_data_len = _buflen - rc;
-					return Success;
 				}
-				
-				if (rc == -1)
-					return Error;
 
-				return Incomplete;
+				// wait for complete request data
+				if (_buflen < length())
+					return Incomplete;
+
+				_data_len = length() - _hdrlen;
+				return Success;
 			}
 
 			auto method()
@@ -172,6 +247,19 @@ namespace Hap
 				return makeBuf(_data, _data_len);
 			}
 
+			// length of parsed request (headers and data),
+			//	pipelined requests may follow it in the buffer
+			uint16_t length()
+			{
+				return (uint16_t)(_hdrlen + (_contentlen > 0 ? _contentlen : 0));
+			}
+
+			// value of Content-Length header, -1 if the header is not present
+			int contentLength()
+			{
+				return _contentlen;
+			}
+
 			size_t hdr_count()
 			{
 				return _num_headers;
@@ -194,79 +282,165 @@ namespace Hap
 			// return true if header h exists, and value of integer parameter
 			bool hdr(Header h, int& prm)
 			{
-				for (size_t i = 0; i < _num_headers; i++)
+				if (h == ContentLength)
 				{
-					const char* s = HeaderStr(h);
+					prm = _contentlen;
+					return _contentlen >= 0;
+				}
 
-					if (strlen(s) == _headers[i].name_len && 
-						memcmp(_headers[i].name, s, _headers[i].name_len) == 0)
-					{
-						char v[16];
-						if (_headers[i].value_len < sizeof(v))
-						{
-							memcpy(v, _headers[i].value, _headers[i].value_len);
-							v[_headers[i].value_len] = 0;
+				if (h >= HeaderMax || _slot[h] < 0)
+					return false;
 
-							prm = atoi(v);
-							return true;
-						}
-						else
-						{
-							Log("Http: %s is too big\n", s);
-						}
-					}
-				}
-				return false;
+				return number(_headers[_slot[h]], prm);
 			}
 
 			// returns true if header h exists and its value matches prm
 			bool hdr(Header h, const char* prm)
 			{
-				for (size_t i = 0; i < _num_headers; i++)
-				{
-					const char* s = HeaderStr(h);
+				if (h >= HeaderMax || _slot[h] < 0)
+					return false;
 
-					if (strlen(s) == _headers[i].name_len &&
-						memcmp(_headers[i].name, s, _headers[i].name_len) == 0)
-					{
-						unsigned l = strlen(prm);
-						return l == _headers[i].value_len &&
-							memcmp(prm, _headers[i].value, l) == 0;
-					}
+				const phr_header& hd = _headers[_slot[h]];
+				size_t l = strlen(prm);
+				return l == hd.value_len && memcmp(prm, hd.value, l) == 0;
+			}
+
+		private:
+			// classify request header by name (case-insensitive), returns HeaderMax for unknown header
+			static Header classify(const char* name, size_t len)
+			{
+				Header h;
+				switch (len)
+				{
+				case 4:		h = Host; break;
+				case 10:	h = Connection; break;
+				case 12:	h = ContentType; break;
+				case 14:	h = ContentLength; break;
+				case 17:	h = TransferEncoding; break;
+				default:	return HeaderMax;
 				}
-				return false;
+
+				// known names consist of letters and '-', setting bit 5 folds the case
+				const char* s = HeaderStr(h);
+				for (size_t i = 0; i < len; i++)
+					if ((name[i] | 0x20) != (s[i] | 0x20))
+						return HeaderMax;
+
+				return h;
 			}
 
+			// decode decimal header value, up to 65535
+			static bool number(const phr_header& hd, int& prm)
+			{
+				if (hd.value_len == 0 || hd.value_len > 5)
+					return false;
+
+				int v = 0;
+				for (size_t i = 0; i < hd.value_len; i++)
+				{
+					char c = hd.value[i];
+					if (c < '0' || c > '9')
+						return false;
+					v = v * 10 + (c - '0');
+				}
+
+				if (v > 0xFFFF)
+					return false;
+
+				prm = v;
+				return true;
+			}
 		};
 
 		// HTTP response creator
+		//	status line and headers are copied from literals, numbers are formatted in place;
+		//	the response starts after small headroom, so when Content-Length is set after
+		//	the data is created, the status line and headers slide into the headroom
+		//	to fit the length digits and the data stays in place
 		class Response
 		{
 		private:
+			// Content-Length placeholder "0" may grow up to 5 digits,
+			//	and encrypted frame length goes in front of response encrypted in place
+			static constexpr uint16_t Headroom = 4 + 2;
+
 			char* _buf = nullptr;
-			uint16_t _max = 0;
-			uint16_t _len = 0;
-			uint16_t _len_pos = 0;
+			uint16_t _size = 0;		// buffer size
+			uint16_t _off = 0;		// response start
+			uint16_t _len = 0;		// end of valid data
+			uint16_t _len_pos = 0;	// position of Content-Length digits, 0 if not added
+			uint8_t _len_digits = 0;
+
+			bool put(const char* s, uint16_t l)
+			{
+				if (_len + l > _size)
+					return false;
+
+				memcpy(_buf + _len, s, l);
+				_len += l;
+				return true;
+			}
+
+			bool put(const Literal& l)
+			{
+				return put(l.str, l.len);
+			}
+
+			// format unsigned decimal number, returns number of digits
+			static uint8_t format(char* s, uint16_t v)
+			{
+				char t[5];
+				uint8_t n = 0;
+
+				do
+				{
+					t[n++] = '0' + v % 10;
+					v /= 10;
+				} while (v != 0);
+
+				for (uint8_t i = 0; i < n; i++)
+					s[i] = t[n - 1 - i];
+
+				return n;
+			}
+
+			bool line(const Literal& proto, Status status)
+			{
+				_off = _size > Headroom ? Headroom : 0;
+				_len = _off;
+				_len_pos = 0;
+
+				return put(proto) && put(StatusLit(status)) && put("\r\n", 2);
+			}
 
 		public:
 			void init(char* buf, uint16_t size)
 			{
 				_buf = buf;
-				_max = size;
+				_size = size;
+				_off = 0;
+				_len = 0;
+				_len_pos = 0;
 			}
 
 			// return response buffer
 			char* buf()
 			{
-				if (_max == 0)
+				if (_size == 0)
 					return nullptr;
-				return _buf;
+				return _buf + _off;
 			}
 
 			// return length of valid data in the buffer
 			uint16_t len()
 			{
-				return _len;
+				return _len - _off;
+			}
+
+			// return space available in front of the response
+			uint16_t headroom()
+			{
+				return _off;
 			}
 
 			// return pointer to data area after headers
@@ -278,41 +452,37 @@ namespace Hap
 			// return size of data area
 			uint16_t size()
 			{
-				return _max;
+				return _size - _len;
 			}
 
 			bool start(Status status)
 			{
-				_len = snprintf(_buf, _max, "HTTP/1.1 %s\r\n", StatusStr(status));
-				_max -= _len;
-				return _max != 0;
+				static const Literal proto = HTTP_LITERAL("HTTP/1.1 ");
+				return line(proto, status);
 			}
 
 			bool event(Status status)
 			{
-				_len = snprintf(_buf, _max, "EVENT/1.0 %s\r\n", StatusStr(status));
-				_max -= _len;
-				return _max != 0;
+				static const Literal proto = HTTP_LITERAL("EVENT/1.0 ");
+				return line(proto, status);
 			}
 
 			// add header with integer parameter
 			bool add(Header h, int prm)
 			{
-				if (_max == 0)
-					return false;
+				char v[5];
+				uint8_t n = format(v, (uint16_t)prm);
 
-				int l = 0;
-
-				l = snprintf(_buf + _len, _max, "%s: %4d\r\n", HeaderStr(h), prm);
-				_len += l;
-				_max -= _len;
+				if (!put(HeaderLit(h)) || !put(": ", 2))
+					return false;
 
 				if (h == ContentLength)
 				{
-					_len_pos = _len - 2;
+					_len_pos = _len;
+					_len_digits = n;
 				}
 
-				return _max != 0;
+				return put(v, n) && put("\r\n", 2);
 			}
 
 			// add length of data area
@@ -322,70 +492,144 @@ namespace Hap
 				if (_len_pos == 0)
 					return;
 
-				char t = _buf[_len_pos];
-				snprintf(_buf + _len_pos - 4, 5, "%4d", len);
-				_buf[_len_pos] = t;
+				char v[5];
+				uint8_t n = format(v, len);
+				int d = n - _len_digits;	// status line and headers move by d to fit the digits
+
+				if (d > (int)_off)
+					return;
+
+				memmove(_buf + _off - d, _buf + _off, _len_pos - _off);
+				_off -= d;
+				_len_pos -= d;
+				memcpy(_buf + _len_pos, v, n);
+				_len_digits = n;
 
 				_len += len;
 			}
 
 			bool add(Header h, const char* prm)
 			{
-				if (_max == 0)
-					return false;
-
-				int l = 0;
-				l = snprintf(_buf + _len, _max, "%s: %s\r\n", HeaderStr(h), prm);
-				_len += l;
-				_max -= _len;
-				return _max != 0;
+				return put(HeaderLit(h)) && put(": ", 2) &&
+					put(prm, (uint16_t)strlen(prm)) && put("\r\n", 2);
 			}
 
 			// end HTTP response with no data
 			bool end()
 			{
-				if (_max == 0)
-					return false;
-
-				int l = snprintf(_buf + _len, _max, "\r\n");
-				_len += l;
-				_max -= l;
-				return _max != 0;
+				return put("\r\n", 2);
 			}
 
 			// end HTTP response, attach data from string
 			bool end(const char* s, int l = 0)
 			{
-				if (_max == 0)
-					return false;
-
 				if (l == 0)
-					l = strlen(s);
-				if (!add(ContentLength, l))
+					l = (int)strlen(s);
+
+				return add(ContentLength, l) && put("\r\n", 2) && put(s, (uint16_t)l);
+			}
+
+			// chunked body - chunk data is written into chunkData() area,
+			//	chunk() adds the size line in front of it and CRLF after it,
+			//	the last chunk is followed by zero-length chunk that ends the body
+			static constexpr uint16_t ChunkHead = 6;	// chunk size as 4 hex digits and CRLF
+			static constexpr uint16_t ChunkTail = 7;	// CRLF and the zero-length chunk
+
+			char* chunkData()
+			{
+				return data() + ChunkHead;
+			}
+
+			uint16_t chunkSize()
+			{
+				if (size() <= ChunkHead + ChunkTail)
+					return 0;
+				return size() - ChunkHead - ChunkTail;
+			}
+
+			bool chunk(uint16_t len, bool last)
+			{
+				static const char hex[] = "0123456789abcdef";
+
+				if (len > chunkSize())
 					return false;
-				l = snprintf(_buf + _len, _max, "\r\n%s", s);
-				_len += l;
-				_max -= l;
-				return _max != 0;
+
+				// zero-length chunk would end the body
+				if (len > 0)
+				{
+					char* s = data();
+					for (int i = 0; i < 4; i++)
+						s[i] = hex[(len >> (12 - 4 * i)) & 0xF];
+					s[4] = '\r';
+					s[5] = '\n';
+
+					_len += ChunkHead + len;
+					put("\r\n", 2);
+				}
+
+				if (last)
+					put("0\r\n\r\n", 5);
+
+				return true;
 			}
 		};
 
-		// Http Server object
-		//	- all access to Http Server object must be externally serialized
-		class Server
+		// Buffer pool
+		//	slab of MaxHttpFrame-sized chunks, leases buffers of one or more
+		//	contiguous chunks; may be used from any thread
+		class Pool
 		{
+		private:
+			std::mutex _lock;
+			char* _slab;			// chunks storage
+			uint32_t* _map;			// bitmap of leased chunks
+			uint16_t _chunks;		// number of chunks in the slab
+			uint16_t _free;			// number of free chunks
+
 		public:
-			struct Buf
+			Pool(char* slab, uint32_t* map, uint16_t chunks)
+				: _slab(slab), _map(map), _chunks(chunks), _free(chunks)
 			{
-				Hap::Buf<char*> req;	// request buffer MaxHttpFrame*N where N depends on expected request size
-				Hap::Buf<char*> rsp;	// response buffer  MaxHttpFrame*M where M depends on expected response size
-				Hap::Buf<char*> tmp;	// temporary storage (encrypt/decrypt etc.), MaxHttpFrame
+				memset(_map, 0, ((chunks + 31) / 32) * sizeof(uint32_t));
+			}
 
+			// lease buffer of at least 'size' bytes
+			//	returns false if there are no enough contiguous free chunks
+			bool Lease(Hap::Buf<char*>& buf, uint16_t size);
 
-			};
+			// return leased buffer to the pool, buf is reset
+			//	buf length may be reduced after lease but must not be zero
+			void Release(Hap::Buf<char*>& buf);
 
+			uint16_t Free()
+			{
+				return _free;
+			}
+		};
+
+		template<uint16_t Chunks>
+		class PoolStatic : public Pool
+		{
 		private:
-			Buf& _buf;
+			char _slab[Chunks * MaxHttpFrame];
+			uint32_t _map[(Chunks + 31) / 32];
+		public:
+			PoolStatic() : Pool(_slab, _map, Chunks) {}
+		};
+
+		// Http Server object
+		//	- session buffers are leased from the pool for the time of processing one request
+		//		or event, so memory is bounded by the pool size, not by number of sessions;
+		//	- calls for one session must be serialized, calls for different sessions
+		//		may run concurrently from different network threads - access to the shared DB,
+		//		pairings and pair setup state is serialized internally
+		class Server
+		{
+		private:
+			Pool& _pool;					// session buffers
+			uint16_t _reqSize;				// request buffer size
+			uint16_t _rspSize;				// response buffer size
+			std::mutex _lock;				// serializes access to DB and pairings
 			Db& _db;						// accessory database
 			Pairings& _pairings;			// pairings database
 			Hap::Crypt::Ed25519& _keys;		// crypto keys
@@ -411,15 +655,33 @@ namespace Hap
 				// session temp data
 				uint8_t key[32];
 
-				void Open(sid_t sid, Buf* buf)
+				// request receive state, valid while request buffer is leased
+				//	encrypted data is received into request buffer after request data and decrypted in place
+				uint16_t rxLen;						// length of received encrypted data not decrypted yet
+				uint16_t reqLen;					// length of request data in request buffer
+				bool eventsHeld;					// events were not polled while receiving
+
+				// outbound queue state, valid while queue buffer is leased
+				uint16_t txLen;						// length of queued data
+				uint16_t txOff;						// length of data sent so far
+
+				// streamed response state, GET /accessories that does not fit into response buffer
+				int dbPos;							// position in accessory database, 0 when not streaming
+
+				void Open(sid_t sid)
 				{
 					_sid = sid;
-					_buf = buf;
 					_opened = true;
 					ios = nullptr;
 					secured = false;
 					recvSeq = 0;
 					sendSeq = 0;
+					rxLen = 0;
+					reqLen = 0;
+					eventsHeld = false;
+					txLen = 0;
+					txOff = 0;
+					dbPos = 0;
 				}
 
 				void Close()
@@ -435,11 +697,106 @@ namespace Hap
 					return _opened;
 				}
 
-				void Init(
-				)
+				// lease buffer for receiving request, does nothing if the request is being received
+				bool LeaseReq(Pool& pool, uint16_t reqSize)
 				{
-					req.init(_buf->req.ptr(), (uint16_t)_buf->req.len());
-					rsp.init(_buf->rsp.ptr(), (uint16_t)_buf->rsp.len());
+					if (Receiving())
+						return true;
+
+					if (pool.Lease(_req, reqSize))
+					{
+						req.init(_req.ptr(), (uint16_t)_req.len());
+						rxLen = 0;
+						reqLen = 0;
+						return true;
+					}
+
+					return false;
+				}
+
+				// lease buffers for response or event
+				//	tmp is used for encryption so it is always one frame
+				bool LeaseRsp(Pool& pool, uint16_t rspSize)
+				{
+					if ((_tmp.ptr() != nullptr || pool.Lease(_tmp, MaxHttpFrame)) && pool.Lease(_rsp, rspSize))
+					{
+						rsp.init(_rsp.ptr(), (uint16_t)_rsp.len());
+						return true;
+					}
+
+					Release(pool);
+					return false;
+				}
+
+				// return all leased buffers
+				void Release(Pool& pool)
+				{
+					pool.Release(_req);
+					pool.Release(_rsp);
+					pool.Release(_tmp);
+				}
+
+				// return response buffers, request buffer is kept for pipelined requests
+				void ReleaseRsp(Pool& pool)
+				{
+					pool.Release(_rsp);
+					pool.Release(_tmp);
+				}
+
+				// reuse response buffer for next portion of streamed response
+				void ContinueRsp()
+				{
+					rsp.init(_rsp.ptr(), (uint16_t)_rsp.len());
+				}
+
+				// streamed response is not complete
+				bool Streaming()
+				{
+					return dbPos != 0;
+				}
+
+				// drop processed request from request buffer, pipelined data that follows it is kept
+				void Next()
+				{
+					uint16_t l = req.length();
+
+					reqLen -= l;
+					if (reqLen + rxLen > 0)
+						memmove(_req.ptr(), _req.ptr() + l, reqLen + rxLen);
+
+					req.init(_req.ptr(), (uint16_t)_req.len());
+				}
+
+				// request is being received
+				bool Receiving()
+				{
+					return _req.ptr() != nullptr;
+				}
+
+				// lease outbound queue buffer
+				bool LeaseTx(Pool& pool, uint16_t size)
+				{
+					txLen = 0;
+					txOff = 0;
+					return pool.Lease(_tx, size);
+				}
+
+				void ReleaseTx(Pool& pool)
+				{
+					pool.Release(_tx);
+					txLen = 0;
+					txOff = 0;
+				}
+
+				// outbound queue is not empty
+				bool Pending()
+				{
+					return txOff < txLen;
+				}
+
+				char* txData()
+				{
+					return _tx.ptr();
 				}
 
 				sid_t Sid()
@@ -451,35 +808,84 @@ namespace Hap
 
 				uint8_t* data()
 				{
-					return (uint8_t*)_buf->tmp.ptr();
+					return (uint8_t*)_tmp.ptr();
 				}
 
 				uint16_t sizeofdata()
 				{
-					return (uint16_t)_buf->tmp.len();
+					return (uint16_t)_tmp.len();
 				}
 
 			private:
 				// the following fields are valid from session open to close
 				bool _opened = false;		// true when session is opened
 				sid_t _sid = sid_invalid;	// valid when opened
-				Buf* _buf = nullptr;
+
+				// buffers leased from the pool
+				Hap::Buf<char*> _req = { nullptr, 0 };
+				Hap::Buf<char*> _rsp = { nullptr, 0 };
+				Hap::Buf<char*> _tmp = { nullptr, 0 };
+				Hap::Buf<char*> _tx = { nullptr, 0 };
 			} _sess[MaxHttpSessions + 1];	// last slot is for handling 'too many sessions' condition
 
 		public:
+			// Recv returns number of bytes received, 0 on EOF, RecvAgain when
+			//	no more data is available now (non-blocking socket), other negative on error
 			using Recv = std::function<int(sid_t sid, char* buf, uint16_t size)>;
+			static constexpr int RecvAgain = -2;
+
+			// Send and SendV return number of bytes sent, SendAgain when socket
+			//	cannot take more data now, other negative on error
+			static constexpr int SendAgain = -2;
+
 			using Send = std::function<int(sid_t sid, char* buf, uint16_t len)>;
 
+			// vectored send, sends 'count' buffers with one call (writev)
+			using SendV = std::function<int(sid_t sid, const Hap::Buf<char*>* buf, uint8_t count)>;
+			static constexpr uint8_t MaxSendFrames = MaxHttpRsp / MaxHttpBlock + 1;	// max buffers passed to SendV
+
+			// encrypted size of response data
+			static constexpr uint32_t Encrypted(uint16_t len)
+			{
+				return len + (len + MaxHttpBlock - 1) / MaxHttpBlock * Hap::Crypt::FrameOverhead;
+			}
+
+			// pool chunks leased for session outbound queue, it holds the rest of one encrypted
+			//	response of rspSize; responses to pipelined requests are batched before it
+			//	only while the next response may still fit in the queue together with them
+			static constexpr uint16_t QueueChunks(uint16_t rspSize = MaxHttpRsp)
+			{
+				return (uint16_t)((Encrypted(rspSize) + MaxHttpFrame - 1) / MaxHttpFrame);
+			}
+
 
-			Server(Buf& buf, Db& db, Pairings& pairings, Hap::Crypt::Ed25519& keys)
-				: _buf(buf), _db(db), _pairings(pairings), _keys(keys)
+			// the reqSize and rspSize define buffers leased for each request,
+			//	they depend on expected request and response (accessory database) size
+			Server(Pool& pool, Db& db, Pairings& pairings, Hap::Crypt::Ed25519& keys,
+				uint16_t reqSize = MaxHttpReq, uint16_t rspSize = MaxHttpRsp)
+				: _pool(pool), _reqSize(reqSize), _rspSize(rspSize),
+				_db(db), _pairings(pairings), _keys(keys)
 			{}
 
-			// Open - returns new session ID, 0..sid_max, or sid_invalid
+			// admission control counters
+			struct Stats
+			{
+				std::atomic<uint32_t> rejected;		// requests rejected with 503 (too many sessions or no buffers)
+				std::atomic<uint32_t> noBuffers;	// requests failed because buffer pool is exhausted
+				std::atomic<uint32_t> refused;		// connections refused by network task (no connection context)
+			} stats = {};
+
+			// buffer pool, the network task may lease its receive buffers from it
+			Pool& Buffers()
+			{
+				return _pool;
+			}
+
+			// Open - returns new session ID, 0..sid_max, or MaxHttpSessions when all sessions are in use
 			//	the caller (network task) calls Open when new TCP connection request arrives
-			//	when sid_invalid is returned, the caller should still call Process
-			//	which will create and send correct error response (503 Unavailable or 
-			//	429 Too many requests)
+			//	when MaxHttpSessions is returned, the caller should still call Process
+			//	which drains the request, sends 503 Service Unavailable and returns false,
+			//	Close is not needed in this case
 			sid_t Open();
 
 			// Close - returns true if opened session was closed
@@ -493,21 +899,72 @@ namespace Hap
 			//		- calls 'recv' one or more times until complete HTTP request is arrived
 			//			when recv error or data timeout is detected the caller returns false 
 			//			and disconnects the TCP session 
+			//		- when recv returns RecvAgain, keeps the partial request in the session
+			//			and returns true, processing resumes on next call
 			//		- processes the request and creates response
 			//		- calls 'send' to send the response back
 			//			buf is send to nullptr if response buffer is too small
+			//			when 'sendv' is provided, encrypted frames are sent in batches through it
+			//		- pipelined requests that arrived with the request are processed in the same call,
+			//			responses to them are collected and sent with one 'sendv' call
 			//		-	returns true to keep the connection open
 			//		-	returns false to close the TCP connection
-			bool Process(sid_t sid,	Recv recv, Send send);
+			bool Process(sid_t sid,	Recv recv, Send send, SendV sendv = nullptr);
 
 			// Poll database (collect events)
 			//	the network task must call this periodically (once every 1..n sec)
-			//	for all opened sessions so events get delivered to all connected controllers
-			void Poll(sid_t sid, Send send);
+			//	for all opened sessions so events get delivered to all connected controllers;
+			//	it should also call it when Hap::eventSignal is raised to deliver events immediately
+			void Poll(sid_t sid, Send send, SendV sendv = nullptr);
+
+			// Flush outbound queue
+			//	when Send does not take whole message, the rest is kept in session outbound queue
+			//	(further requests, including buffered pipelined ones, are not processed and
+			//	events are held meanwhile);
+			//	the network task checks Pending after Process/Poll and calls Flush
+			//	when the socket becomes writable, then calls Process and Poll to resume
+			//	returns false to close the TCP connection
+			bool Flush(sid_t sid, Send send);
+
+			// returns true if the session has data in outbound queue
+			bool Pending(sid_t sid);
 
 		private:
-			bool _send(Session* sess, Send& send);
+			// encrypted frames collected for one vectored send
+			struct Batch
+			{
+				Hap::Buf<char*> frame[MaxSendFrames];
+				bool leased[MaxSendFrames];		// frame is leased from the pool
+				uint8_t cnt = 0;
+				int total = 0;		// total length of frames
+			};
+
+			void _reject(sid_t sid, Recv& recv, Send& send);
+			int _recv(Session* sess, Recv& recv);
+			bool _decrypt(Session* sess);
+			int _parse(Session* sess);
+			uint16_t _encrypt(Session* sess, uint8_t* b, const uint8_t* p, uint16_t len);
+			bool _spill(Session* sess, const Hap::Buf<char*>* frame, uint8_t cnt, int rc, const uint8_t* p, uint16_t len);
+			bool _process(Session* sess, Send& send, SendV& sendv, Batch& batch, bool more);
+			void _poll(Session* sess, Send& send, SendV& sendv);
+			bool _send(Session* sess, Send& send, SendV& sendv, Batch& batch, bool more);
+			bool _sendBatch(Session* sess, Send& send, SendV& sendv, Batch& batch, const uint8_t* p, uint16_t len);
+			bool _makeRoom(Session* sess, Send& send, SendV& sendv, Batch& batch);
+			void _releaseBatch(Batch& batch);
+			bool _stream(Session* sess, Send& send, SendV& sendv, Batch& batch, bool more);
+			bool _resume(Session* sess, Send& send, SendV& sendv);
 			
+			// request handlers, called by dispatcher after the request is validated
+			//	against route descriptor; pair verify returns session secured state after the response is sent
+			void _identify(Session* sess);
+			void _pairSetup(Session* sess);
+			bool _pairVerify(Session* sess);
+			void _pairingsMethod(Session* sess);
+			void _getAccessories(Session* sess);
+			bool _getAccessoriesChunk(Session* sess);
+			void _getCharacteristics(Session* sess);
+			void _putCharacteristics(Session* sess);
+
 			void _pairSetup1(Session* sess);
 			void _pairSetup3(Session* sess);
 			void _pairSetup5(Session* sess);
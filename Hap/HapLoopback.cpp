@@ -0,0 +1,314 @@
+/*
+MIT License
+
+Copyright (c) 2018 Gera Kazakov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "Hap.h"
+
+namespace Hap
+{
+	uint16_t Loopback::Pipe::put(const char* buf, uint16_t len)
+	{
+		if (len > space())
+			len = space();
+
+		for (uint16_t i = 0; i < len; )
+		{
+			uint16_t tail = (_head + _len) % PipeSize;
+			uint16_t l = PipeSize - tail;
+			if (l > len - i)
+				l = len - i;
+
+			memcpy(_buf + tail, buf + i, l);
+			_len += l;
+			i += l;
+		}
+
+		return len;
+	}
+
+	uint16_t Loopback::Pipe::get(char* buf, uint16_t size)
+	{
+		if (size > _len)
+			size = _len;
+
+		for (uint16_t i = 0; i < size; )
+		{
+			uint16_t l = PipeSize - _head;
+			if (l > size - i)
+				l = size - i;
+
+			memcpy(buf + i, _buf + _head, l);
+			_head = (_head + l) % PipeSize;
+			_len -= l;
+			i += l;
+		}
+
+		return size;
+	}
+
+	bool Loopback::Start()
+	{
+		_signaled = false;
+
+		// events are raised inside Process too (characteristic write),
+		//	so only remember the signal and deliver events outside of connection lock
+		if (!Hap::eventSignal.Add(signalHook, this))
+			return false;
+
+		_running = true;
+		return true;
+	}
+
+	void Loopback::Stop()
+	{
+		bool running = _running;
+		_running = false;
+
+		for (unsigned i = 0; i < sizeofarr(_conn); i++)
+			Disconnect(i);
+
+		if (running)
+			Hap::eventSignal.Remove(signalHook, this);
+	}
+
+	int Loopback::Connect()
+	{
+		if (!_running)
+			return -1;
+
+		for (unsigned i = 0; i < sizeofarr(_conn); i++)
+		{
+			Conn* conn = &_conn[i];
+			std::lock_guard<std::mutex> lock(conn->lock);
+
+			if (conn->open)
+				continue;
+
+			conn->open = true;
+			conn->closed = false;
+			conn->sid = sid_invalid;
+			conn->in.reset();
+			conn->out.reset();
+
+			return i;
+		}
+
+		return -1;
+	}
+
+	void Loopback::Disconnect(int c)
+	{
+		if (c < 0 || c >= (int)sizeofarr(_conn))
+			return;
+
+		Conn* conn = &_conn[c];
+		std::lock_guard<std::mutex> lock(conn->lock);
+
+		if (!conn->open)
+			return;
+
+		close(conn);
+		conn->open = false;
+	}
+
+	int Loopback::Write(int c, const char* buf, uint16_t len)
+	{
+		if (c < 0 || c >= (int)sizeofarr(_conn))
+			return -1;
+
+		Conn* conn = &_conn[c];
+		int rc;
+		{
+			std::lock_guard<std::mutex> lock(conn->lock);
+
+			if (!conn->open || conn->closed)
+				return -1;
+
+			rc = conn->in.put(buf, len);
+
+			process(conn);
+		}
+
+		signaled();
+
+		return rc;
+	}
+
+	int Loopback::Read(int c, char* buf, uint16_t size)
+	{
+		if (c < 0 || c >= (int)sizeofarr(_conn))
+			return -1;
+
+		Conn* conn = &_conn[c];
+		int rc;
+		{
+			std::lock_guard<std::mutex> lock(conn->lock);
+
+			if (!conn->open)
+				return -1;
+
+			rc = conn->out.get(buf, size);
+
+			if (!conn->closed && conn->sid != sid_invalid && _http->Pending(conn->sid))
+			{
+				// pipe has space now - flush outbound queue and resume
+				if (!_http->Flush(conn->sid, send(conn)))
+					close(conn);
+				else if (!_http->Pending(conn->sid))
+				{
+					process(conn);
+					poll(conn);
+				}
+			}
+
+			if (rc == 0 && conn->closed && conn->out.len() == 0)
+				rc = -1;
+		}
+
+		signaled();
+
+		return rc;
+	}
+
+	void Loopback::Poll()
+	{
+		_signaled = false;
+
+		for (unsigned i = 0; i < sizeofarr(_conn); i++)
+		{
+			Conn* conn = &_conn[i];
+			std::lock_guard<std::mutex> lock(conn->lock);
+
+			if (conn->open)
+				poll(conn);
+		}
+	}
+
+	void Loopback::signalHook(void* ctx)
+	{
+		((Loopback*)ctx)->_signaled = true;
+	}
+
+	// deliver events signaled by DB
+	void Loopback::signaled()
+	{
+		if (_signaled)
+			Poll();
+	}
+
+	// process data in the 'in' pipe, connection must be locked
+	void Loopback::process(Conn* conn)
+	{
+		if (conn->closed)
+			return;
+
+		if (conn->sid == sid_invalid)
+			conn->sid = _http->Open();
+
+		// called at least once - the server may have pipelined requests buffered
+		do
+		{
+			uint16_t len = conn->in.len();
+
+			if (!_http->Process(conn->sid, recv(conn), send(conn), sendv(conn)))
+			{
+				close(conn);
+				return;
+			}
+
+			// no progress - the server waits for the client to read
+			if (conn->in.len() == len || _http->Pending(conn->sid))
+				break;
+		} while (conn->in.len() > 0);
+	}
+
+	// collect events, connection must be locked
+	void Loopback::poll(Conn* conn)
+	{
+		if (conn->closed || conn->sid == sid_invalid)
+			return;
+
+		_http->Poll(conn->sid, send(conn), sendv(conn));
+	}
+
+	// close server side of the connection, connection must be locked
+	void Loopback::close(Conn* conn)
+	{
+		if (conn->closed)
+			return;
+
+		if (conn->sid != sid_invalid)
+			_http->Close(conn->sid);
+
+		conn->sid = sid_invalid;
+		conn->closed = true;
+	}
+
+	Hap::Http::Server::Recv Loopback::recv(Conn* conn)
+	{
+		return [conn](sid_t sid, char* buf, uint16_t size) -> int
+		{
+			if (conn->in.len() == 0)
+				return Hap::Http::Server::RecvAgain;
+
+			return conn->in.get(buf, size);
+		};
+	}
+
+	Hap::Http::Server::Send Loopback::send(Conn* conn)
+	{
+		return [conn](sid_t sid, char* buf, uint16_t len) -> int
+		{
+			if (buf == nullptr)
+				return 0;
+
+			if (len > 0 && conn->out.space() == 0)
+				return Hap::Http::Server::SendAgain;
+
+			return conn->out.put(buf, len);
+		};
+	}
+
+	Hap::Http::Server::SendV Loopback::sendv(Conn* conn)
+	{
+		return [conn](sid_t sid, const Hap::Buf<char*>* buf, uint8_t count) -> int
+		{
+			int rc = 0;
+
+			for (uint8_t i = 0; i < count; i++)
+			{
+				uint16_t l = conn->out.put(buf[i].ptr(), (uint16_t)buf[i].len());
+				rc += l;
+
+				if (l < buf[i].len())
+					break;
+			}
+
+			if (rc == 0)
+				return Hap::Http::Server::SendAgain;
+
+			return rc;
+		};
+	}
+}
@@ -0,0 +1,133 @@
+/*
+MIT License
+
+Copyright (c) 2018 Gera Kazakov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef _HAP_LOOPBACK_H_
+#define _HAP_LOOPBACK_H_
+
+// In-memory loopback transport
+//	implements Tcp contract without sockets, the client side (benchmark, test)
+//	connects and exchanges raw HTTP bytes (encrypted after pair verify)
+//	with the Http Server through paired memory pipes;
+//	it may run next to the TCP transport, each of them adds its own event signal hook
+
+namespace Hap
+{
+	class Loopback : public Tcp
+	{
+	public:
+		static constexpr uint16_t PipeSize = MaxHttpFrame * 4;	// size of pipe in each direction
+
+		Loopback(Hap::Http::Server* http)
+		{
+			_http = http;
+		}
+
+		~Loopback()
+		{
+			Stop();
+		}
+
+		virtual bool Start() override;
+		virtual void Stop() override;
+
+		// open client connection, returns connection index or -1 if all are in use
+		int Connect();
+
+		// close client connection
+		void Disconnect(int c);
+
+		// client to server - write request data
+		//	the request is processed in the calling thread,
+		//	returns number of bytes accepted (may be less than len when the server
+		//	does not read - backpressure), -1 when connection is closed
+		int Write(int c, const char* buf, uint16_t len);
+
+		// server to client - read response and event data
+		//	returns number of bytes read, 0 if there is no data, -1 when connection
+		//	is closed and all data is read; reading resumes the server blocked on full pipe
+		int Read(int c, char* buf, uint16_t size);
+
+		// collect events for all connections
+		//	events signaled by DB are delivered on next Write/Read/Poll call,
+		//	the client should call Poll periodically when it does not read
+		void Poll();
+
+	private:
+		// one direction of the connection
+		class Pipe
+		{
+		private:
+			char _buf[PipeSize];
+			uint16_t _head = 0;		// read position
+			uint16_t _len = 0;		// valid data length
+
+		public:
+			void reset()
+			{
+				_head = 0;
+				_len = 0;
+			}
+
+			uint16_t len()
+			{
+				return _len;
+			}
+
+			uint16_t space()
+			{
+				return PipeSize - _len;
+			}
+
+			uint16_t put(const char* buf, uint16_t len);
+			uint16_t get(char* buf, uint16_t size);
+		};
+
+		struct Conn
+		{
+			std::mutex lock;
+			bool open = false;		// opened by client
+			bool closed = false;	// closed by server
+			sid_t sid = sid_invalid;
+			Pipe in;				// client to server
+			Pipe out;				// server to client
+		} _conn[MaxHttpSessions + 1];
+
+		bool _running = false;
+		std::atomic<bool> _signaled;
+
+		void process(Conn* conn);
+		void poll(Conn* conn);
+		void close(Conn* conn);
+		void signaled();
+
+		static void signalHook(void* ctx);
+
+		Hap::Http::Server::Recv recv(Conn* conn);
+		Hap::Http::Server::Send send(Conn* conn);
+		Hap::Http::Server::SendV sendv(Conn* conn);
+	};
+}
+
+#endif
@@ -123,7 +123,7 @@ namespace Hap
 					Type t = Type(b[0]);
 					size_t s = b[1];
 
-					Log("Tlv: type %d  length %d\n", int(t), s);
+					Dbg("Tlv: type %d  length %d\n", int(t), s);
 
 					s += 2;
 					if (s > l)	// this Tlv spans beyond the buffer, limit its size
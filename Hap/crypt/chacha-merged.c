@@ -16,12 +16,6 @@ Public domain.
 #define CHACHA_STATELEN		(CHACHA_NONCELEN+CHACHA_CTRLEN)
 #define CHACHA_BLOCKLEN		64
 
-struct chacha_ctx {
-	u_int input[16];
-	uint8_t ks[CHACHA_BLOCKLEN];
-	uint8_t unused;
-};
-
 #if 0
 static inline void chacha_keysetup(struct chacha_ctx *x, const u_char *k,
     u_int kbits)
@@ -116,6 +110,289 @@ chacha_ivsetup(chacha_ctx *x, const u8 *iv, const u8 *counter)
 	x->input[15] = U8TO32_LITTLE(iv + 8);
 }
 
+/*
+ * Multi-block kernels: 4 blocks with SSE2 or NEON, 8 blocks with AVX2.
+ * Each vector holds the same state word of consecutive blocks, so rounds
+ * run on all blocks at once and the words are transposed back before
+ * the XOR with the message. The kernels process whole groups of blocks
+ * and return the number of blocks done; the scalar code does the rest.
+ * Only word 12 of the counter is incremented, as in RFC 7539.
+ * The whole group of input is loaded before any output is stored, so
+ * the output may overlap the input at a lower address, as it does when
+ * a HAP frame is decrypted in place over its length prefix.
+ * AVX2 is used when the CPU reports it, SSE2 and NEON are compile-time.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CHACHA_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHACHA_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CHACHA_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef CHACHA_SSE2
+
+#define SSE2_ROT16(x) _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1)
+#define SSE2_ROT(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+
+#define SSE2_QR(a, b, c, d) \
+  a = _mm_add_epi32(a, b); d = SSE2_ROT16(_mm_xor_si128(d, a)); \
+  c = _mm_add_epi32(c, d); b = SSE2_ROT(_mm_xor_si128(b, c), 12); \
+  a = _mm_add_epi32(a, b); d = SSE2_ROT(_mm_xor_si128(d, a), 8); \
+  c = _mm_add_epi32(c, d); b = SSE2_ROT(_mm_xor_si128(b, c), 7);
+
+/* transpose words w..w+3 of 4 blocks and XOR them with the loaded input into the output */
+#define SSE2_OUT(w) \
+  do { \
+    __m128i t0 = _mm_unpacklo_epi32(x[w], x[w + 1]); \
+    __m128i t1 = _mm_unpacklo_epi32(x[w + 2], x[w + 3]); \
+    __m128i t2 = _mm_unpackhi_epi32(x[w], x[w + 1]); \
+    __m128i t3 = _mm_unpackhi_epi32(x[w + 2], x[w + 3]); \
+    __m128i b0 = _mm_unpacklo_epi64(t0, t1); \
+    __m128i b1 = _mm_unpackhi_epi64(t0, t1); \
+    __m128i b2 = _mm_unpacklo_epi64(t2, t3); \
+    __m128i b3 = _mm_unpackhi_epi64(t2, t3); \
+    _mm_storeu_si128((__m128i *)(c + 4 * (w)), _mm_xor_si128(b0, in[0 + (w) / 4])); \
+    _mm_storeu_si128((__m128i *)(c + 64 + 4 * (w)), _mm_xor_si128(b1, in[4 + (w) / 4])); \
+    _mm_storeu_si128((__m128i *)(c + 128 + 4 * (w)), _mm_xor_si128(b2, in[8 + (w) / 4])); \
+    _mm_storeu_si128((__m128i *)(c + 192 + 4 * (w)), _mm_xor_si128(b3, in[12 + (w) / 4])); \
+  } while (0)
+
+static u32
+chacha_blocks_sse2(const u32 *input, const u8 *m, u8 *c, u32 blocks)
+{
+	__m128i j[16], x[16], in[16];
+	u32 done, i;
+
+	for (i = 0; i < 16; i++)
+		j[i] = _mm_set1_epi32((int)input[i]);
+	j[12] = _mm_add_epi32(j[12], _mm_set_epi32(3, 2, 1, 0));
+
+	for (done = 0; done + 4 <= blocks; done += 4) {
+		for (i = 0; i < 16; i++)
+			x[i] = j[i];
+
+		for (i = 20; i > 0; i -= 2) {
+			SSE2_QR(x[0], x[4], x[8], x[12])
+			SSE2_QR(x[1], x[5], x[9], x[13])
+			SSE2_QR(x[2], x[6], x[10], x[14])
+			SSE2_QR(x[3], x[7], x[11], x[15])
+			SSE2_QR(x[0], x[5], x[10], x[15])
+			SSE2_QR(x[1], x[6], x[11], x[12])
+			SSE2_QR(x[2], x[7], x[8], x[13])
+			SSE2_QR(x[3], x[4], x[9], x[14])
+		}
+
+		for (i = 0; i < 16; i++)
+			x[i] = _mm_add_epi32(x[i], j[i]);
+
+		for (i = 0; i < 16; i++)
+			in[i] = _mm_loadu_si128((const __m128i *)(m + 16 * i));
+
+		SSE2_OUT(0);
+		SSE2_OUT(4);
+		SSE2_OUT(8);
+		SSE2_OUT(12);
+
+		j[12] = _mm_add_epi32(j[12], _mm_set1_epi32(4));
+		m += 256;
+		c += 256;
+	}
+
+	return done;
+}
+
+#endif
+
+#ifdef CHACHA_AVX2
+
+#define AVX2_ROT8(x) _mm256_shuffle_epi8(x, rot8)
+#define AVX2_ROT16(x) _mm256_shuffle_epi8(x, rot16)
+#define AVX2_ROT(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+#define AVX2_QR(a, b, c, d) \
+  a = _mm256_add_epi32(a, b); d = AVX2_ROT16(_mm256_xor_si256(d, a)); \
+  c = _mm256_add_epi32(c, d); b = AVX2_ROT(_mm256_xor_si256(b, c), 12); \
+  a = _mm256_add_epi32(a, b); d = AVX2_ROT8(_mm256_xor_si256(d, a)); \
+  c = _mm256_add_epi32(c, d); b = AVX2_ROT(_mm256_xor_si256(b, c), 7);
+
+/* transpose words w..w+3 within 128-bit lanes: b[k] holds block k in the low lane and block k + 4 in the high lane */
+#define AVX2_TRANSPOSE(b, w) \
+  do { \
+    __m256i t0 = _mm256_unpacklo_epi32(x[w], x[w + 1]); \
+    __m256i t1 = _mm256_unpacklo_epi32(x[w + 2], x[w + 3]); \
+    __m256i t2 = _mm256_unpackhi_epi32(x[w], x[w + 1]); \
+    __m256i t3 = _mm256_unpackhi_epi32(x[w + 2], x[w + 3]); \
+    b[0] = _mm256_unpacklo_epi64(t0, t1); \
+    b[1] = _mm256_unpackhi_epi64(t0, t1); \
+    b[2] = _mm256_unpacklo_epi64(t2, t3); \
+    b[3] = _mm256_unpackhi_epi64(t2, t3); \
+  } while (0)
+
+#define AVX2_XOR(o, v) \
+  _mm256_storeu_si256((__m256i *)(c + (o)), _mm256_xor_si256(v, in[(o) / 32]))
+
+__attribute__((target("avx2"))) static u32
+chacha_blocks_avx2(const u32 *input, const u8 *m, u8 *c, u32 blocks)
+{
+	const __m256i rot16 = _mm256_set_epi8(
+	    13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+	    13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+	const __m256i rot8 = _mm256_set_epi8(
+	    14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+	    14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+	__m256i j[16], x[16], lo[4], hi[4], in[16];
+	u32 done, i, k;
+
+	for (i = 0; i < 16; i++)
+		j[i] = _mm256_set1_epi32((int)input[i]);
+	j[12] = _mm256_add_epi32(j[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+
+	for (done = 0; done + 8 <= blocks; done += 8) {
+		for (i = 0; i < 16; i++)
+			x[i] = j[i];
+
+		for (i = 20; i > 0; i -= 2) {
+			AVX2_QR(x[0], x[4], x[8], x[12])
+			AVX2_QR(x[1], x[5], x[9], x[13])
+			AVX2_QR(x[2], x[6], x[10], x[14])
+			AVX2_QR(x[3], x[7], x[11], x[15])
+			AVX2_QR(x[0], x[5], x[10], x[15])
+			AVX2_QR(x[1], x[6], x[11], x[12])
+			AVX2_QR(x[2], x[7], x[8], x[13])
+			AVX2_QR(x[3], x[4], x[9], x[14])
+		}
+
+		for (i = 0; i < 16; i++)
+			x[i] = _mm256_add_epi32(x[i], j[i]);
+
+		for (i = 0; i < 16; i++)
+			in[i] = _mm256_loadu_si256((const __m256i *)(m + 32 * i));
+
+		/* words 0..7 then 8..15 of each block, 32 bytes at a time */
+		for (i = 0; i < 16; i += 8) {
+			AVX2_TRANSPOSE(lo, i);
+			AVX2_TRANSPOSE(hi, i + 4);
+			for (k = 0; k < 4; k++) {
+				AVX2_XOR(64 * k + 4 * i, _mm256_permute2x128_si256(lo[k], hi[k], 0x20));
+				AVX2_XOR(64 * (k + 4) + 4 * i, _mm256_permute2x128_si256(lo[k], hi[k], 0x31));
+			}
+		}
+
+		j[12] = _mm256_add_epi32(j[12], _mm256_set1_epi32(8));
+		m += 512;
+		c += 512;
+	}
+
+	return done;
+}
+
+#endif
+
+#ifdef CHACHA_NEON
+
+#define NEON_ROT16(x) vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(x)))
+#define NEON_ROT(x, n) vsriq_n_u32(vshlq_n_u32(x, n), x, 32 - (n))
+
+#define NEON_QR(a, b, c, d) \
+  a = vaddq_u32(a, b); d = veorq_u32(d, a); d = NEON_ROT16(d); \
+  c = vaddq_u32(c, d); b = veorq_u32(b, c); b = NEON_ROT(b, 12); \
+  a = vaddq_u32(a, b); d = veorq_u32(d, a); d = NEON_ROT(d, 8); \
+  c = vaddq_u32(c, d); b = veorq_u32(b, c); b = NEON_ROT(b, 7);
+
+#define NEON_XOR(o, v) \
+  vst1q_u8(c + (o), veorq_u8(in[(o) / 16], vreinterpretq_u8_u32(v)))
+
+/* transpose words w..w+3 of 4 blocks and XOR them with the loaded input into the output */
+#define NEON_OUT(w) \
+  do { \
+    uint32x4x2_t p01 = vtrnq_u32(x[w], x[w + 1]); \
+    uint32x4x2_t p23 = vtrnq_u32(x[w + 2], x[w + 3]); \
+    NEON_XOR(4 * (w), vcombine_u32(vget_low_u32(p01.val[0]), vget_low_u32(p23.val[0]))); \
+    NEON_XOR(64 + 4 * (w), vcombine_u32(vget_low_u32(p01.val[1]), vget_low_u32(p23.val[1]))); \
+    NEON_XOR(128 + 4 * (w), vcombine_u32(vget_high_u32(p01.val[0]), vget_high_u32(p23.val[0]))); \
+    NEON_XOR(192 + 4 * (w), vcombine_u32(vget_high_u32(p01.val[1]), vget_high_u32(p23.val[1]))); \
+  } while (0)
+
+static u32
+chacha_blocks_neon(const u32 *input, const u8 *m, u8 *c, u32 blocks)
+{
+	static const u32 ctr[4] = { 0, 1, 2, 3 };
+	uint32x4_t j[16], x[16];
+	uint8x16_t in[16];
+	u32 done, i;
+
+	for (i = 0; i < 16; i++)
+		j[i] = vdupq_n_u32(input[i]);
+	j[12] = vaddq_u32(j[12], vld1q_u32(ctr));
+
+	for (done = 0; done + 4 <= blocks; done += 4) {
+		for (i = 0; i < 16; i++)
+			x[i] = j[i];
+
+		for (i = 20; i > 0; i -= 2) {
+			NEON_QR(x[0], x[4], x[8], x[12])
+			NEON_QR(x[1], x[5], x[9], x[13])
+			NEON_QR(x[2], x[6], x[10], x[14])
+			NEON_QR(x[3], x[7], x[11], x[15])
+			NEON_QR(x[0], x[5], x[10], x[15])
+			NEON_QR(x[1], x[6], x[11], x[12])
+			NEON_QR(x[2], x[7], x[8], x[13])
+			NEON_QR(x[3], x[4], x[9], x[14])
+		}
+
+		for (i = 0; i < 16; i++)
+			x[i] = vaddq_u32(x[i], j[i]);
+
+		for (i = 0; i < 16; i++)
+			in[i] = vld1q_u8(m + 16 * i);
+
+		NEON_OUT(0);
+		NEON_OUT(4);
+		NEON_OUT(8);
+		NEON_OUT(12);
+
+		j[12] = vaddq_u32(j[12], vdupq_n_u32(4));
+		m += 256;
+		c += 256;
+	}
+
+	return done;
+}
+
+#endif
+
+/* encrypt as many whole blocks as the best available kernel can, returns number of blocks done */
+static inline u32
+chacha_blocks(const u32 *input, const u8 *m, u8 *c, u32 blocks)
+{
+#ifdef CHACHA_AVX2
+	if (blocks >= 8 && __builtin_cpu_supports("avx2")) {
+		u32 n = chacha_blocks_avx2(input, m, c, blocks);
+		if (n == blocks)
+			return n;
+
+		/* rest of the blocks with 4-block kernel */
+		u32 in[16];
+		memcpy(in, input, sizeof(in));
+		in[12] += n;
+		return n + chacha_blocks_sse2(in, m + 64 * n, c + 64 * n, blocks - n);
+	}
+#endif
+#if defined(CHACHA_SSE2)
+	return chacha_blocks_sse2(input, m, c, blocks);
+#elif defined(CHACHA_NEON)
+	return chacha_blocks_neon(input, m, c, blocks);
+#else
+	(void)input; (void)m; (void)c; (void)blocks;
+	return 0;
+#endif
+}
+
 static inline void
 chacha_encrypt_bytes(chacha_ctx *x, const u8 *m, u8 *c, u32 bytes)
 {
@@ -147,6 +424,20 @@ chacha_encrypt_bytes(chacha_ctx *x, const u8 *m, u8 *c, u32 bytes)
 	j14 = x->input[14];
 	j15 = x->input[15];
 
+	/* whole blocks with multi-block kernel */
+	if (bytes >= 4 * 64) {
+		u32 n = chacha_blocks(x->input, m, c, bytes / 64);
+		j12 += n;
+		x->input[12] = j12;
+		m += 64 * n;
+		c += 64 * n;
+		bytes -= 64 * n;
+		if (!bytes) {
+			x->unused = 0;
+			return;
+		}
+	}
+
 	for (;;) {
 		if (bytes < 64) {
 			for (i = 0; i < bytes; ++i)
@@ -300,3 +591,101 @@ void chacha20_encrypt(unsigned char *out, const unsigned char *in, size_t len,
 	chacha_encrypt_bytes(&ctx, in, out, (uint32_t)len);
 }
 
+void chacha20_init(struct chacha_ctx *ctx, const unsigned char key[32],
+    const unsigned char nonce[12])
+{
+	unsigned char counter[8] = { 1, 0, 0, 0, 0, 0, 0, 0 };
+
+	chacha_keysetup(ctx, key, 256);
+	chacha_ivsetup(ctx, nonce, counter);
+	ctx->unused = 0;
+}
+
+void chacha20_update(struct chacha_ctx *ctx, unsigned char *out,
+    const unsigned char *in, size_t len)
+{
+	const uint8_t *k;
+	size_t i, l;
+
+	/* consume keystream left from previous piece */
+	if (ctx->unused > 0) {
+		k = ctx->ks + CHACHA_BLOCKLEN - ctx->unused;
+		l = (len > ctx->unused) ? ctx->unused : len;
+		for (i = 0; i < l; i++)
+			*(out++) = *(in++) ^ *(k++);
+		ctx->unused -= l;
+		len -= l;
+	}
+
+	chacha_encrypt_bytes(ctx, in, out, (uint32_t)len);
+}
+
+#ifdef TEST_VECTORS
+
+/* RFC 7539 2.4.2 and overlapping in-place decryption */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(void)
+{
+	static const unsigned char ct[114] = {
+		0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81,
+		0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2, 0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b,
+		0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab, 0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+		0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35, 0x9f, 0x08, 0x61, 0xd8,
+		0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61, 0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e,
+		0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+		0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 0xb4, 0x0b, 0x8e, 0xed, 0xf2, 0x78, 0x5e, 0x42,
+		0x87, 0x4d
+	};
+	static const char pt[] =
+	    "Ladies and Gentlemen of the class of '99: If I could offer you only one tip "
+	    "for the future, sunscreen would be it.";
+	static const unsigned char nonce[12] = { 0, 0, 0, 0, 0, 0, 0, 0x4a, 0, 0, 0, 0 };
+	/* output below the input by 0, by the 18 bytes of one frame overhead and by 2 + 18 * 3 */
+	static const size_t shift[] = { 0, 1, 18, 56 };
+	unsigned char key[32], out[sizeof(ct)];
+	unsigned char msg[2048], enc[2048], ref[2048], buf[2048 + 64];
+	struct chacha_ctx ctx;
+	size_t i, s, len;
+
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = (unsigned char)i;
+
+	chacha20_encrypt(out, (const unsigned char *)pt, sizeof(ct), key, nonce);
+	if (memcmp(out, ct, sizeof(ct))) {
+		fprintf(stderr, "RFC 7539 2.4.2 failed.\n");
+		exit(1);
+	}
+
+	for (i = 0; i < sizeof(msg); i++)
+		msg[i] = (unsigned char)(i * 7 + 3);
+
+	for (len = 1; len <= sizeof(msg); len++) {
+		/* reference in pieces too short for the multi-block kernels */
+		chacha20_init(&ctx, key, nonce);
+		for (i = 0; i < len; i += 63)
+			chacha20_update(&ctx, ref + i, msg + i, len - i < 63 ? len - i : 63);
+
+		chacha20_encrypt(enc, msg, len, key, nonce);
+		if (memcmp(enc, ref, len)) {
+			fprintf(stderr, "Encrypt failed, len %u.\n", (unsigned)len);
+			exit(1);
+		}
+
+		for (s = 0; s < sizeof(shift) / sizeof(shift[0]); s++) {
+			memcpy(buf + shift[s], enc, len);
+			chacha20_encrypt(buf, buf + shift[s], len, key, nonce);
+			if (memcmp(buf, msg, len)) {
+				fprintf(stderr, "In-place decrypt failed, len %u, shift %u.\n", (unsigned)len, (unsigned)shift[s]);
+				exit(1);
+			}
+		}
+	}
+
+	printf("OK\n");
+	return 0;
+}
+
+#endif /* TEST_VECTORS */
@@ -25,12 +25,25 @@
 extern "C" {
 #endif
 
+struct chacha_ctx {
+	unsigned int input[16];
+	uint8_t ks[64];
+	uint8_t unused;
+};
+
 void chacha20_block(unsigned char *out, const unsigned char key[32],
 		const unsigned char nonce[12]);
 
 void chacha20_encrypt(unsigned char *out, const unsigned char *in, size_t len,
     const unsigned char key[32], const unsigned char nonce[12]);
 
+/* stream of pieces of any length, block counter starts at 1 as in chacha20_encrypt */
+void chacha20_init(struct chacha_ctx *ctx, const unsigned char key[32],
+    const unsigned char nonce[12]);
+
+void chacha20_update(struct chacha_ctx *ctx, unsigned char *out,
+    const unsigned char *in, size_t len);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -1,311 +1,396 @@
 /*
-version 20081011
-Matthew Dempsky
-Public domain.
-Derived from public domain code by D. J. Bernstein.
-*/
+ * Public domain X25519 (RFC 7748) Montgomery ladder.
+ * Derived from public domain curve25519-donna-c64 by Adam Langley
+ * and ref10 by D. J. Bernstein et al.
+ *
+ * On targets with 128-bit integers the field uses five 51-bit limbs,
+ * elsewhere (or with X25519_NO_INT128) the radix 2^25.5 field from
+ * ed25519_fe.c is used.
+ *
+ * The result matches the original Dempsky reference code: the scalar is
+ * clamped here, and bit 255 of the input point is not masked
+ * (it is reduced together with the rest of the value).
+ */
+
+#include <stdint.h>
+#include "ed25519_fe.h"
 
 int curve25519(unsigned char *, const unsigned char *, const unsigned char *);
 
-static void add(unsigned int out[32],const unsigned int a[32],const unsigned int b[32])
+#if defined(__SIZEOF_INT128__) && !defined(X25519_NO_INT128)
+
+typedef uint64_t x25519_fe[5];
+typedef unsigned __int128 x25519_u128;
+
+#define X25519_MASK 0x7ffffffffffffULL
+
+static uint64_t x25519_load64(const unsigned char *s)
 {
-  unsigned int j;
-  unsigned int u;
-  u = 0;
-  for (j = 0;j < 31;++j) { u += a[j] + b[j]; out[j] = u & 255; u >>= 8; }
-  u += a[31] + b[31]; out[31] = u;
+	uint64_t r = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		r = (r << 8) | s[i];
+
+	return r;
 }
 
-static void sub(unsigned int out[32],const unsigned int a[32],const unsigned int b[32])
+static void x25519_store64(unsigned char *s, uint64_t v)
 {
-  unsigned int j;
-  unsigned int u;
-  u = 218;
-  for (j = 0;j < 31;++j) {
-    u += a[j] + 65280 - b[j];
-    out[j] = u & 255;
-    u >>= 8;
-  }
-  u += a[31] - b[31];
-  out[31] = u;
+	int i;
+
+	for (i = 0; i < 8; i++, v >>= 8)
+		s[i] = (unsigned char)v;
 }
 
-static void squeeze(unsigned int a[32])
+// limb 4 keeps bit 255
+static void x25519_frombytes(x25519_fe h, const unsigned char *s)
 {
-  unsigned int j;
-  unsigned int u;
-  u = 0;
-  for (j = 0;j < 31;++j) { u += a[j]; a[j] = u & 255; u >>= 8; }
-  u += a[31]; a[31] = u & 127;
-  u = 19 * (u >> 7);
-  for (j = 0;j < 31;++j) { u += a[j]; a[j] = u & 255; u >>= 8; }
-  u += a[31]; a[31] = u;
+	h[0] = x25519_load64(s) & X25519_MASK;
+	h[1] = (x25519_load64(s + 6) >> 3) & X25519_MASK;
+	h[2] = (x25519_load64(s + 12) >> 6) & X25519_MASK;
+	h[3] = (x25519_load64(s + 19) >> 1) & X25519_MASK;
+	h[4] = x25519_load64(s + 24) >> 12;
 }
 
-static const unsigned int minusp[32] = {
- 19, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 128
-} ;
+static void x25519_1(x25519_fe h)
+{
+	h[0] = 1;
+	h[1] = h[2] = h[3] = h[4] = 0;
+}
 
-static void freeze(unsigned int a[32])
+static void x25519_0(x25519_fe h)
 {
-  unsigned int aorig[32];
-  unsigned int j;
-  unsigned int negative;
-
-  for (j = 0;j < 32;++j) aorig[j] = a[j];
-  add(a,a,minusp);
-  negative = -(int)((a[31] >> 7) & 1);
-  for (j = 0;j < 32;++j) a[j] ^= negative & (aorig[j] ^ a[j]);
+	h[0] = h[1] = h[2] = h[3] = h[4] = 0;
 }
 
-static void mult(unsigned int out[32],const unsigned int a[32],const unsigned int b[32])
+static void x25519_copy(x25519_fe h, const x25519_fe f)
 {
-  unsigned int i;
-  unsigned int j;
-  unsigned int u;
-
-  for (i = 0;i < 32;++i) {
-    u = 0;
-    for (j = 0;j <= i;++j) u += a[j] * b[i - j];
-    for (j = i + 1;j < 32;++j) u += 38 * a[j] * b[i + 32 - j];
-    out[i] = u;
-  }
-  squeeze(out);
+	h[0] = f[0]; h[1] = f[1]; h[2] = f[2]; h[3] = f[3]; h[4] = f[4];
 }
 
-static void mult121665(unsigned int out[32],const unsigned int a[32])
+// inputs are reduced, output limbs < 2^53
+static void x25519_add(x25519_fe h, const x25519_fe f, const x25519_fe g)
 {
-  unsigned int j;
-  unsigned int u;
-
-  u = 0;
-  for (j = 0;j < 31;++j) { u += 121665 * a[j]; out[j] = u & 255; u >>= 8; }
-  u += 121665 * a[31]; out[31] = u & 127;
-  u = 19 * (u >> 7);
-  for (j = 0;j < 31;++j) { u += out[j]; out[j] = u & 255; u >>= 8; }
-  u += out[j]; out[j] = u;
+	h[0] = f[0] + g[0];
+	h[1] = f[1] + g[1];
+	h[2] = f[2] + g[2];
+	h[3] = f[3] + g[3];
+	h[4] = f[4] + g[4];
 }
 
-static void square(unsigned int out[32],const unsigned int a[32])
+// h = f + 4p - g, inputs are reduced, output limbs < 2^54
+static void x25519_sub(x25519_fe h, const x25519_fe f, const x25519_fe g)
 {
-  unsigned int i;
-  unsigned int j;
-  unsigned int u;
-
-  for (i = 0;i < 32;++i) {
-    u = 0;
-    for (j = 0;j < i - j;++j) u += a[j] * a[i - j];
-    for (j = i + 1;j < i + 32 - j;++j) u += 38 * a[j] * a[i + 32 - j];
-    u *= 2;
-    if ((i & 1) == 0) {
-      u += a[i / 2] * a[i / 2];
-      u += 38 * a[i / 2 + 16] * a[i / 2 + 16];
-    }
-    out[i] = u;
-  }
-  squeeze(out);
+	h[0] = f[0] + 0x1fffffffffffb4ULL - g[0];
+	h[1] = f[1] + 0x1ffffffffffffcULL - g[1];
+	h[2] = f[2] + 0x1ffffffffffffcULL - g[2];
+	h[3] = f[3] + 0x1ffffffffffffcULL - g[3];
+	h[4] = f[4] + 0x1ffffffffffffcULL - g[4];
 }
 
-static void select(unsigned int p[64],unsigned int q[64],const unsigned int r[64],const unsigned int s[64],unsigned int b)
+static void x25519_carry(x25519_fe h, x25519_u128 t0, x25519_u128 t1, x25519_u128 t2, x25519_u128 t3, x25519_u128 t4)
 {
-  unsigned int j;
-  unsigned int t;
-  unsigned int bminus1;
-
-  bminus1 = b - 1;
-  for (j = 0;j < 64;++j) {
-    t = bminus1 & (r[j] ^ s[j]);
-    p[j] = s[j] ^ t;
-    q[j] = r[j] ^ t;
-  }
+	uint64_t r0, r1, r2, r3, r4, c;
+
+	r0 = (uint64_t)t0 & X25519_MASK; c = (uint64_t)(t0 >> 51);
+	t1 += c; r1 = (uint64_t)t1 & X25519_MASK; c = (uint64_t)(t1 >> 51);
+	t2 += c; r2 = (uint64_t)t2 & X25519_MASK; c = (uint64_t)(t2 >> 51);
+	t3 += c; r3 = (uint64_t)t3 & X25519_MASK; c = (uint64_t)(t3 >> 51);
+	t4 += c; r4 = (uint64_t)t4 & X25519_MASK; c = (uint64_t)(t4 >> 51);
+	r0 += c * 19; c = r0 >> 51; r0 &= X25519_MASK;
+	r1 += c;
+
+	h[0] = r0; h[1] = r1; h[2] = r2; h[3] = r3; h[4] = r4;
 }
 
-static void mainloop(unsigned int work[64],const unsigned char e[32])
+// input limbs < 2^54, output is reduced
+static void x25519_mul(x25519_fe h, const x25519_fe f, const x25519_fe g)
 {
-  unsigned int xzm1[64];
-  unsigned int xzm[64];
-  unsigned int xzmb[64];
-  unsigned int xzm1b[64];
-  unsigned int xznb[64];
-  unsigned int xzn1b[64];
-  unsigned int a0[64];
-  unsigned int a1[64];
-  unsigned int b0[64];
-  unsigned int b1[64];
-  unsigned int c1[64];
-  unsigned int r[32];
-  unsigned int s[32];
-  unsigned int t[32];
-  unsigned int u[32];
-  unsigned int j;
-  unsigned int b;
-  int pos;
-
-  for (j = 0;j < 32;++j) xzm1[j] = work[j];
-  xzm1[32] = 1;
-  for (j = 33;j < 64;++j) xzm1[j] = 0;
-
-  xzm[0] = 1;
-  for (j = 1;j < 64;++j) xzm[j] = 0;
-
-  for (pos = 254;pos >= 0;--pos) {
-    b = e[pos / 8] >> (pos & 7);
-    b &= 1;
-    select(xzmb,xzm1b,xzm,xzm1,b);
-    add(a0,xzmb,xzmb + 32);
-    sub(a0 + 32,xzmb,xzmb + 32);
-    add(a1,xzm1b,xzm1b + 32);
-    sub(a1 + 32,xzm1b,xzm1b + 32);
-    square(b0,a0);
-    square(b0 + 32,a0 + 32);
-    mult(b1,a1,a0 + 32);
-    mult(b1 + 32,a1 + 32,a0);
-    add(c1,b1,b1 + 32);
-    sub(c1 + 32,b1,b1 + 32);
-    square(r,c1 + 32);
-    sub(s,b0,b0 + 32);
-    mult121665(t,s);
-    add(u,t,b0);
-    mult(xznb,b0,b0 + 32);
-    mult(xznb + 32,s,u);
-    square(xzn1b,c1);
-    mult(xzn1b + 32,r,work);
-    select(xzm,xzm1,xznb,xzn1b,b);
-  }
-
-  for (j = 0;j < 64;++j) work[j] = xzm[j];
+	uint64_t f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+	uint64_t g0 = g[0], g1 = g[1], g2 = g[2], g3 = g[3], g4 = g[4];
+	uint64_t g1_19 = g1 * 19, g2_19 = g2 * 19, g3_19 = g3 * 19, g4_19 = g4 * 19;
+
+	x25519_u128 t0 = (x25519_u128)f0 * g0 + (x25519_u128)f1 * g4_19 + (x25519_u128)f2 * g3_19 + (x25519_u128)f3 * g2_19 + (x25519_u128)f4 * g1_19;
+	x25519_u128 t1 = (x25519_u128)f0 * g1 + (x25519_u128)f1 * g0 + (x25519_u128)f2 * g4_19 + (x25519_u128)f3 * g3_19 + (x25519_u128)f4 * g2_19;
+	x25519_u128 t2 = (x25519_u128)f0 * g2 + (x25519_u128)f1 * g1 + (x25519_u128)f2 * g0 + (x25519_u128)f3 * g4_19 + (x25519_u128)f4 * g3_19;
+	x25519_u128 t3 = (x25519_u128)f0 * g3 + (x25519_u128)f1 * g2 + (x25519_u128)f2 * g1 + (x25519_u128)f3 * g0 + (x25519_u128)f4 * g4_19;
+	x25519_u128 t4 = (x25519_u128)f0 * g4 + (x25519_u128)f1 * g3 + (x25519_u128)f2 * g2 + (x25519_u128)f3 * g1 + (x25519_u128)f4 * g0;
+
+	x25519_carry(h, t0, t1, t2, t3, t4);
 }
 
-static void recip(unsigned int out[32],const unsigned int z[32])
+// input limbs < 2^54, output is reduced
+static void x25519_sq(x25519_fe h, const x25519_fe f)
 {
-  unsigned int z2[32];
-  unsigned int z9[32];
-  unsigned int z11[32];
-  unsigned int z2_5_0[32];
-  unsigned int z2_10_0[32];
-  unsigned int z2_20_0[32];
-  unsigned int z2_50_0[32];
-  unsigned int z2_100_0[32];
-  unsigned int t0[32];
-  unsigned int t1[32];
-  int i;
-
-  /* 2 */ square(z2,z);
-  /* 4 */ square(t1,z2);
-  /* 8 */ square(t0,t1);
-  /* 9 */ mult(z9,t0,z);
-  /* 11 */ mult(z11,z9,z2);
-  /* 22 */ square(t0,z11);
-  /* 2^5 - 2^0 = 31 */ mult(z2_5_0,t0,z9);
-
-  /* 2^6 - 2^1 */ square(t0,z2_5_0);
-  /* 2^7 - 2^2 */ square(t1,t0);
-  /* 2^8 - 2^3 */ square(t0,t1);
-  /* 2^9 - 2^4 */ square(t1,t0);
-  /* 2^10 - 2^5 */ square(t0,t1);
-  /* 2^10 - 2^0 */ mult(z2_10_0,t0,z2_5_0);
-
-  /* 2^11 - 2^1 */ square(t0,z2_10_0);
-  /* 2^12 - 2^2 */ square(t1,t0);
-  /* 2^20 - 2^10 */ for (i = 2;i < 10;i += 2) { square(t0,t1); square(t1,t0); }
-  /* 2^20 - 2^0 */ mult(z2_20_0,t1,z2_10_0);
-
-  /* 2^21 - 2^1 */ square(t0,z2_20_0);
-  /* 2^22 - 2^2 */ square(t1,t0);
-  /* 2^40 - 2^20 */ for (i = 2;i < 20;i += 2) { square(t0,t1); square(t1,t0); }
-  /* 2^40 - 2^0 */ mult(t0,t1,z2_20_0);
-
-  /* 2^41 - 2^1 */ square(t1,t0);
-  /* 2^42 - 2^2 */ square(t0,t1);
-  /* 2^50 - 2^10 */ for (i = 2;i < 10;i += 2) { square(t1,t0); square(t0,t1); }
-  /* 2^50 - 2^0 */ mult(z2_50_0,t0,z2_10_0);
-
-  /* 2^51 - 2^1 */ square(t0,z2_50_0);
-  /* 2^52 - 2^2 */ square(t1,t0);
-  /* 2^100 - 2^50 */ for (i = 2;i < 50;i += 2) { square(t0,t1); square(t1,t0); }
-  /* 2^100 - 2^0 */ mult(z2_100_0,t1,z2_50_0);
-
-  /* 2^101 - 2^1 */ square(t1,z2_100_0);
-  /* 2^102 - 2^2 */ square(t0,t1);
-  /* 2^200 - 2^100 */ for (i = 2;i < 100;i += 2) { square(t1,t0); square(t0,t1); }
-  /* 2^200 - 2^0 */ mult(t1,t0,z2_100_0);
-
-  /* 2^201 - 2^1 */ square(t0,t1);
-  /* 2^202 - 2^2 */ square(t1,t0);
-  /* 2^250 - 2^50 */ for (i = 2;i < 50;i += 2) { square(t0,t1); square(t1,t0); }
-  /* 2^250 - 2^0 */ mult(t0,t1,z2_50_0);
-
-  /* 2^251 - 2^1 */ square(t1,t0);
-  /* 2^252 - 2^2 */ square(t0,t1);
-  /* 2^253 - 2^3 */ square(t1,t0);
-  /* 2^254 - 2^4 */ square(t0,t1);
-  /* 2^255 - 2^5 */ square(t1,t0);
-  /* 2^255 - 21 */ mult(out,t1,z11);
+	uint64_t f0 = f[0], f1 = f[1], f2 = f[2], f3 = f[3], f4 = f[4];
+	uint64_t d0 = f0 * 2, d1 = f1 * 2, d2_19 = f2 * 2 * 19, f4_19 = f4 * 19, d4_19 = f4_19 * 2;
+
+	x25519_u128 t0 = (x25519_u128)f0 * f0 + (x25519_u128)d4_19 * f1 + (x25519_u128)d2_19 * f3;
+	x25519_u128 t1 = (x25519_u128)d0 * f1 + (x25519_u128)d4_19 * f2 + (x25519_u128)f3 * (f3 * 19);
+	x25519_u128 t2 = (x25519_u128)d0 * f2 + (x25519_u128)f1 * f1 + (x25519_u128)d4_19 * f3;
+	x25519_u128 t3 = (x25519_u128)d0 * f3 + (x25519_u128)d1 * f2 + (x25519_u128)f4 * f4_19;
+	x25519_u128 t4 = (x25519_u128)d0 * f4 + (x25519_u128)d1 * f3 + (x25519_u128)f2 * f2;
+
+	x25519_carry(h, t0, t1, t2, t3, t4);
 }
 
-int curve25519(unsigned char *q,
-  const unsigned char *n,
-  const unsigned char *p)
+// input is reduced, output is reduced
+static void x25519_mul121666(x25519_fe h, const x25519_fe f)
 {
-  unsigned int work[96];
-  unsigned char e[32];
-  unsigned int i;
-  for (i = 0;i < 32;++i) e[i] = n[i];
-  e[0] &= 248;
-  e[31] &= 127;
-  e[31] |= 64;
-  for (i = 0;i < 32;++i) work[i] = p[i];
-  mainloop(work,e);
-  recip(work + 32,work + 32);
-  mult(work + 64,work,work + 32);
-  freeze(work + 64);
-  for (i = 0;i < 32;++i) q[i] = work[64 + i];
-  return 0;
+	x25519_carry(h,
+		(x25519_u128)f[0] * 121666,
+		(x25519_u128)f[1] * 121666,
+		(x25519_u128)f[2] * 121666,
+		(x25519_u128)f[3] * 121666,
+		(x25519_u128)f[4] * 121666);
 }
 
-#ifdef TEST
+static void x25519_cswap(x25519_fe f, x25519_fe g, unsigned int b)
+{
+	uint64_t mask = (uint64_t)0 - b;
+	int i;
+
+	for (i = 0; i < 5; i++)
+	{
+		uint64_t x = mask & (f[i] ^ g[i]);
+		f[i] ^= x;
+		g[i] ^= x;
+	}
+}
 
-#include <stdio.h>
+static void x25519_sqn(x25519_fe h, const x25519_fe f, int n)
+{
+	x25519_sq(h, f);
+	while (--n > 0)
+		x25519_sq(h, h);
+}
 
-void doit(unsigned char *ek,unsigned char *e,unsigned char *k)
+// out = z^(p-2)
+static void x25519_invert(x25519_fe out, const x25519_fe z)
 {
-  int i;
+	x25519_fe a, b, c, t;
+
+	/* 2 */				x25519_sq(a, z);
+	/* 8 */				x25519_sqn(t, a, 2);
+	/* 9 */				x25519_mul(b, t, z);
+	/* 11 */			x25519_mul(a, b, a);
+	/* 22 */			x25519_sq(t, a);
+	/* 2^5 - 2^0 */		x25519_mul(b, t, b);
+	/* 2^10 - 2^5 */	x25519_sqn(t, b, 5);
+	/* 2^10 - 2^0 */	x25519_mul(b, t, b);
+	/* 2^20 - 2^10 */	x25519_sqn(t, b, 10);
+	/* 2^20 - 2^0 */	x25519_mul(c, t, b);
+	/* 2^40 - 2^20 */	x25519_sqn(t, c, 20);
+	/* 2^40 - 2^0 */	x25519_mul(t, t, c);
+	/* 2^50 - 2^10 */	x25519_sqn(t, t, 10);
+	/* 2^50 - 2^0 */	x25519_mul(b, t, b);
+	/* 2^100 - 2^50 */	x25519_sqn(t, b, 50);
+	/* 2^100 - 2^0 */	x25519_mul(c, t, b);
+	/* 2^200 - 2^100 */	x25519_sqn(t, c, 100);
+	/* 2^200 - 2^0 */	x25519_mul(t, t, c);
+	/* 2^250 - 2^50 */	x25519_sqn(t, t, 50);
+	/* 2^250 - 2^0 */	x25519_mul(t, t, b);
+	/* 2^255 - 2^5 */	x25519_sqn(t, t, 5);
+	/* 2^255 - 21 */	x25519_mul(out, t, a);
+}
 
-  for (i = 0;i < 32;++i) printf("%02x",(unsigned int) e[i]); printf(" ");
-  for (i = 0;i < 32;++i) printf("%02x",(unsigned int) k[i]); printf(" ");
-  curve25519(ek,e,k);
-  for (i = 0;i < 32;++i) printf("%02x",(unsigned int) ek[i]); printf("\n");
+// write canonical value
+static void x25519_tobytes(unsigned char *s, const x25519_fe f)
+{
+	uint64_t h0 = f[0], h1 = f[1], h2 = f[2], h3 = f[3], h4 = f[4], q;
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		h1 += h0 >> 51; h0 &= X25519_MASK;
+		h2 += h1 >> 51; h1 &= X25519_MASK;
+		h3 += h2 >> 51; h2 &= X25519_MASK;
+		h4 += h3 >> 51; h3 &= X25519_MASK;
+		h0 += (h4 >> 51) * 19; h4 &= X25519_MASK;
+	}
+
+	// q is 1 if h >= p
+	q = (h0 + 19) >> 51;
+	q = (h1 + q) >> 51;
+	q = (h2 + q) >> 51;
+	q = (h3 + q) >> 51;
+	q = (h4 + q) >> 51;
+
+	h0 += 19 * q;
+	h1 += h0 >> 51; h0 &= X25519_MASK;
+	h2 += h1 >> 51; h1 &= X25519_MASK;
+	h3 += h2 >> 51; h2 &= X25519_MASK;
+	h4 += h3 >> 51; h3 &= X25519_MASK;
+	h4 &= X25519_MASK;
+
+	x25519_store64(s, h0 | (h1 << 51));
+	x25519_store64(s + 8, (h1 >> 13) | (h2 << 38));
+	x25519_store64(s + 16, (h2 >> 26) | (h3 << 25));
+	x25519_store64(s + 24, (h3 >> 39) | (h4 << 12));
 }
 
-unsigned char e1k[32];
-unsigned char e2k[32];
-unsigned char e1e2k[32];
-unsigned char e2e1k[32];
-unsigned char e1[32] = {3};
-unsigned char e2[32] = {5};
-unsigned char k[32] = {9};
+#else
 
-int
-main()
+typedef fe x25519_fe;
+
+// bit 255 of the input is 2^255 = 19 mod p
+static void x25519_frombytes(x25519_fe h, const unsigned char *s)
 {
-  int loop;
-  int i;
-
-  for (loop = 0;loop < 100;++loop) {
-    doit(e1k,e1,k);
-    doit(e2e1k,e2,e1k);
-    doit(e2k,e2,k);
-    doit(e1e2k,e1,e2k);
-    for (i = 0;i < 32;++i) if (e1e2k[i] != e2e1k[i]) {
-      printf("fail\n");
-      return 1;
-    }
-    for (i = 0;i < 32;++i) e1[i] ^= e2k[i];
-    for (i = 0;i < 32;++i) e2[i] ^= e1k[i];
-    for (i = 0;i < 32;++i) k[i] ^= e1e2k[i];
-  }
-
-  return 0;
+	fe_frombytes(h, s);
+	h[0] += 19 * (s[31] >> 7);
 }
 
+#define x25519_0 fe_0
+#define x25519_1 fe_1
+#define x25519_copy fe_copy
+#define x25519_add fe_add
+#define x25519_sub fe_sub
+#define x25519_mul fe_mul
+#define x25519_sq fe_sq
+#define x25519_mul121666 fe_mul121666
+#define x25519_cswap fe_cswap
+#define x25519_invert fe_invert
+#define x25519_tobytes fe_tobytes
+
 #endif
+
+int curve25519(unsigned char *q, const unsigned char *n, const unsigned char *p)
+{
+	unsigned char e[32];
+	x25519_fe x1, x2, z2, x3, z3, tmp0, tmp1;
+	unsigned int swap, b;
+	int i, pos;
+
+	for (i = 0; i < 32; i++)
+		e[i] = n[i];
+	e[0] &= 248;
+	e[31] &= 127;
+	e[31] |= 64;
+
+	x25519_frombytes(x1, p);
+	x25519_1(x2);
+	x25519_0(z2);
+	x25519_copy(x3, x1);
+	x25519_1(z3);
+
+	swap = 0;
+	for (pos = 254; pos >= 0; pos--)
+	{
+		b = (e[pos / 8] >> (pos & 7)) & 1;
+		swap ^= b;
+		x25519_cswap(x2, x3, swap);
+		x25519_cswap(z2, z3, swap);
+		swap = b;
+
+		x25519_sub(tmp0, x3, z3);
+		x25519_sub(tmp1, x2, z2);
+		x25519_add(x2, x2, z2);
+		x25519_add(z2, x3, z3);
+		x25519_mul(z3, tmp0, x2);
+		x25519_mul(z2, z2, tmp1);
+		x25519_sq(tmp0, tmp1);
+		x25519_sq(tmp1, x2);
+		x25519_add(x3, z3, z2);
+		x25519_sub(z2, z3, z2);
+		x25519_mul(x2, tmp1, tmp0);
+		x25519_sub(tmp1, tmp1, tmp0);
+		x25519_sq(z2, z2);
+		x25519_mul121666(z3, tmp1);
+		x25519_sq(x3, x3);
+		x25519_add(tmp0, tmp0, z3);
+		x25519_mul(z3, x1, z2);
+		x25519_mul(z2, tmp1, tmp0);
+	}
+
+	x25519_cswap(x2, x3, swap);
+	x25519_cswap(z2, z3, swap);
+
+	x25519_invert(z2, z2);
+	x25519_mul(x2, x2, z2);
+	x25519_tobytes(q, x2);
+
+	return 0;
+}
+
+#ifdef TEST_VECTORS
+
+/* RFC 7748 5.2 scalar multiplication and 6.1 Diffie-Hellman,
+ * build with -DX25519_NO_INT128 to test the radix 2^25.5 field */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void x25519_hex(unsigned char *b, const char *s)
+{
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		unsigned int v;
+		sscanf(s + 2 * i, "%2x", &v);
+		b[i] = (unsigned char)v;
+	}
+}
+
+static void x25519_check(const char *name, const unsigned char *out, const char *expect)
+{
+	unsigned char e[32];
+
+	x25519_hex(e, expect);
+	if (memcmp(out, e, 32)) {
+		fprintf(stderr, "%s failed.\n", name);
+		exit(1);
+	}
+}
+
+int main(void)
+{
+	unsigned char k[32], u[32], r[32], a[32], b[32], pa[32], pb[32], base[32];
+	int i;
+
+	/* 5.2 test vectors */
+	x25519_hex(k, "a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4");
+	x25519_hex(u, "e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c");
+	curve25519(r, k, u);
+	x25519_check("RFC 7748 5.2 vector 1", r, "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552");
+
+	/* the input has bit 255 set, which is masked by RFC 7748 */
+	x25519_hex(k, "4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d");
+	x25519_hex(u, "e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493");
+	u[31] &= 127;
+	curve25519(r, k, u);
+	x25519_check("RFC 7748 5.2 vector 2", r, "95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957");
+
+	/* 5.2 iterations: k = X25519(k, u), u = old k */
+	memset(k, 0, sizeof(k));
+	k[0] = 9;
+	memcpy(u, k, sizeof(u));
+	for (i = 1; i <= 1000; i++) {
+		curve25519(r, k, u);
+		memcpy(u, k, sizeof(u));
+		memcpy(k, r, sizeof(k));
+		if (i == 1)
+			x25519_check("RFC 7748 5.2 1 iteration", k, "422c8e7a6227d7bca1350b3e2bb7279f7897b87bb6854b783c60e80311ae3079");
+	}
+	x25519_check("RFC 7748 5.2 1000 iterations", k, "684cf59ba83309552800ef566f2f4d3c1c3887c49360e3875f2eb94d99532c51");
+
+	/* 6.1 Diffie-Hellman */
+	memset(base, 0, sizeof(base));
+	base[0] = 9;
+	x25519_hex(a, "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a");
+	x25519_hex(b, "5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb");
+	curve25519(pa, a, base);
+	x25519_check("RFC 7748 6.1 Alice public key", pa, "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a");
+	curve25519(pb, b, base);
+	x25519_check("RFC 7748 6.1 Bob public key", pb, "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f");
+	curve25519(r, a, pb);
+	x25519_check("RFC 7748 6.1 Alice shared secret", r, "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742");
+	curve25519(r, b, pa);
+	x25519_check("RFC 7748 6.1 Bob shared secret", r, "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742");
+
+	printf("OK\n");
+	return 0;
+}
+
+#endif /* TEST_VECTORS */
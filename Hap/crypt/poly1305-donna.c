@@ -7,6 +7,295 @@
 #include <stddef.h>
 #include "poly1305.h"
 
+#if defined(__SIZEOF_INT128__)
+
+/*
+ * poly1305 implementation using 64 bit * 64 bit = 128 bit multiplication
+ * and 128 bit addition, from poly1305-donna-64.h.
+ */
+
+#define poly1305_block_size 16
+
+typedef unsigned __int128 poly1305_u128;
+
+/* 17 + sizeof(size_t) + 8*sizeof(unsigned long long) */
+typedef struct poly1305_state_internal_t {
+	unsigned long long r[3];
+	unsigned long long h[3];
+	unsigned long long pad[2];
+	size_t leftover;
+	unsigned char buffer[poly1305_block_size];
+	unsigned char final;
+} poly1305_state_internal_t;
+
+/* interpret eight 8 bit unsigned integers as a 64 bit unsigned integer in little endian */
+static unsigned long long
+U8TO64(const unsigned char *p)
+{
+	return (((unsigned long long)(p[0] & 0xff)) |
+	    ((unsigned long long)(p[1] & 0xff) <<  8) |
+	    ((unsigned long long)(p[2] & 0xff) << 16) |
+	    ((unsigned long long)(p[3] & 0xff) << 24) |
+	    ((unsigned long long)(p[4] & 0xff) << 32) |
+	    ((unsigned long long)(p[5] & 0xff) << 40) |
+	    ((unsigned long long)(p[6] & 0xff) << 48) |
+	    ((unsigned long long)(p[7] & 0xff) << 56));
+}
+
+/* store a 64 bit unsigned integer as eight 8 bit unsigned integers in little endian */
+static void
+U64TO8(unsigned char *p, unsigned long long v)
+{
+	p[0] = (v) & 0xff;
+	p[1] = (v >>  8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+	p[4] = (v >> 32) & 0xff;
+	p[5] = (v >> 40) & 0xff;
+	p[6] = (v >> 48) & 0xff;
+	p[7] = (v >> 56) & 0xff;
+}
+
+void
+poly1305_init(poly1305_context *ctx, const unsigned char key[32])
+{
+	poly1305_state_internal_t *st = (poly1305_state_internal_t *)ctx;
+	unsigned long long t0, t1;
+
+	/* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+	t0 = U8TO64(&key[0]);
+	t1 = U8TO64(&key[8]);
+
+	st->r[0] = (t0) & 0xffc0fffffff;
+	st->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+	st->r[2] = ((t1 >> 24)) & 0x00ffffffc0f;
+
+	/* h = 0 */
+	st->h[0] = 0;
+	st->h[1] = 0;
+	st->h[2] = 0;
+
+	/* save pad for later */
+	st->pad[0] = U8TO64(&key[16]);
+	st->pad[1] = U8TO64(&key[24]);
+
+	st->leftover = 0;
+	st->final = 0;
+}
+
+/* h *= r, partially reduced */
+static inline void
+poly1305_mul(unsigned long long h[3], const unsigned long long r[3])
+{
+	unsigned long long r0 = r[0], r1 = r[1], r2 = r[2];
+	unsigned long long s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+	unsigned long long h0 = h[0], h1 = h[1], h2 = h[2];
+	poly1305_u128 d0, d1, d2;
+	unsigned long long c;
+
+	d0 = (poly1305_u128)h0 * r0 + (poly1305_u128)h1 * s2 + (poly1305_u128)h2 * s1;
+	d1 = (poly1305_u128)h0 * r1 + (poly1305_u128)h1 * r0 + (poly1305_u128)h2 * s2;
+	d2 = (poly1305_u128)h0 * r2 + (poly1305_u128)h1 * r1 + (poly1305_u128)h2 * r0;
+
+	/* (partial) h %= p */
+	c = (unsigned long long)(d0 >> 44);
+	h0 = (unsigned long long)d0 & 0xfffffffffff;
+	d1 += c;
+	c = (unsigned long long)(d1 >> 44);
+	h1 = (unsigned long long)d1 & 0xfffffffffff;
+	d2 += c;
+	c = (unsigned long long)(d2 >> 42);
+	h2 = (unsigned long long)d2 & 0x3ffffffffff;
+	h0 += c * 5;
+	c = (h0 >> 44);
+	h0 = h0 & 0xfffffffffff;
+	h1 += c;
+
+	h[0] = h0;
+	h[1] = h1;
+	h[2] = h2;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define POLY1305_AVX2
+#include <immintrin.h>
+
+/*
+ * 4 blocks at a time with AVX2: lane j of the accumulator takes blocks j, j + 4, ...
+ * and is multiplied by r^4 each step, the last step multiplies the lanes by
+ * r^4, r^3, r^2, r and their sum is the usual h. Lanes use 26 bit limbs.
+ */
+
+#define POLY1305_MASK26 0x3ffffff
+
+/* convert partially reduced 44 bit limbs to 26 bit limbs */
+static void
+poly1305_to26(unsigned long long l[5], const unsigned long long h[3])
+{
+	unsigned long long h0 = h[0], h1 = h[1], h2 = h[2];
+
+	h1 += h0 >> 44;
+	h0 &= 0xfffffffffff;
+	h2 += h1 >> 44;
+	h1 &= 0xfffffffffff;
+
+	l[0] = h0 & POLY1305_MASK26;
+	l[1] = ((h0 >> 26) | (h1 << 18)) & POLY1305_MASK26;
+	l[2] = (h1 >> 8) & POLY1305_MASK26;
+	l[3] = ((h1 >> 34) | (h2 << 10)) & POLY1305_MASK26;
+	l[4] = h2 >> 16;
+}
+
+/* convert 26 bit limbs to partially reduced 44 bit limbs */
+static void
+poly1305_from26(unsigned long long h[3], unsigned long long l[5])
+{
+	unsigned long long c, t;
+	int i;
+
+	for (i = 0, c = 0; i < 5; i++) {
+		l[i] += c;
+		c = l[i] >> 26;
+		l[i] &= POLY1305_MASK26;
+	}
+	l[0] += c * 5;
+
+	t = l[0] + (l[1] << 26);
+	h[0] = t & 0xfffffffffff;
+	t = (t >> 44) + (l[2] << 8) + (l[3] << 34);
+	h[1] = t & 0xfffffffffff;
+	h[2] = (t >> 44) + (l[4] << 16);
+}
+
+#define AVX2_MUL(a, b) _mm256_mul_epu32(a, b)
+#define AVX2_ADD(a, b) _mm256_add_epi64(a, b)
+
+/* processes whole groups of 4 blocks, returns number of bytes done */
+__attribute__((target("avx2"))) static size_t
+poly1305_blocks_avx2(poly1305_state_internal_t *st, const unsigned char *m, size_t bytes)
+{
+	const __m256i mask = _mm256_set1_epi64x(POLY1305_MASK26);
+	const __m256i hibit = _mm256_set1_epi64x(1 << 24);
+	unsigned long long p[4][3], l[4][5], hl[5];
+	unsigned long long acc[4];
+	__m256i h[5], r[5], s[5], rf[5], sf[5];
+	size_t groups = bytes / 64, done = groups * 64;
+	int i;
+
+	/* r, r^2, r^3, r^4 */
+	p[0][0] = st->r[0]; p[0][1] = st->r[1]; p[0][2] = st->r[2];
+	for (i = 1; i < 4; i++) {
+		p[i][0] = p[i - 1][0]; p[i][1] = p[i - 1][1]; p[i][2] = p[i - 1][2];
+		poly1305_mul(p[i], st->r);
+	}
+	for (i = 0; i < 4; i++)
+		poly1305_to26(l[i], p[i]);
+
+	for (i = 0; i < 5; i++) {
+		r[i] = _mm256_set1_epi64x((long long)l[3][i]);
+		s[i] = _mm256_set1_epi64x((long long)(l[3][i] * 5));
+		rf[i] = _mm256_set_epi64x((long long)l[0][i], (long long)l[1][i], (long long)l[2][i], (long long)l[3][i]);
+		sf[i] = _mm256_set_epi64x((long long)(l[0][i] * 5), (long long)(l[1][i] * 5), (long long)(l[2][i] * 5), (long long)(l[3][i] * 5));
+	}
+
+	poly1305_to26(hl, st->h);
+	for (i = 0; i < 5; i++)
+		h[i] = _mm256_set_epi64x(0, 0, 0, (long long)hl[i]);
+
+	while (groups-- > 0) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)m);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(m + 32));
+		__m256i lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), 0xD8);
+		__m256i hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), 0xD8);
+		__m256i d0, d1, d2, d3, d4, c;
+		const __m256i *rr = groups ? r : rf;
+		const __m256i *ss = groups ? s : sf;
+
+		/* h += m[i] */
+		h[0] = AVX2_ADD(h[0], _mm256_and_si256(lo, mask));
+		h[1] = AVX2_ADD(h[1], _mm256_and_si256(_mm256_srli_epi64(lo, 26), mask));
+		h[2] = AVX2_ADD(h[2], _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo, 52), _mm256_slli_epi64(hi, 12)), mask));
+		h[3] = AVX2_ADD(h[3], _mm256_and_si256(_mm256_srli_epi64(hi, 14), mask));
+		h[4] = AVX2_ADD(h[4], _mm256_or_si256(_mm256_srli_epi64(hi, 40), hibit));
+
+		/* h *= r */
+		d0 = AVX2_ADD(AVX2_ADD(AVX2_ADD(AVX2_ADD(AVX2_MUL(h[0], rr[0]), AVX2_MUL(h[1], ss[4])), AVX2_MUL(h[2], ss[3])), AVX2_MUL(h[3], ss[2])), AVX2_MUL(h[4], ss[1]));
+		d1 = AVX2_ADD(AVX2_ADD(AVX2_ADD(AVX2_ADD(AVX2_MUL(h[0], rr[1]), AVX2_MUL(h[1], rr[0])), AVX2_MUL(h[2], ss[4])), AVX2_MUL(h[3], ss[3])), AVX2_MUL(h[4], ss[2]));
+		d2 = AVX2_ADD(AVX2_ADD(AVX2_ADD(AVX2_ADD(AVX2_MUL(h[0], rr[2]), AVX2_MUL(h[1], rr[1])), AVX2_MUL(h[2], rr[0])), AVX2_MUL(h[3], ss[4])), AVX2_MUL(h[4], ss[3]));
+		d3 = AVX2_ADD(AVX2_ADD(AVX2_ADD(AVX2_ADD(AVX2_MUL(h[0], rr[3]), AVX2_MUL(h[1], rr[2])), AVX2_MUL(h[2], rr[1])), AVX2_MUL(h[3], rr[0])), AVX2_MUL(h[4], ss[4]));
+		d4 = AVX2_ADD(AVX2_ADD(AVX2_ADD(AVX2_ADD(AVX2_MUL(h[0], rr[4]), AVX2_MUL(h[1], rr[3])), AVX2_MUL(h[2], rr[2])), AVX2_MUL(h[3], rr[1])), AVX2_MUL(h[4], rr[0]));
+
+		/* (partial) h %= p */
+		c = _mm256_srli_epi64(d0, 26); h[0] = _mm256_and_si256(d0, mask); d1 = AVX2_ADD(d1, c);
+		c = _mm256_srli_epi64(d1, 26); h[1] = _mm256_and_si256(d1, mask); d2 = AVX2_ADD(d2, c);
+		c = _mm256_srli_epi64(d2, 26); h[2] = _mm256_and_si256(d2, mask); d3 = AVX2_ADD(d3, c);
+		c = _mm256_srli_epi64(d3, 26); h[3] = _mm256_and_si256(d3, mask); d4 = AVX2_ADD(d4, c);
+		c = _mm256_srli_epi64(d4, 26); h[4] = _mm256_and_si256(d4, mask);
+		h[0] = AVX2_ADD(h[0], AVX2_ADD(c, _mm256_slli_epi64(c, 2)));
+		c = _mm256_srli_epi64(h[0], 26); h[0] = _mm256_and_si256(h[0], mask); h[1] = AVX2_ADD(h[1], c);
+
+		m += 64;
+	}
+
+	/* sum the lanes */
+	for (i = 0; i < 5; i++) {
+		_mm256_storeu_si256((__m256i *)acc, h[i]);
+		hl[i] = acc[0] + acc[1] + acc[2] + acc[3];
+	}
+	poly1305_from26(st->h, hl);
+
+	return done;
+}
+
+#endif
+
+static void
+poly1305_blocks(poly1305_state_internal_t *st, const unsigned char *m, size_t bytes)
+{
+	const unsigned long long hibit = (st->final) ? 0 : ((unsigned long long)1 << 40); /* 1 << 128 */
+	unsigned long long r[3], h[3];
+	unsigned long long t0, t1;
+
+#ifdef POLY1305_AVX2
+	/* r^2..r^4 cost a few blocks, only worth it for longer messages */
+	if (bytes >= 256 && !st->final && __builtin_cpu_supports("avx2")) {
+		size_t done = poly1305_blocks_avx2(st, m, bytes);
+		m += done;
+		bytes -= done;
+	}
+#endif
+
+	r[0] = st->r[0];
+	r[1] = st->r[1];
+	r[2] = st->r[2];
+
+	h[0] = st->h[0];
+	h[1] = st->h[1];
+	h[2] = st->h[2];
+
+	while (bytes >= poly1305_block_size) {
+		t0 = U8TO64(&m[0]);
+		t1 = U8TO64(&m[8]);
+
+		/* h += m[i] */
+		h[0] += ((t0) & 0xfffffffffff);
+		h[1] += (((t0 >> 44) | (t1 << 20)) & 0xfffffffffff);
+		h[2] += (((t1 >> 24)) & 0x3ffffffffff) | hibit;
+
+		/* h *= r */
+		poly1305_mul(h, r);
+
+		m += poly1305_block_size;
+		bytes -= poly1305_block_size;
+	}
+
+	st->h[0] = h[0];
+	st->h[1] = h[1];
+	st->h[2] = h[2];
+}
+
+#else
+
 /*
  * poly1305 implementation using 32 bit * 32 bit = 64 bit multiplication
  * and 64 bit addition.
@@ -166,6 +455,8 @@ poly1305_blocks(poly1305_state_internal_t *st, const unsigned char *m, size_t by
 	st->h[4] = h4;
 }
 
+#endif
+
 void
 poly1305_update(poly1305_context *ctx, const unsigned char *m, size_t bytes)
 {
@@ -204,6 +495,102 @@ poly1305_update(poly1305_context *ctx, const unsigned char *m, size_t bytes)
 	}
 }
 
+#if defined(__SIZEOF_INT128__)
+
+void
+poly1305_finish(poly1305_context *ctx, unsigned char mac[16])
+{
+	poly1305_state_internal_t *st = (poly1305_state_internal_t *)ctx;
+	unsigned long long h0, h1, h2, c;
+	unsigned long long g0, g1, g2;
+	unsigned long long t0, t1;
+
+	/* process the remaining block */
+	if (st->leftover) {
+		size_t i = st->leftover;
+		st->buffer[i++] = 1;
+		for (; i < poly1305_block_size; i++)
+			st->buffer[i] = 0;
+		st->final = 1;
+		poly1305_blocks(st, st->buffer, poly1305_block_size);
+	}
+
+	/* fully carry h */
+	h0 = st->h[0];
+	h1 = st->h[1];
+	h2 = st->h[2];
+
+	c = (h1 >> 44);
+	h1 &= 0xfffffffffff;
+	h2 += c;
+	c = (h2 >> 42);
+	h2 &= 0x3ffffffffff;
+	h0 += c * 5;
+	c = (h0 >> 44);
+	h0 &= 0xfffffffffff;
+	h1 += c;
+	c = (h1 >> 44);
+	h1 &= 0xfffffffffff;
+	h2 += c;
+	c = (h2 >> 42);
+	h2 &= 0x3ffffffffff;
+	h0 += c * 5;
+	c = (h0 >> 44);
+	h0 &= 0xfffffffffff;
+	h1 += c;
+
+	/* compute h + -p */
+	g0 = h0 + 5;
+	c = (g0 >> 44);
+	g0 &= 0xfffffffffff;
+	g1 = h1 + c;
+	c = (g1 >> 44);
+	g1 &= 0xfffffffffff;
+	g2 = h2 + c - ((unsigned long long)1 << 42);
+
+	/* select h if h < p, or h + -p if h >= p */
+	c = (g2 >> ((sizeof(unsigned long long) * 8) - 1)) - 1;
+	g0 &= c;
+	g1 &= c;
+	g2 &= c;
+	c = ~c;
+	h0 = (h0 & c) | g0;
+	h1 = (h1 & c) | g1;
+	h2 = (h2 & c) | g2;
+
+	/* h = (h + pad) */
+	t0 = st->pad[0];
+	t1 = st->pad[1];
+
+	h0 += ((t0) & 0xfffffffffff);
+	c = (h0 >> 44);
+	h0 &= 0xfffffffffff;
+	h1 += (((t0 >> 44) | (t1 << 20)) & 0xfffffffffff) + c;
+	c = (h1 >> 44);
+	h1 &= 0xfffffffffff;
+	h2 += (((t1 >> 24)) & 0x3ffffffffff) + c;
+	h2 &= 0x3ffffffffff;
+
+	/* mac = h % (2^128) */
+	h0 = ((h0) | (h1 << 44));
+	h1 = ((h1 >> 20) | (h2 << 24));
+
+	U64TO8(&mac[0], h0);
+	U64TO8(&mac[8], h1);
+
+	/* zero out the state */
+	st->h[0] = 0;
+	st->h[1] = 0;
+	st->h[2] = 0;
+	st->r[0] = 0;
+	st->r[1] = 0;
+	st->r[2] = 0;
+	st->pad[0] = 0;
+	st->pad[1] = 0;
+}
+
+#else
+
 void
 poly1305_finish(poly1305_context *ctx, unsigned char mac[16])
 {
@@ -312,3 +699,91 @@ poly1305_finish(poly1305_context *ctx, unsigned char mac[16])
 	st->pad[2] = 0;
 	st->pad[3] = 0;
 }
+
+#endif
+
+#ifdef TEST_VECTORS
+
+/* RFC 7539 2.5.2, and messages long enough for the AVX2 blocks (>= 256 bytes)
+ * of all lengths checked against the same message fed in short pieces */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void
+poly1305_auth(unsigned char mac[16], const unsigned char *m, size_t bytes, const unsigned char key[32])
+{
+	poly1305_context ctx;
+
+	poly1305_init(&ctx, key);
+	poly1305_update(&ctx, m, bytes);
+	poly1305_finish(&ctx, mac);
+}
+
+int main(void)
+{
+	static const unsigned char rfc_key[32] = {
+		0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33, 0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+		0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd, 0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b
+	};
+	static const char rfc_msg[] = "Cryptographic Forum Research Group";
+	static const unsigned char rfc_tag[16] = {
+		0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6, 0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9
+	};
+	/* key 00..1f, message (i * 7 + 3) & 0xff, 1000 bytes */
+	static const unsigned char long_tag[16] = {
+		0xb7, 0x4c, 0xe6, 0x6f, 0x76, 0xa2, 0x56, 0x6f, 0xb0, 0x05, 0x29, 0x67, 0xc1, 0x46, 0xde, 0x6d
+	};
+	unsigned char key[32], msg[2048], mac[16], ref[16];
+	poly1305_context ctx;
+	size_t i, len;
+
+	poly1305_auth(mac, (const unsigned char *)rfc_msg, sizeof(rfc_msg) - 1, rfc_key);
+	if (memcmp(mac, rfc_tag, sizeof(mac))) {
+		fprintf(stderr, "RFC 7539 2.5.2 failed.\n");
+		exit(1);
+	}
+
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = (unsigned char)i;
+	for (i = 0; i < sizeof(msg); i++)
+		msg[i] = (unsigned char)(i * 7 + 3);
+
+	poly1305_auth(mac, msg, 1000, key);
+	if (memcmp(mac, long_tag, sizeof(mac))) {
+		fprintf(stderr, "1000 byte message failed.\n");
+		exit(1);
+	}
+
+	for (len = 0; len <= sizeof(msg); len++) {
+		/* reference in pieces too short for the AVX2 blocks */
+		poly1305_init(&ctx, key);
+		for (i = 0; i < len; i += 63)
+			poly1305_update(&ctx, msg + i, len - i < 63 ? len - i : 63);
+		poly1305_finish(&ctx, ref);
+
+		poly1305_auth(mac, msg, len, key);
+		if (memcmp(mac, ref, sizeof(mac))) {
+			fprintf(stderr, "Failed, len %u.\n", (unsigned)len);
+			exit(1);
+		}
+
+		/* odd leftover before a long update */
+		if (len > 7) {
+			poly1305_init(&ctx, key);
+			poly1305_update(&ctx, msg, 7);
+			poly1305_update(&ctx, msg + 7, len - 7);
+			poly1305_finish(&ctx, mac);
+			if (memcmp(mac, ref, sizeof(mac))) {
+				fprintf(stderr, "Failed after leftover, len %u.\n", (unsigned)len);
+				exit(1);
+			}
+		}
+	}
+
+	printf("OK\n");
+	return 0;
+}
+
+#endif /* TEST_VECTORS */
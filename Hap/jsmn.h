@@ -45,7 +45,7 @@ typedef struct {
 	int8_t type;
 	int8_t size;
 #ifdef JSMN_PARENT_LINKS
-	int8_t parent;
+	int16_t parent;
 #endif
 } jsmntok_t;
 
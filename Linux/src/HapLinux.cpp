@@ -26,12 +26,223 @@ SOFTWARE.
 #include "HapCrypt.cpp"
 #include "HapSrp.cpp"
 #include "HapHttp.cpp"
+#include "HapLoopback.cpp"
 #include "jsmn.cpp"
 #include "picohttpparser.cpp"
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
 // HAP logging functions
+//	Log formats the message in the calling thread into a slot of lock-free ring,
+//	the logger thread writes completed slots to stdout, so network threads never
+//	block on console output. When the ring is full the message is dropped and counted.
+//	The logger is created on first use and never destroyed, so Log stays usable from
+//	static destructors and threads running at exit; the logger thread is stopped at exit
+//	and later messages are written synchronously.
 namespace Hap
 {
+	class Logger
+	{
+	private:
+		static constexpr uint16_t Slots = 256;		// power of 2
+		static constexpr uint16_t LineSize = 160;	// longer messages take several consecutive slots
+		static constexpr uint16_t MaxSlots = 32;	// longer messages are truncated
+
+		// slot is free for producer at ticket pos when seq == pos,
+		//	and has message for consumer when seq == pos + 1
+		struct Slot
+		{
+			std::atomic<uint32_t> seq;
+			uint16_t len;
+			char text[LineSize];
+		};
+
+		Slot _slot[Slots];
+		std::atomic<uint32_t> _tail;	// next producer ticket
+		uint32_t _head = 0;				// next consumer ticket
+		std::atomic<uint32_t> _dropped;
+		std::atomic<bool> _running;
+		std::atomic<bool> _waiting;		// logger thread sleeps on _wake
+		std::mutex _lock;
+		std::condition_variable _wake;
+		std::thread _task;
+
+		// completed message is available for the consumer
+		bool ready()
+		{
+			return _slot[_head & (Slots - 1)].seq.load(std::memory_order_acquire) == _head + 1;
+		}
+
+		// wake up the logger thread if it sleeps, called after the fence in write
+		void wake()
+		{
+			if (_waiting.load(std::memory_order_relaxed))
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				_wake.notify_one();
+			}
+		}
+
+		// write out all completed messages, returns false if there were none
+		bool drain()
+		{
+			char out[2048];
+			uint16_t len = 0;
+
+			while (ready())
+			{
+				Slot& s = _slot[_head & (Slots - 1)];
+
+				if (len + s.len > sizeof(out))
+				{
+					fwrite(out, 1, len, stdout);
+					len = 0;
+				}
+
+				memcpy(out + len, s.text, s.len);
+				len += s.len;
+
+				s.seq.store(_head + Slots, std::memory_order_release);
+				_head++;
+			}
+
+			uint32_t dropped = _dropped.exchange(0);
+			if (len == 0 && dropped == 0)
+				return false;
+
+			fwrite(out, 1, len, stdout);
+			if (dropped != 0)
+				printf("Log: %u messages dropped\n", dropped);
+			fflush(stdout);
+
+			return true;
+		}
+
+		// drains under _lock, producers drain themselves under it once stop has begun
+		void run()
+		{
+			for (;;)
+			{
+				std::unique_lock<std::mutex> lock(_lock);
+
+				// exit only after a drain that follows seeing stop found nothing,
+				//	the fence pairs with the one in write
+				bool running = _running.load(std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (drain())
+					continue;
+				if (!running)
+					break;
+
+				// sleep until a producer publishes a message or stop
+				_waiting.store(true, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (_running && !ready())
+					_wake.wait(lock);
+				_waiting.store(false, std::memory_order_relaxed);
+			}
+		}
+
+	public:
+		Logger()
+		{
+			for (uint32_t i = 0; i < Slots; i++)
+				_slot[i].seq = i;
+
+			_tail = 0;
+			_dropped = 0;
+			_waiting = false;
+			_running = true;
+			_task = std::thread(&Logger::run, this);
+		}
+
+		// stop logger thread and write out what is left in the ring
+		void stop()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				_running = false;
+				_wake.notify_one();
+			}
+
+			if (_task.joinable())
+				_task.join();
+		}
+
+		void write(const char* f, va_list arg)
+		{
+			// format in the caller, truncated message keeps its line end
+			char text[MaxSlots * LineSize];
+			int l = vsnprintf(text, sizeof(text), f, arg);
+			if (l <= 0)
+				return;
+			if (l >= (int)sizeof(text))
+			{
+				l = sizeof(text) - 1;
+				text[l - 1] = '\n';
+			}
+
+			// logger thread is stopped (exit) - write out directly
+			if (!_running)
+			{
+				fwrite(text, 1, l, stdout);
+				fflush(stdout);
+				return;
+			}
+
+			uint32_t n = (l + LineSize - 1) / LineSize;		// slots needed
+			uint32_t pos = _tail.load(std::memory_order_relaxed);
+
+			// claim n consecutive slots, the consumer frees slots in order
+			//	so they are all free when the last one is
+			for (;;)
+			{
+				Slot* s = &_slot[(pos + n - 1) & (Slots - 1)];
+				int32_t d = (int32_t)(s->seq.load(std::memory_order_acquire) - (pos + n - 1));
+
+				if (d == 0)
+				{
+					if (_tail.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+						break;
+				}
+				else if (d < 0)
+				{
+					_dropped++;
+					return;
+				}
+				else
+					pos = _tail.load(std::memory_order_relaxed);
+			}
+
+			for (uint32_t i = 0; i < n; i++)
+			{
+				Slot* s = &_slot[(pos + i) & (Slots - 1)];
+				uint16_t len = l > LineSize ? LineSize : (uint16_t)l;
+
+				memcpy(s->text, text + i * LineSize, len);
+				s->len = len;
+				l -= len;
+
+				s->seq.store(pos + i + 1, std::memory_order_release);
+			}
+
+			// pairs with the fences in run: either the logger sees the published slot,
+			//	or the producer sees it waiting or stopped; when stop has begun the logger
+			//	may be gone already, write out the ring here
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!_running.load(std::memory_order_relaxed))
+			{
+				std::lock_guard<std::mutex> lock(_lock);
+				drain();
+				return;
+			}
+
+			wake();
+		}
+	};
+
 	void Hex(const char* Header, const void* Buffer, size_t Length)
 	{
 		static const char hex[] = "0123456789ABCDEF";
@@ -84,9 +295,22 @@ namespace Hap
 
 	void Log(const char* f, ...)
 	{
+		// intentionally leaked, see above
+		static Logger* logger = []() -> Logger*
+		{
+			Logger* l = new Logger;
+			atexit([]() -> void { logger->stop(); });
+			return l;
+		}();
+
+		if (logLevel < LogInfo)
+			return;
+
 		va_list arg;
 		va_start(arg, f);
 
-		vprintf(f, arg);
+		logger->write(f, arg);
+
+		va_end(arg);
 	}
 }
@@ -22,6 +22,10 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+// epoll based TCP server, the io_uring one is in HapTcpUring.cpp
+
+#ifndef HAP_TCP_URING
+
 #include "Hap.h"
 
 #include <thread>
@@ -32,187 +36,470 @@ SOFTWARE.
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 namespace Hap
 {
+	// Linux TCP server
+	//	one or more edge-triggered epoll reactors, each running on its own thread and owning
+	//	its connections and HTTP sessions, so request parsing, crypto and JSON work
+	//	for different controllers runs on different cores;
+	//	the listening socket is shared by all reactors (EPOLLEXCLUSIVE wakes up only one of them);
+	//	eventfd wakes a reactor up when DB signals pending events or on Stop
 	class TcpImpl : public Tcp
 	{
 	private:
-		std::thread task;
-		bool running = false;
-
-		int server;
-		int client[Hap::MaxHttpSessions + 1];
-		Hap::sid_t sess[Hap::MaxHttpSessions + 1];
+		static constexpr int MaxEvents = MaxHttpSessions + 3;	// all connections + listening socket + eventfd
+		static constexpr int PollTimeout = 1000;				// msec, events are also collected on timeout
 
-		void run()
+		// connection context
+		struct Conn
 		{
-			Log("Tcp::Run - enter\n");
+			int sd = -1;					// client socket, -1 when context is free
+			Hap::sid_t sid = sid_invalid;	// HTTP session
+			bool out = false;				// waiting for socket writability
+			Conn* next = nullptr;			// link in free list
+		};
+
+		// reactor thread
+		class Reactor
+		{
+		private:
+			TcpImpl* tcp = nullptr;
+			uint8_t shard = 0;		// index of this reactor
+			std::thread task;
 
-			struct sockaddr_in address;
-			size_t addrlen = sizeof(address);
+			int ep = -1;
+			int wake = -1;			// eventfd
+			Conn conn[Hap::MaxHttpSessions + 1];
+			Conn* spare = nullptr;		// list of free connection contexts
 
-			while (running)
+			Conn* alloc()
 			{
-				int nfds = 0;
-				fd_set readfds;
-				FD_ZERO(&readfds);
+				Conn* c = spare;
+				if (c != nullptr)
+					spare = c->next;
+				return c;
+			}
 
-				FD_SET(server, &readfds);
-				nfds = server + 1;
+			void release(Conn* c)
+			{
+				c->sd = -1;
+				c->sid = sid_invalid;
+				c->out = false;
+				c->next = spare;
+				spare = c;
+			}
+
+			void disconnect(Conn* c)
+			{
+				struct sockaddr_in address;
+				socklen_t addrlen = sizeof(address);
 
-				for (unsigned i = 0; i < sizeofarr(client); i++)
+				::getpeername(c->sd, (struct sockaddr*)&address, &addrlen);
+				Log("Disconnect socket %d to ip %s  port %d\n", c->sd,
+					::inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+
+				::epoll_ctl(ep, EPOLL_CTL_DEL, c->sd, NULL);
+				::close(c->sd);
+
+				if (c->sid != sid_invalid)
+					tcp->_http->Close(c->sid);
+
+				release(c);
+			}
+
+			// accept pending connections
+			void accept()
+			{
+				struct sockaddr_in address;
+				socklen_t addrlen = sizeof(address);
+
+				while (true)
 				{
-					int sd = client[i];
-					if (sd > 0)
+					int clnt = ::accept4(tcp->server, (struct sockaddr *)&address, &addrlen, SOCK_CLOEXEC);
+					if (clnt < 0)
 					{
-						FD_SET(sd, &readfds);
-						if (sd >= nfds)
-							nfds = sd + 1;
+						if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+							Log("accept error %s\n", strerror(errno));
+						return;
 					}
-				}
 
-				Dbg("Tcp::Run - select\n");
-				timeval to = { 1, 0 };
-				int rc = ::select(nfds, &readfds, NULL, NULL, &to);
-				Dbg("Tcp::Run - select: %d\n", rc);
-				if (rc < 0)
-				{
-					Log("select error %s\n", strerror(errno));
-				}
+					Log("Connection on socket %d from ip %s  port %d, reactor %d\n", clnt,
+						::inet_ntoa(address.sin_addr), ntohs(address.sin_port), shard);
 
-				if (rc == 0)
-				{
-					// timeout, process events
-					for (unsigned i = 0; i < sizeofarr(client); i++)
+					Conn* c = alloc();
+					if (c == nullptr)
 					{
-						int sd = client[i];
-						if (sd == 0)
-							continue;
-
-						Hap::sid_t sid = sess[i];
-						if (sid == Hap::sid_invalid)
-							continue;
+						Log("No connection context for socket %d\n", clnt);
+						tcp->_http->stats.refused++;
+						::close(clnt);
+						continue;
+					}
 
-						Dbg("Tcp::Run - poll sid %d\n", sid);
+					c->sd = clnt;
 
-						_http->Poll(sid, [sd](Hap::sid_t sid, char* buf, uint16_t len) -> int
-						{
-							if (buf != nullptr)
-								return ::send(sd, buf, len, 0);
-							return 0;
-						});
+					struct epoll_event ev;
+					ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+					ev.data.ptr = c;
+					if (::epoll_ctl(ep, EPOLL_CTL_ADD, clnt, &ev) < 0)
+					{
+						Log("epoll_ctl(%d) failed: %s\n", clnt, strerror(errno));
+						::close(clnt);
+						release(c);
 					}
+
+					// other reactors may pick up the rest
+					if (tcp->count > 1)
+						return;
 				}
+			}
+
+			// send buffer, never blocks
+			static int write(int sd, char* buf, uint16_t len)
+			{
+				if (buf == nullptr)
+					return 0;
+
+				int rc = ::send(sd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+				if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					return Hap::Http::Server::SendAgain;
+				return rc;
+			}
+
+			// send batch of buffers with one system call, never blocks
+			static int sendv(int sd, const Hap::Buf<char*>* buf, uint8_t count)
+			{
+				struct iovec iov[Hap::Http::Server::MaxSendFrames];
+
+				if (count > sizeofarr(iov))
+					count = sizeofarr(iov);
 
-				// read event on server socket - incoming connection
-				if (FD_ISSET(server, &readfds))
+				for (uint8_t i = 0; i < count; i++)
 				{
-					Dbg("Tcp::Run - accept %d\n", server);
+					iov[i].iov_base = buf[i].ptr();
+					iov[i].iov_len = buf[i].len();
+				}
 
-					int clnt = ::accept(server, (struct sockaddr *)&address, &addrlen);
-					if (clnt < 0)
-					{
-						Log("accept error\n");
-					}
-					else
+				struct msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = iov;
+				msg.msg_iovlen = count;
+
+				int rc = ::sendmsg(sd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+				if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					return Hap::Http::Server::SendAgain;
+				return rc;
+			}
+
+			// wait for writability while session has data in outbound queue
+			void watch(Conn* c)
+			{
+				bool out = tcp->_http->Pending(c->sid);
+				if (out == c->out)
+					return;
+
+				struct epoll_event ev;
+				ev.events = (uint32_t)(EPOLLIN | EPOLLRDHUP | EPOLLET) | (out ? (uint32_t)EPOLLOUT : 0u);
+				ev.data.ptr = c;
+				if (::epoll_ctl(ep, EPOLL_CTL_MOD, c->sd, &ev) < 0)
+					Log("epoll_ctl(%d) failed: %s\n", c->sd, strerror(errno));
+
+				c->out = out;
+			}
+
+			// socket is writable - flush outbound queue, then resume reading and events
+			//	returns false when the connection must be closed
+			bool flush(Conn* c)
+			{
+				int sd = c->sd;
+
+				if (!tcp->_http->Flush(c->sid,
+					[sd](Hap::sid_t sid, char* buf, uint16_t len) -> int
 					{
-						Log("Connection on socket %d from ip %s  port %d\n", clnt,
-							::inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+						return write(sd, buf, len);
+					}))
+					return false;
+
+				if (tcp->_http->Pending(c->sid))
+					return true;
+
+				if (!read(c))
+					return false;
+
+				poll(c);
+				return true;
+			}
+
+			// data or disconnect on client socket
+			//	returns false when the connection must be closed
+			bool read(Conn* c)
+			{
+				int sd = c->sd;
+
+				if (c->sid == Hap::sid_invalid)
+					c->sid = tcp->_http->Open();
+
+				if (c->sid == Hap::sid_invalid)
+				{
+					Log("Cannot open HTTP session for socket %d\n", sd);
+					return false;
+				}
 
-						//add new socket to array of sockets
-						for (unsigned i = 0; i < sizeofarr(client); i++)
+				// edge-triggered - keep processing until the socket is drained (recv would block),
+				//	EOF that arrived together with the last request is seen by Process then
+				bool again = false;
+				do
+				{
+					bool rc = tcp->_http->Process(c->sid,
+						[sd, &again](Hap::sid_t sid, char* buf, uint16_t size) -> int
 						{
-							if (client[i] == 0)
+							// never block the reactor on a slow client
+							int rc = ::recv(sd, buf, size, MSG_DONTWAIT);
+							if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
 							{
-								client[i] = clnt;
-								break;
+								again = true;
+								return Hap::Http::Server::RecvAgain;
 							}
+							return rc;
+						},
+						[sd](Hap::sid_t sid, char* buf, uint16_t len) -> int
+						{
+							return write(sd, buf, len);
+						},
+						[sd](Hap::sid_t sid, const Hap::Buf<char*>* buf, uint8_t count) -> int
+						{
+							return sendv(sd, buf, count);
 						}
+					);
+
+					if (!rc)
+					{
+						Log("HTTP Disconnect\n");
+						return false;
 					}
+
+					// response not sent completely - stop reading until the socket is writable
+					if (tcp->_http->Pending(c->sid))
+						break;
+				} while (!again);
+
+				watch(c);
+
+				return true;
+			}
+
+			// collect events of one session
+			void poll(Conn* c)
+			{
+				int sd = c->sd;
+
+				Dbg("Tcp::Run - poll sid %d\n", c->sid);
+
+				tcp->_http->Poll(c->sid,
+					[sd](Hap::sid_t sid, char* buf, uint16_t len) -> int
+					{
+						return write(sd, buf, len);
+					},
+					[sd](Hap::sid_t sid, const Hap::Buf<char*>* buf, uint8_t count) -> int
+					{
+						return sendv(sd, buf, count);
+					}
+				);
+
+				watch(c);
+			}
+
+			// timeout or event signal, process events
+			void poll()
+			{
+				for (unsigned i = 0; i < sizeofarr(conn); i++)
+				{
+					Conn* c = &conn[i];
+					if (c->sd < 0 || c->sid == Hap::sid_invalid)
+						continue;
+
+					poll(c);
 				}
+			}
 
-				// read event on client socket - data or disconnect
-				for (unsigned i = 0; i < sizeofarr(client); i++)
+			void run()
+			{
+				Log("Tcp::Run %d - enter\n", shard);
+
+				struct epoll_event events[MaxEvents];
+
+				while (tcp->running)
 				{
-					int sd = client[i];
+					Dbg("Tcp::Run - epoll_wait\n");
+					int rc = ::epoll_wait(ep, events, MaxEvents, PollTimeout);
+					Dbg("Tcp::Run - epoll_wait: %d\n", rc);
+					if (rc < 0)
+					{
+						if (errno != EINTR)
+							Log("epoll_wait error %s\n", strerror(errno));
+						continue;
+					}
 
-					if (FD_ISSET(sd, &readfds))
+					if (rc == 0)
 					{
-						bool close = false;
-						Hap::sid_t sid = sess[i];
+						poll();
+						continue;
+					}
 
-						Dbg("Tcp::Run - data from %d\n", sd);
+					bool signaled = false;
 
-						if (sid == Hap::sid_invalid)
+					for (int i = 0; i < rc; i++)
+					{
+						// read event on server socket - incoming connection
+						if (events[i].data.ptr == &tcp->server)
 						{
-							sid = _http->Open();
-							sess[i] = sid;
+							Dbg("Tcp::Run - accept %d\n", tcp->server);
+							accept();
+							continue;
 						}
 
-						if (sid == Hap::sid_invalid)
-						{
-							Log("Cannot open HTTP session for client %d\n", i);
-							close = true;
-						}
-						else
+						// event signal - reset the counter, deliver events after all sockets are served
+						if (events[i].data.ptr == &wake)
 						{
-							bool rc = _http->Process(sid,
-								[sd](Hap::sid_t sid, char* buf, uint16_t size) -> int
-								{
-									return ::recv(sd, buf, size, 0);
-								},
-								[sd](Hap::sid_t sid, char* buf, uint16_t len) -> int
-								{
-									if (buf != nullptr)
-										return ::send(sd, buf, len, 0);
-									return 0;
-								}
-							);
-
-							if (!rc)
-							{
-								Log("HTTP Disconnect\n");
-								close = true;
-							}
+							uint64_t v;
+							while (::read(wake, &v, sizeof(v)) > 0)
+								;
+							signaled = true;
+							continue;
 						}
 
+						Conn* c = (Conn*)events[i].data.ptr;
+
+						// read event on client socket - data or disconnect
+						Dbg("Tcp::Run - event 0x%X on %d\n", events[i].events, c->sd);
+
+						bool close = (events[i].events & (EPOLLHUP | EPOLLERR)) != 0;
+
+						if (!close && (events[i].events & EPOLLOUT) && c->out)
+							close = !flush(c);
+
+						if (!close && (events[i].events & (EPOLLIN | EPOLLRDHUP)))
+							close = !read(c);
+
 						if (close)
-						{
-							::getpeername(sd, (struct sockaddr*)&address, &addrlen);
-							Log("Disconnect socket %d to ip %s  port %d\n", sd,
-								::inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-
-							::close(sd);
-							client[i] = 0;
-							_http->Close(sid);
-							sess[i] = sid_invalid;
-						}
+							disconnect(c);
 					}
+
+					if (signaled && tcp->running)
+						poll();
 				}
+
+				for (unsigned i = 0; i < sizeofarr(conn); i++)
+				{
+					Conn* c = &conn[i];
+					if (c->sd >= 0)
+						disconnect(c);
+				}
+
+				Log("Tcp::Run %d - exit\n", shard);
 			}
 
-			for (unsigned i = 0; i < sizeofarr(client); i++)
+		public:
+			bool Start(TcpImpl* owner, uint8_t index)
 			{
-				int sd = client[i];
-				if (sd != 0)
+				tcp = owner;
+				shard = index;
+
+				spare = nullptr;
+				for (int i = sizeofarr(conn) - 1; i >= 0; i--)
+					release(&conn[i]);
+
+				ep = ::epoll_create1(EPOLL_CLOEXEC);
+				if (ep < 0)
 				{
-					::close(sd);
-					client[i] = 0;
+					Log("epoll_create1 failed: %s\n", strerror(errno));
+					return false;
 				}
+
+				wake = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+				if (wake < 0)
+				{
+					Log("eventfd failed: %s\n", strerror(errno));
+					return false;
+				}
+
+				struct epoll_event ev;
+				ev.events = EPOLLIN | EPOLLET;
+				ev.data.ptr = &wake;
+				if (::epoll_ctl(ep, EPOLL_CTL_ADD, wake, &ev) < 0)
+				{
+					Log("epoll_ctl(eventfd) failed: %s\n", strerror(errno));
+					return false;
+				}
+
+				// listening socket is shared by all reactors - level-triggered so the connection
+				//	not accepted by a reactor is reported again, exclusive so only one reactor wakes up
+				ev.events = tcp->count > 1 ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN | EPOLLET;
+				ev.data.ptr = &tcp->server;		// listening socket has no connection context
+				if (::epoll_ctl(ep, EPOLL_CTL_ADD, tcp->server, &ev) < 0)
+				{
+					Log("epoll_ctl(server) failed: %s\n", strerror(errno));
+					return false;
+				}
+
+				task = std::thread(&Reactor::run, this);
+
+				return true;
 			}
 
-			Log("Tcp::Run - exit\n");
+			void Join()
+			{
+				if (task.joinable())
+					task.join();
+
+				if (wake >= 0)
+					::close(wake);
+				wake = -1;
+
+				if (ep >= 0)
+					::close(ep);
+				ep = -1;
+			}
+
+			// signal the reactor
+			void Signal()
+			{
+				if (wake < 0)
+					return;
+
+				uint64_t v = 1;
+				if (::write(wake, &v, sizeof(v)) < 0)
+					Log("eventfd write error %s\n", strerror(errno));
+			}
+		};
+
+		std::atomic<bool> running{ false };	// read by reactor threads, cleared by Stop
+		int server = -1;
+		uint8_t count = 0;						// number of reactors
+		std::atomic<uint8_t> started{ 0 };		// number of reactors that can be signaled
+		Reactor reactor[Hap::MaxHttpThreads];
+
+		// signal all reactors
+		void signal()
+		{
+			uint8_t n = started.load(std::memory_order_acquire);
+			for (uint8_t i = 0; i < n; i++)
+				reactor[i].Signal();
+		}
+
+		static void signalHook(void* ctx)
+		{
+			((TcpImpl*)ctx)->signal();
 		}
 
 	public:
 		TcpImpl()
 		{
-			server = 0;
-			for (unsigned i = 0; i < sizeofarr(client); i++)
-				client[i] = 0;
 		}
 
 		~TcpImpl()
@@ -222,14 +509,8 @@ namespace Hap
 
 		virtual bool Start() override
 		{
-			for (unsigned i = 0; i < sizeofarr(client); i++)
-			{
-				client[i] = 0;
-				sess[i] = sid_invalid;
-			}
-
 			//create the server socket
-			server = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			server = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
 			if (server < 0)
 			{
 				Log("server socket creation failed\n");
@@ -265,8 +546,29 @@ namespace Hap
 				return false;
 			}
 
+			// one reactor per core
+			unsigned n = std::thread::hardware_concurrency();
+			if (n > Hap::MaxHttpThreads)
+				n = Hap::MaxHttpThreads;
+			if (n == 0)
+				n = 1;
+
+			// deliver DB events as soon as they are signaled
+			Hap::eventSignal.Add(signalHook, this);
+
 			running = true;
-			task = std::thread(&TcpImpl::run, this);
+			count = n;
+			for (uint8_t i = 0; i < n; i++)
+			{
+				if (!reactor[i].Start(this, i))
+				{
+					Stop();
+					return false;
+				}
+				started.store(i + 1, std::memory_order_release);
+			}
+
+			Log("Tcp::Start - %d reactor(s)\n", count);
 
 			return running;
 		}
@@ -275,10 +577,22 @@ namespace Hap
 		{
 			running = false;
 
-			::close(server);
+			// no signals from DB once reactors are stopped
+			Hap::eventSignal.Remove(signalHook, this);
+
+			signal();
+			started.store(0, std::memory_order_release);
+
+			if (count > 0)
+			{
+				for (uint8_t i = 0; i < count; i++)
+					reactor[i].Join();
+				count = 0;
+			}
 
-			if (task.joinable())
-				task.join();
+			if (server >= 0)
+				::close(server);
+			server = -1;
 		}
 
 	} tcp;
@@ -290,3 +604,4 @@ namespace Hap
 	}
 }
 
+#endif
@@ -0,0 +1,1056 @@
+/*
+MIT License
+
+Copyright (c) 2018 Gera Kazakov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+// io_uring based TCP server
+//	enabled by HAP_TCP_URING, replaces the epoll reactor in HapTcp.cpp
+//	liburing is not required, the ring is set up with raw system calls
+
+#ifdef HAP_TCP_URING
+
+#include "Hap.h"
+
+#include <thread>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+namespace Hap
+{
+	// Linux TCP server
+	//	single thread owning an io_uring instance:
+	//	- multishot accept on the listening socket
+	//	- multishot recv on each connection, data lands in receive buffers provided
+	//		to the kernel through a buffer ring, the buffers are leased from the HTTP buffer pool
+	//	- response frames are copied into a send buffer leased from the HTTP buffer pool and sent
+	//		with one send submission; while it is in flight SendV returns SendAgain, so the HTTP server
+	//		queues further data, and the queue is flushed when the send completes
+	//	- eventfd read and timeout requests wake the thread up to deliver events
+	class TcpImpl : public Tcp
+	{
+	private:
+		static constexpr unsigned Entries = 64;				// submission queue size
+		static constexpr uint16_t RecvBufs = 16;			// receive buffers, power of 2
+		static constexpr uint16_t RecvQueue = RecvBufs / 4;	// received buffers a connection may hold before recv is stopped
+		static constexpr uint16_t RecvGroup = 1;			// buffer group ID
+		static constexpr int PollTimeout = 1000;			// msec, events are also collected on timeout
+		static constexpr uint16_t TxSize =					// send buffer size, fits a batch of frames
+			Hap::Http::Server::MaxSendFrames * MaxHttpFrame;
+		static constexpr uint16_t TxInline = 256;			// short sends (such as 503) do not lease a buffer
+
+		// request type, kept in low bits of user_data, connection pointer in the rest
+		enum Op : uint64_t
+		{
+			OpAccept = 1,
+			OpRecv = 2,
+			OpSend = 3,
+			OpWake = 4,
+			OpTimeout = 5,
+			OpCancel = 6,
+			OpMask = 7,
+		};
+
+		// received data not consumed by HTTP server yet
+		struct Rx
+		{
+			uint16_t bid;		// buffer ID
+			uint16_t len;		// data length
+			uint16_t off;		// consumed so far
+		};
+
+		// connection context
+		struct alignas(8) Conn
+		{
+			int sd = -1;					// client socket, -1 when context is free
+			Hap::sid_t sid = sid_invalid;	// HTTP session
+			bool armed = false;				// multishot recv is active
+			bool canceling = false;			// multishot recv cancel is submitted
+			bool starved = false;			// recv terminated for lack of receive buffers
+			bool closing = false;			// disconnected, waiting for recv and send termination
+			Rx rx[RecvBufs];				// received buffers queue
+			uint8_t rxHead = 0;
+			uint8_t rxCount = 0;
+			Hap::Buf<char*> tx;				// send buffer, leased or inline while send is in flight
+			uint16_t txLen = 0;				// data in send buffer
+			uint16_t txOff = 0;				// sent so far
+			char txInline[TxInline];
+			Conn* next = nullptr;			// link in free list
+		};
+
+		std::thread task;
+		std::atomic<bool> running{ false };	// read by the ring thread, cleared by Stop
+
+		int server = -1;
+		int wake = -1;				// eventfd
+		uint64_t wakeVal;			// eventfd read target
+		struct __kernel_timespec ts;
+
+		Conn conn[Hap::MaxHttpSessions + 1];
+		Conn* spare = nullptr;		// list of free connection contexts
+
+		// ring
+		int ring = -1;
+		void* sqPtr = MAP_FAILED;
+		size_t sqSize = 0;
+		void* cqPtr = MAP_FAILED;
+		size_t cqSize = 0;
+		struct io_uring_sqe* sqes = (struct io_uring_sqe*)MAP_FAILED;
+		size_t sqesSize = 0;
+		unsigned* sqHead;
+		unsigned* sqTail;
+		unsigned sqMask;
+		unsigned* sqArray;
+		unsigned* cqHead;
+		unsigned* cqTail;
+		unsigned cqMask;
+		struct io_uring_cqe* cqes;
+		unsigned toSubmit = 0;
+
+		// receive buffers
+		struct io_uring_buf_ring* br = (struct io_uring_buf_ring*)MAP_FAILED;
+		size_t brSize = 0;
+		Hap::Buf<char*> rxBuf;		// leased from HTTP buffer pool
+		uint8_t starved = 0;		// connections waiting for receive buffers
+
+		static int enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+		{
+			return (int)::syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+		}
+
+		Conn* alloc()
+		{
+			Conn* c = spare;
+			if (c != nullptr)
+				spare = c->next;
+			return c;
+		}
+
+		void release(Conn* c)
+		{
+			c->sd = -1;
+			c->sid = sid_invalid;
+			c->armed = false;
+			c->canceling = false;
+			if (c->starved)
+				starved--;
+			c->starved = false;
+			c->closing = false;
+			c->rxHead = 0;
+			c->rxCount = 0;
+			txRelease(c);
+			c->next = spare;
+			spare = c;
+		}
+
+		// return send buffer to the pool unless it is the inline one
+		void txRelease(Conn* c)
+		{
+			if (c->tx.ptr() == c->txInline)
+				c->tx = makeBuf<char*>(nullptr, 0);
+			else
+				_http->Buffers().Release(c->tx);
+			c->txLen = 0;
+			c->txOff = 0;
+		}
+
+		// submit queued requests, optionally wait for completions
+		void submit(unsigned wait = 0)
+		{
+			while (true)
+			{
+				int rc = enter(ring, toSubmit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+				if (rc >= 0)
+				{
+					toSubmit -= rc;
+					return;
+				}
+
+				if (errno == EINTR)
+					continue;
+
+				if (errno != EAGAIN && errno != EBUSY)
+					Log("io_uring_enter error %s\n", strerror(errno));
+				return;
+			}
+		}
+
+		// get free submission queue entry
+		struct io_uring_sqe* sqe()
+		{
+			unsigned tail = *sqTail;
+			if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > sqMask)
+			{
+				// queue full - submit and retry
+				submit();
+				if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > sqMask)
+					return nullptr;
+			}
+
+			struct io_uring_sqe* e = &sqes[tail & sqMask];
+			memset(e, 0, sizeof(*e));
+			__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+			toSubmit++;
+			return e;
+		}
+
+		// return receive buffer to the kernel
+		//	the ring is indexed directly, in C++ the bufs flexible array of io_uring_buf_ring
+		//	is not at offset 0 (the empty struct preceding it has non-zero size)
+		void recycle(uint16_t bid)
+		{
+			uint16_t tail = br->tail;
+			struct io_uring_buf* b = (struct io_uring_buf*)br + (tail & (RecvBufs - 1));
+			b->addr = (uint64_t)(rxBuf.ptr() + bid * MaxHttpFrame);
+			b->len = MaxHttpFrame;
+			b->bid = bid;
+			__atomic_store_n(&br->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+
+			// restart recv of connections that ran out of buffers
+			for (unsigned i = 0; starved > 0 && i < sizeofarr(conn); i++)
+			{
+				Conn* c = &conn[i];
+				if (!c->starved)
+					continue;
+
+				c->starved = false;
+				starved--;
+				if (c->sd >= 0 && !c->closing && !c->armed && !throttled(c) && running)
+					armRecv(c);
+			}
+		}
+
+		void armAccept()
+		{
+			struct io_uring_sqe* e = sqe();
+			if (e == nullptr)
+				return;
+			e->opcode = IORING_OP_ACCEPT;
+			e->fd = server;
+			e->ioprio = IORING_ACCEPT_MULTISHOT;
+			e->accept_flags = SOCK_CLOEXEC;
+			e->user_data = OpAccept;
+		}
+
+		void armRecv(Conn* c)
+		{
+			struct io_uring_sqe* e = sqe();
+			if (e == nullptr)
+				return;
+			e->opcode = IORING_OP_RECV;
+			e->fd = c->sd;
+			e->ioprio = IORING_RECV_MULTISHOT;
+			e->flags = IOSQE_BUFFER_SELECT;
+			e->buf_group = RecvGroup;
+			e->user_data = (uint64_t)c | OpRecv;
+			c->armed = true;
+		}
+
+		// stop multishot recv, it completes without IORING_CQE_F_MORE
+		void cancelRecv(Conn* c)
+		{
+			if (!c->armed || c->canceling)
+				return;
+
+			cancel((uint64_t)c | OpRecv);
+			c->canceling = true;
+		}
+
+		void cancel(uint64_t user_data)
+		{
+			struct io_uring_sqe* e = sqe();
+			if (e == nullptr)
+				return;
+			e->opcode = IORING_OP_ASYNC_CANCEL;
+			e->fd = -1;
+			e->addr = user_data;
+			e->user_data = OpCancel;
+		}
+
+		// send the rest of the send buffer, the request completes when the socket takes the data
+		bool armSend(Conn* c)
+		{
+			struct io_uring_sqe* e = sqe();
+			if (e == nullptr)
+			{
+				Log("io_uring: no submission entry for socket %d\n", c->sd);
+				return false;
+			}
+			e->opcode = IORING_OP_SEND;
+			e->fd = c->sd;
+			e->addr = (uint64_t)(c->tx.ptr() + c->txOff);
+			e->len = c->txLen - c->txOff;
+			e->msg_flags = MSG_NOSIGNAL;
+			e->user_data = (uint64_t)c | OpSend;
+			return true;
+		}
+
+		void armWake()
+		{
+			struct io_uring_sqe* e = sqe();
+			if (e == nullptr)
+				return;
+			e->opcode = IORING_OP_READ;
+			e->fd = wake;
+			e->addr = (uint64_t)&wakeVal;
+			e->len = sizeof(wakeVal);
+			e->user_data = OpWake;
+		}
+
+		void armTimeout()
+		{
+			struct io_uring_sqe* e = sqe();
+			if (e == nullptr)
+				return;
+			ts.tv_sec = PollTimeout / 1000;
+			ts.tv_nsec = (PollTimeout % 1000) * 1000000;
+			e->opcode = IORING_OP_TIMEOUT;
+			e->fd = -1;
+			e->addr = (uint64_t)&ts;
+			e->len = 1;
+			e->user_data = OpTimeout;
+		}
+
+		void disconnect(Conn* c)
+		{
+			if (c->closing)
+				return;
+
+			Log("Disconnect socket %d\n", c->sd);
+
+			if (c->sid != sid_invalid)
+				_http->Close(c->sid);
+			c->sid = sid_invalid;
+
+			// drop received data
+			while (c->rxCount > 0)
+			{
+				recycle(c->rx[c->rxHead].bid);
+				c->rxHead = (c->rxHead + 1) % RecvBufs;
+				c->rxCount--;
+			}
+
+			// let the last response (such as 503) reach the socket before it is shut down
+			if (c->txLen > 0)
+				submit();
+
+			// shutdown terminates multishot recv and pending send,
+			//	the context is released on their last completion
+			c->closing = true;
+			::shutdown(c->sd, SHUT_RDWR);
+			if (!c->armed && c->txLen == 0)
+			{
+				::close(c->sd);
+				release(c);
+			}
+		}
+
+		// connection holds its share of receive buffers or waits for the response to be sent,
+		//	its recv is stopped so it does not take the buffers of other connections,
+		//	and it is restarted by flush
+		bool throttled(Conn* c)
+		{
+			return c->rxCount >= RecvQueue || (c->sid != Hap::sid_invalid && _http->Pending(c->sid));
+		}
+
+		// number of receive buffers queued in connections
+		unsigned held()
+		{
+			unsigned n = 0;
+			for (unsigned i = 0; i < sizeofarr(conn); i++)
+				n += conn[i].rxCount;
+			return n;
+		}
+
+		// Recv callback, copies data from received buffers
+		int recv(Conn* c, char* buf, uint16_t size)
+		{
+			if (c->rxCount == 0)
+				return Hap::Http::Server::RecvAgain;
+
+			int len = 0;
+			while (c->rxCount > 0 && size > 0)
+			{
+				Rx* rx = &c->rx[c->rxHead];
+				uint16_t l = rx->len - rx->off;
+				if (l > size)
+					l = size;
+
+				memcpy(buf, rxBuf.ptr() + rx->bid * MaxHttpFrame + rx->off, l);
+				buf += l;
+				size -= l;
+				len += l;
+				rx->off += l;
+
+				if (rx->off == rx->len)
+				{
+					recycle(rx->bid);
+					c->rxHead = (c->rxHead + 1) % RecvBufs;
+					c->rxCount--;
+				}
+			}
+
+			return len;
+		}
+
+		// SendV callback, copies buffers into the send buffer and submits one send, never waits
+		//	returns SendAgain while previous send is in flight, the number of bytes copied otherwise
+		int sendv(Conn* c, const Hap::Buf<char*>* buf, uint8_t count)
+		{
+			if (c->txLen > 0)
+				return Hap::Http::Server::SendAgain;
+
+			size_t total = 0;
+			for (uint8_t i = 0; i < count; i++)
+				total += buf[i].len();
+			if (total == 0)
+				return 0;
+			if (total > TxSize)
+				total = TxSize;
+
+			if (total <= TxInline)
+				c->tx = makeBuf<char*>(c->txInline, TxInline);
+			else if (!_http->Buffers().Lease(c->tx, (uint16_t)total))
+			{
+				Log("io_uring: no send buffer for socket %d\n", c->sd);
+				return -1;
+			}
+
+			uint16_t len = 0;
+			for (uint8_t i = 0; i < count && len < total; i++)
+			{
+				uint16_t l = (uint16_t)buf[i].len();
+				if (l > total - len)
+					l = (uint16_t)(total - len);
+				memcpy(c->tx.ptr() + len, buf[i].ptr(), l);
+				len += l;
+			}
+
+			c->txLen = len;
+			c->txOff = 0;
+			if (!armSend(c))
+			{
+				txRelease(c);
+				return -1;
+			}
+
+			return len;
+		}
+
+		// Send callback
+		int send(Conn* c, char* buf, uint16_t len)
+		{
+			if (buf == nullptr)
+				return 0;
+			Hap::Buf<char*> b(buf, len);
+			return sendv(c, &b, 1);
+		}
+
+		// process received data
+		void read(Conn* c)
+		{
+			if (c->sid == Hap::sid_invalid)
+				c->sid = _http->Open();
+
+			if (c->sid == Hap::sid_invalid)
+			{
+				Log("Cannot open HTTP session for socket %d\n", c->sd);
+				disconnect(c);
+				return;
+			}
+
+			// pipelined requests may be buffered in the session - process at least once
+			do
+			{
+				bool rc = _http->Process(c->sid,
+					[this, c](Hap::sid_t sid, char* buf, uint16_t size) -> int
+					{
+						return recv(c, buf, size);
+					},
+					[this, c](Hap::sid_t sid, char* buf, uint16_t len) -> int
+					{
+						return send(c, buf, len);
+					},
+					[this, c](Hap::sid_t sid, const Hap::Buf<char*>* buf, uint8_t count) -> int
+					{
+						return sendv(c, buf, count);
+					}
+				);
+
+				if (!rc)
+				{
+					Log("HTTP Disconnect\n");
+					disconnect(c);
+					break;
+				}
+
+				// response not sent completely - keep received data until the queue is flushed
+				if (_http->Pending(c->sid))
+					break;
+			} while (c->rxCount > 0);
+		}
+
+		// collect events of one session
+		void poll(Conn* c)
+		{
+			_http->Poll(c->sid,
+				[this, c](Hap::sid_t sid, char* buf, uint16_t len) -> int
+				{
+					return send(c, buf, len);
+				},
+				[this, c](Hap::sid_t sid, const Hap::Buf<char*>* buf, uint8_t count) -> int
+				{
+					return sendv(c, buf, count);
+				}
+			);
+		}
+
+		// timeout or event signal, process events
+		void poll()
+		{
+			for (unsigned i = 0; i < sizeofarr(conn); i++)
+			{
+				Conn* c = &conn[i];
+				if (c->sd < 0 || c->closing || c->sid == Hap::sid_invalid)
+					continue;
+
+				poll(c);
+			}
+		}
+
+		// send completed - flush outbound queue of the session, then resume reading and events
+		void flush(Conn* c)
+		{
+			if (c->sid == Hap::sid_invalid)
+				return;
+
+			if (_http->Pending(c->sid))
+			{
+				if (!_http->Flush(c->sid,
+					[this, c](Hap::sid_t sid, char* buf, uint16_t len) -> int
+					{
+						return send(c, buf, len);
+					}))
+				{
+					disconnect(c);
+					return;
+				}
+
+				if (_http->Pending(c->sid))
+					return;
+			}
+
+			read(c);
+
+			if (c->closing)
+				return;
+
+			poll(c);
+
+			// queue is drained - resume receiving
+			if (!c->armed && !c->starved && !throttled(c) && running)
+				armRecv(c);
+		}
+
+		// handle one completion
+		void complete(const struct io_uring_cqe* cqe)
+		{
+			Op op = (Op)(cqe->user_data & OpMask);
+			bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+			switch (op)
+			{
+			case OpAccept:
+				if (cqe->res >= 0)
+				{
+					int clnt = cqe->res;
+					Conn* c = alloc();
+					if (c == nullptr)
+					{
+						Log("No connection context for socket %d\n", clnt);
+						_http->stats.refused++;
+						::close(clnt);
+					}
+					else if (!running)
+					{
+						// accept completed after stop
+						::close(clnt);
+						c->next = spare;
+						spare = c;
+					}
+					else
+					{
+						Log("Connection on socket %d\n", clnt);
+						c->sd = clnt;
+						armRecv(c);
+					}
+				}
+				else
+				{
+					Log("accept error %s\n", strerror(-cqe->res));
+				}
+
+				if (!more && running)
+					armAccept();
+				break;
+
+			case OpRecv:
+			{
+				Conn* c = (Conn*)(cqe->user_data & ~(uint64_t)OpMask);
+
+				if (cqe->flags & IORING_CQE_F_BUFFER)
+				{
+					uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+					if (cqe->res > 0 && !c->closing && c->rxCount < RecvBufs)
+					{
+						Rx* rx = &c->rx[(c->rxHead + c->rxCount) % RecvBufs];
+						rx->bid = bid;
+						rx->len = (uint16_t)cqe->res;
+						rx->off = 0;
+						c->rxCount++;
+					}
+					else
+					{
+						recycle(bid);
+					}
+				}
+
+				if (!more)
+				{
+					c->armed = false;
+					c->canceling = false;
+				}
+
+				if (c->closing)
+				{
+					if (!c->armed && c->txLen == 0)
+					{
+						::close(c->sd);
+						release(c);
+					}
+					break;
+				}
+
+				if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED))
+				{
+					// EOF or error
+					disconnect(c);
+					break;
+				}
+
+				read(c);
+
+				if (c->closing || !running)
+					break;
+
+				if (throttled(c))
+				{
+					cancelRecv(c);
+					break;
+				}
+
+				if (c->armed)
+					break;
+
+				// recv terminated when receive buffers ran out - if all of them wait in connection queues,
+				//	restart it when a buffer is recycled, otherwise some are on their way back to the kernel
+				if (cqe->res == -ENOBUFS && held() == RecvBufs)
+				{
+					c->starved = true;
+					starved++;
+					break;
+				}
+
+				armRecv(c);
+				break;
+			}
+
+			case OpSend:
+			{
+				Conn* c = (Conn*)(cqe->user_data & ~(uint64_t)OpMask);
+
+				if (cqe->res > 0)
+					c->txOff += cqe->res;
+
+				// short send - send the rest when the socket takes more data
+				if (cqe->res >= 0 && c->txOff < c->txLen && !c->closing && armSend(c))
+					break;
+
+				bool sent = c->txOff == c->txLen;
+				txRelease(c);
+
+				if (c->closing)
+				{
+					if (!c->armed)
+					{
+						::close(c->sd);
+						release(c);
+					}
+					break;
+				}
+
+				if (!sent)
+				{
+					Log("send error %s\n", strerror(cqe->res < 0 ? -cqe->res : EIO));
+					disconnect(c);
+					break;
+				}
+
+				flush(c);
+				break;
+			}
+
+			case OpWake:
+				if (running)
+				{
+					armWake();
+					poll();
+				}
+				break;
+
+			case OpTimeout:
+				if (running)
+				{
+					armTimeout();
+					poll();
+				}
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		// collect completions
+		void reap()
+		{
+			while (true)
+			{
+				unsigned head = *cqHead;
+				if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+					return;
+
+				struct io_uring_cqe cqe = cqes[head & cqMask];
+				__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+				complete(&cqe);
+			}
+		}
+
+		// some connection has requests in flight
+		bool busy()
+		{
+			for (unsigned i = 0; i < sizeofarr(conn); i++)
+			{
+				if (conn[i].sd >= 0)
+					return true;
+			}
+			return false;
+		}
+
+		void run()
+		{
+			Log("Tcp::Run - enter\n");
+
+			while (running)
+			{
+				submit(1);
+				reap();
+			}
+
+			// in-flight recv and send requests use pool buffers - cancel them and
+			//	reap their completions before the buffers are released,
+			//	connections are released on their last completion as in disconnect
+			cancel(OpAccept);
+			for (unsigned i = 0; i < sizeofarr(conn); i++)
+			{
+				Conn* c = &conn[i];
+				if (c->sd < 0)
+					continue;
+
+				disconnect(c);
+				if (c->sd < 0)
+					continue;
+
+				cancelRecv(c);
+				if (c->txLen > 0)
+					cancel((uint64_t)c | OpSend);
+			}
+
+			while (busy())
+			{
+				submit(1);
+				reap();
+			}
+
+			Log("Tcp::Run - exit\n");
+		}
+
+		bool setup()
+		{
+			struct io_uring_params p;
+			memset(&p, 0, sizeof(p));
+
+			ring = (int)::syscall(__NR_io_uring_setup, Entries, &p);
+			if (ring < 0)
+			{
+				Log("io_uring_setup failed: %s\n", strerror(errno));
+				return false;
+			}
+
+			if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+			{
+				Log("io_uring: kernel is too old\n");
+				return false;
+			}
+
+			sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+			cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+			if (cqSize > sqSize)
+				sqSize = cqSize;
+			cqSize = 0;		// single mapping
+
+			sqPtr = ::mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+			if (sqPtr == MAP_FAILED)
+			{
+				Log("io_uring: ring mmap failed: %s\n", strerror(errno));
+				return false;
+			}
+			cqPtr = sqPtr;
+
+			sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+			sqes = (struct io_uring_sqe*)::mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+			if (sqes == MAP_FAILED)
+			{
+				Log("io_uring: sqes mmap failed: %s\n", strerror(errno));
+				return false;
+			}
+
+			char* sq = (char*)sqPtr;
+			sqHead = (unsigned*)(sq + p.sq_off.head);
+			sqTail = (unsigned*)(sq + p.sq_off.tail);
+			sqMask = *(unsigned*)(sq + p.sq_off.ring_mask);
+			sqArray = (unsigned*)(sq + p.sq_off.array);
+			for (unsigned i = 0; i <= sqMask; i++)
+				sqArray[i] = i;
+
+			char* cq = (char*)cqPtr;
+			cqHead = (unsigned*)(cq + p.cq_off.head);
+			cqTail = (unsigned*)(cq + p.cq_off.tail);
+			cqMask = *(unsigned*)(cq + p.cq_off.ring_mask);
+			cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+			// receive buffers from HTTP buffer pool
+			if (!_http->Buffers().Lease(rxBuf, RecvBufs * MaxHttpFrame))
+			{
+				Log("io_uring: no receive buffers in HTTP pool\n");
+				return false;
+			}
+
+			brSize = RecvBufs * sizeof(struct io_uring_buf);
+			br = (struct io_uring_buf_ring*)::mmap(NULL, brSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (br == MAP_FAILED)
+			{
+				Log("io_uring: buffer ring mmap failed: %s\n", strerror(errno));
+				return false;
+			}
+
+			struct io_uring_buf_reg reg;
+			memset(&reg, 0, sizeof(reg));
+			reg.ring_addr = (uint64_t)br;
+			reg.ring_entries = RecvBufs;
+			reg.bgid = RecvGroup;
+			if (::syscall(__NR_io_uring_register, ring, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+			{
+				Log("io_uring: buffer ring register failed: %s\n", strerror(errno));
+				return false;
+			}
+
+			br->tail = 0;
+			for (uint16_t i = 0; i < RecvBufs; i++)
+				recycle(i);
+
+			return true;
+		}
+
+		void cleanup()
+		{
+			if (ring >= 0)
+				::close(ring);
+			ring = -1;
+
+			if (sqPtr != MAP_FAILED)
+				::munmap(sqPtr, sqSize);
+			sqPtr = cqPtr = MAP_FAILED;
+
+			if (sqes != MAP_FAILED)
+				::munmap(sqes, sqesSize);
+			sqes = (struct io_uring_sqe*)MAP_FAILED;
+
+			if (br != MAP_FAILED)
+				::munmap(br, brSize);
+			br = (struct io_uring_buf_ring*)MAP_FAILED;
+
+			_http->Buffers().Release(rxBuf);
+
+			toSubmit = 0;
+		}
+
+		// signal the thread
+		void signal()
+		{
+			if (wake < 0)
+				return;
+
+			uint64_t v = 1;
+			if (::write(wake, &v, sizeof(v)) < 0)
+				Log("eventfd write error %s\n", strerror(errno));
+		}
+
+		static void signalHook(void* ctx)
+		{
+			((TcpImpl*)ctx)->signal();
+		}
+
+	public:
+		TcpImpl()
+		{
+		}
+
+		~TcpImpl()
+		{
+			Stop();
+		}
+
+		virtual bool Start() override
+		{
+			spare = nullptr;
+			starved = 0;
+			for (int i = sizeofarr(conn) - 1; i >= 0; i--)
+				release(&conn[i]);
+
+			if (!setup())
+			{
+				cleanup();
+				return false;
+			}
+
+			wake = ::eventfd(0, EFD_CLOEXEC);
+			if (wake < 0)
+			{
+				Log("eventfd failed: %s\n", strerror(errno));
+				return false;
+			}
+
+			//create the server socket
+			server = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+			if (server < 0)
+			{
+				Log("server socket creation failed\n");
+				return false;
+			}
+
+			// allow local address reuse
+			int opt = 1;
+			if (::setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt)) < 0)
+			{
+				Log("setsockopt(server, SO_REUSEADDR) failed: %s\n", strerror(errno));
+				return false;
+			}
+
+			//bind the socket
+			struct sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = INADDR_ANY;
+			address.sin_port = Hap::config->port;
+
+			Dbg("Tcp::Start - bind %d to %s:%d\n", server,
+					::inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+
+			if (::bind(server, (struct sockaddr *)&address, sizeof(address))<0)
+			{
+				Log("bind(server, INADDR_ANY) failed\n");
+				return false;
+			}
+
+			if (::listen(server, MaxHttpSessions) < 0)
+			{
+				Log("listen(server) failed\n");
+				return false;
+			}
+
+			running = true;
+
+			armAccept();
+			armWake();
+			armTimeout();
+
+			// deliver DB events as soon as they are signaled
+			Hap::eventSignal.Add(signalHook, this);
+
+			task = std::thread(&TcpImpl::run, this);
+
+			return running;
+		}
+
+		virtual void Stop() override
+		{
+			running = false;
+
+			// no signals from DB once the eventfd is closed
+			Hap::eventSignal.Remove(signalHook, this);
+
+			signal();
+
+			if (task.joinable())
+				task.join();
+
+			if (server >= 0)
+				::close(server);
+			server = -1;
+
+			if (wake >= 0)
+				::close(wake);
+			wake = -1;
+
+			cleanup();
+		}
+
+	} tcp;
+
+	Tcp* Tcp::Create(Hap::Http::Server* http)
+	{
+		tcp._http = http;
+		return &tcp;
+	}
+}
+
+#endif
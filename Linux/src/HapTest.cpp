@@ -264,6 +264,9 @@ public:
 
 } db;
 
+// serialized database structure for GET /accessories, values and ev flags are not cached
+Hap::DbCacheStatic<1, Hap::MaxHttpRsp, 32> dbCache;
+
 // Pairing records
 
 class MyPairings : public Hap::Pairings
@@ -641,16 +644,30 @@ private:
 Hap::Config* Hap::config = &myConfig;
 
 // statically allocated storage for HTTP processing
-//	Our implementation is single-threaded so only one set of buffers.
-//	The http server uses this buffers only during processing a request.
+//	The http server leases buffers from the pool only during processing a request,
+//	the pool is sized for all sessions receiving requests and keeping unsent response
+//	in outbound queue, and all network threads sending responses (response and encrypted
+//	frames) at the same time, io_uring transport also leases its receive and send buffers from the pool.
 //	All session-persistent data is kept in Session objects.
-Hap::BufStatic<char, Hap::MaxHttpFrame * 2> http_req;
-Hap::BufStatic<char, Hap::MaxHttpFrame * 4> http_rsp;
-Hap::BufStatic<char, Hap::MaxHttpFrame * 1> http_tmp;
-Hap::Http::Server::Buf buf = { http_req, http_rsp, http_tmp };
-Hap::Http::Server http(buf, db, myConfig.pairings, myConfig.keys);
-
-bool Hap::debug = false;
+#ifdef HAP_TCP_URING
+constexpr uint16_t TcpPoolChunks = 16 +								// receive buffers
+	(Hap::MaxHttpSessions + 1) * Hap::Http::Server::MaxSendFrames;	// send buffers
+#else
+constexpr uint16_t TcpPoolChunks = 0;
+#endif
+constexpr uint16_t SessionPoolChunks =
+	Hap::MaxHttpReq / Hap::MaxHttpFrame +							// request, decrypted in place
+	Hap::Http::Server::QueueChunks();								// outbound queue
+constexpr uint16_t ThreadPoolChunks =
+	Hap::MaxHttpRsp / Hap::MaxHttpFrame + 1 +						// response + tmp
+	Hap::Http::Server::MaxSendFrames;								// encrypted frames
+Hap::Http::PoolStatic<
+	Hap::MaxHttpSessions * SessionPoolChunks +
+	Hap::MaxHttpThreads * ThreadPoolChunks +
+	TcpPoolChunks> pool;
+Hap::Http::Server http(pool, db, myConfig.pairings, myConfig.keys);
+
+uint8_t Hap::logLevel = Hap::LogInfo;
 
 // random number generator
 extern "C" {
@@ -676,8 +693,13 @@ int main(int argc, char* argv[])
 	bool reset = false;
 	app.add_flag("-R,--reset", reset, "Reset configuration");
 
+	int logLevel = Hap::logLevel;
+	app.add_option("-l,--log-level", logLevel, "Log level: 0 - none, 1 - info, 2 - debug", true);
+
 	CLI11_PARSE(app, argc, argv);
 
+	Hap::logLevel = (uint8_t)logLevel;
+
 	t_stronginitrand();
 
 	// create servers
@@ -713,6 +735,7 @@ int main(int argc, char* argv[])
 
 	// init static objects
 	db.Init(1);
+	db.Cache(&dbCache);
 
 	// start servers
 	mdns->Start();
@@ -0,0 +1,272 @@
+/*
+MIT License
+
+Copyright (c) 2018 Gera Kazakov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// crypto wrappers test
+//	ChaCha20-Poly1305 AEAD against RFC 7539 2.8.2 in place and scatter-gather,
+//	cached HKDF salts against plain HKDF, and the HKDF output length limit;
+//	exits with non-zero status when any check fails
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Hap.h"
+
+static int failed = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failed++; } } while (0)
+
+Hap::Config* Hap::config = nullptr;
+uint8_t Hap::logLevel = Hap::LogNone;
+
+// random number generator
+extern "C" {
+	void t_stronginitrand()
+	{
+		srand((unsigned)time(NULL));
+	}
+
+	void t_random(unsigned char* data, unsigned size)
+	{
+		for (unsigned i = 0; i < size; i++)
+		{
+			*data++ = rand() & 0xFF;
+		}
+	}
+}
+
+// RFC 7539 2.8.2
+static const uint8_t aeadKey[32] =
+{
+	0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+	0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
+};
+static const uint8_t aeadNonce[12] =
+{
+	0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+};
+static const uint8_t aeadAad[12] =
+{
+	0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+};
+static const char aeadPlain[] =
+	"Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+static const uint8_t aeadCipher[] =
+{
+	0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2,
+	0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe, 0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6,
+	0x3d, 0xbe, 0xa4, 0x5e, 0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b,
+	0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29, 0x05, 0xd6, 0xa5, 0xb6, 0x7e, 0xcd, 0x3b, 0x36,
+	0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c, 0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58,
+	0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85, 0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc,
+	0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d, 0xe5, 0x76, 0xd2, 0x65, 0x86, 0xce, 0xc6, 0x4b,
+	0x61, 0x16,
+};
+static const uint8_t aeadTag[Hap::Crypt::TagSize] =
+{
+	0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91,
+};
+
+static const uint16_t aeadSize = sizeof(aeadCipher);
+
+static void testAeadInPlace()
+{
+	using namespace Hap::Crypt;
+
+	uint8_t buf[aeadSize];
+	uint8_t tag[TagSize];
+
+	CHECK(sizeof(aeadPlain) - 1 == aeadSize);
+
+	memcpy(buf, aeadPlain, aeadSize);
+	CHECK(aead(Encrypt, buf, aeadSize, tag, aeadKey, aeadNonce, aeadAad, sizeof(aeadAad)));
+	CHECK(memcmp(buf, aeadCipher, aeadSize) == 0);
+	CHECK(memcmp(tag, aeadTag, TagSize) == 0);
+
+	CHECK(aead(Decrypt, buf, aeadSize, tag, aeadKey, aeadNonce, aeadAad, sizeof(aeadAad)));
+	CHECK(memcmp(buf, aeadPlain, aeadSize) == 0);
+
+	// tampered tag is rejected and the data is left as received
+	memcpy(buf, aeadCipher, aeadSize);
+	tag[TagSize - 1] ^= 1;
+	CHECK(!aead(Decrypt, buf, aeadSize, tag, aeadKey, aeadNonce, aeadAad, sizeof(aeadAad)));
+	CHECK(memcmp(buf, aeadCipher, aeadSize) == 0);
+
+	// so is tampered data and AAD
+	memcpy(tag, aeadTag, TagSize);
+	buf[aeadSize / 2] ^= 0x80;
+	CHECK(!aead(Decrypt, buf, aeadSize, tag, aeadKey, aeadNonce, aeadAad, sizeof(aeadAad)));
+	buf[aeadSize / 2] ^= 0x80;
+	CHECK(!aead(Decrypt, buf, aeadSize, tag, aeadKey, aeadNonce, aeadAad, sizeof(aeadAad) - 1));
+	CHECK(memcmp(buf, aeadCipher, aeadSize) == 0);
+}
+
+static void testAeadScatter()
+{
+	using namespace Hap::Crypt;
+
+	// segments not aligned to ChaCha or Poly1305 blocks
+	static const size_t split[][3] =
+	{
+		{ aeadSize, 0, 0 },
+		{ 1, 63, aeadSize - 64 },
+		{ 17, 0, aeadSize - 17 },
+		{ 64, 48, aeadSize - 112 },
+	};
+
+	for (auto& s : split)
+	{
+		uint8_t out[aeadSize];
+		uint8_t tag[TagSize];
+		Hap::Buf<const uint8_t*> m[3];
+		size_t off = 0;
+
+		for (int i = 0; i < 3; i++)
+		{
+			m[i] = Hap::Buf<const uint8_t*>((const uint8_t*)aeadPlain + off, s[i]);
+			off += s[i];
+		}
+
+		memset(out, 0, sizeof(out));
+		CHECK(aead(Encrypt, out, tag, aeadKey, aeadNonce, m, 3, aeadAad, sizeof(aeadAad)));
+		CHECK(memcmp(out, aeadCipher, aeadSize) == 0);
+		CHECK(memcmp(tag, aeadTag, TagSize) == 0);
+
+		off = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			m[i] = Hap::Buf<const uint8_t*>(aeadCipher + off, s[i]);
+			off += s[i];
+		}
+
+		memset(out, 0, sizeof(out));
+		CHECK(aead(Decrypt, out, tag, aeadKey, aeadNonce, m, 3, aeadAad, sizeof(aeadAad)));
+		CHECK(memcmp(out, aeadPlain, aeadSize) == 0);
+
+		// nothing is written when the tag does not match
+		static const uint8_t zero[aeadSize] = {};
+		memset(out, 0, sizeof(out));
+		tag[0] ^= 1;
+		CHECK(!aead(Decrypt, out, tag, aeadKey, aeadNonce, m, 3, aeadAad, sizeof(aeadAad)));
+		CHECK(memcmp(out, zero, aeadSize) == 0);
+	}
+}
+
+// each Salt entry must give the same keys as the salt string passed to plain HKDF
+static void testSalts()
+{
+	using namespace Hap::Crypt;
+
+	static const char* const salts[SaltCount] =
+	{
+		"Pair-Setup-Encrypt-Salt",
+		"Pair-Setup-Accessory-Sign-Salt",
+		"Pair-Verify-Encrypt-Salt",
+		"Control-Salt",
+	};
+	static const char info[] = "Control-Read-Encryption-Key";
+
+	uint8_t key[100];
+	uint8_t okm1[200];
+	uint8_t okm2[200];
+	uint8_t prk[PrkSize];
+
+	t_random(key, sizeof(key));
+
+	for (int i = 0; i < SaltCount; i++)
+	{
+		Salt salt = (Salt)i;
+
+		// twice to see the cached state is not changed by use
+		for (int n = 0; n < 2; n++)
+		{
+			memset(okm1, 0, sizeof(okm1));
+			memset(okm2, 0xFF, sizeof(okm2));
+
+			CHECK(hkdf((const uint8_t*)salts[i], strlen(salts[i]), key, sizeof(key),
+				(const uint8_t*)info, sizeof(info) - 1, okm1, sizeof(okm1)));
+			CHECK(hkdf(salt, key, sizeof(key),
+				(const uint8_t*)info, sizeof(info) - 1, okm2, sizeof(okm2)));
+			CHECK(memcmp(okm1, okm2, sizeof(okm1)) == 0);
+
+			memset(okm2, 0xFF, sizeof(okm2));
+			hkdfExtract(salt, key, sizeof(key), prk);
+			CHECK(hkdfExpand(prk, (const uint8_t*)info, sizeof(info) - 1, okm2, sizeof(okm2)));
+			CHECK(memcmp(okm1, okm2, sizeof(okm1)) == 0);
+		}
+
+		// different salts give different keys
+		if (i > 0)
+		{
+			CHECK(hkdf((Salt)(i - 1), key, sizeof(key),
+				(const uint8_t*)info, sizeof(info) - 1, okm2, sizeof(okm2)));
+			CHECK(memcmp(okm1, okm2, sizeof(okm1)) != 0);
+		}
+	}
+}
+
+// one byte block counter limits the output to 255 blocks
+static void testOkmSize()
+{
+	using namespace Hap::Crypt;
+
+	static uint8_t okm1[MaxOkmSize + 1];
+	static uint8_t okm2[MaxOkmSize + 1];
+	static const char info[] = "info";
+	uint8_t key[32];
+
+	t_random(key, sizeof(key));
+
+	memset(okm1, 0x5A, sizeof(okm1));
+	CHECK(!hkdf(ControlSalt, key, sizeof(key), (const uint8_t*)info, sizeof(info) - 1, okm1, MaxOkmSize + 1));
+	CHECK(!hkdf((const uint8_t*)"Control-Salt", 12, key, sizeof(key), (const uint8_t*)info, sizeof(info) - 1, okm1, MaxOkmSize + 1));
+	bool untouched = true;
+	for (unsigned i = 0; i < sizeof(okm1); i++)
+		untouched = untouched && okm1[i] == 0x5A;
+	CHECK(untouched);
+
+	// the limit itself is fine, and a shorter output is its prefix
+	memset(okm1, 0x5A, sizeof(okm1));
+	CHECK(hkdf(ControlSalt, key, sizeof(key), (const uint8_t*)info, sizeof(info) - 1, okm1, MaxOkmSize));
+	CHECK(okm1[MaxOkmSize] == 0x5A);
+	CHECK(hkdf((const uint8_t*)"Control-Salt", 12, key, sizeof(key), (const uint8_t*)info, sizeof(info) - 1, okm2, MaxOkmSize));
+	CHECK(memcmp(okm1, okm2, MaxOkmSize) == 0);
+
+	memset(okm2, 0, sizeof(okm2));
+	CHECK(hkdf(ControlSalt, key, sizeof(key), (const uint8_t*)info, sizeof(info) - 1, okm2, 100));
+	CHECK(memcmp(okm1, okm2, 100) == 0);
+}
+
+int main(int argc, char* argv[])
+{
+	testAeadInPlace();
+	testAeadScatter();
+	testSalts();
+	testOkmSize();
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,1253 @@
+/*
+MIT License
+
+Copyright (c) 2018 Gera Kazakov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// HTTP server test over the in-memory loopback transport
+//	a paired controller opens several sessions, runs pair verify on each of them,
+//	then exchanges encrypted GET/PUT requests and checks event delivery;
+//	exits with non-zero status when any check fails
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <thread>
+#include <atomic>
+
+#include "Hap.h"
+
+#define Log Hap::Log
+
+static int failed = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failed++; } } while (0)
+
+// HAP database - one lightbulb
+
+class TestLb : public Hap::Lightbulb
+{
+public:
+	Hap::iid_t OnIid() { return _on.Iid().get(); }
+	bool On() { return _on.Value(); }
+	void On(bool v) { _on.Value(v); }
+} testLb;
+
+class TestAcc : public Hap::Accessory<2>
+{
+public:
+	TestAcc() : Hap::Accessory<2>()
+	{
+		AddService(&testAis);
+		AddService(&testLb);
+	}
+
+	Hap::AccessoryInformation testAis;
+} testAcc;
+
+class TestDb : public Hap::DbStatic<1>
+{
+public:
+	TestDb()
+	{
+		AddAcc(&testAcc);
+	}
+} db;
+
+// larger HAP database, GET /accessories does not fit into response buffer
+
+constexpr int BigAccessories = 12;
+
+class BigAcc : public Hap::Accessory<2>
+{
+public:
+	BigAcc() : Hap::Accessory<2>()
+	{
+		AddService(&ais);
+		AddService(&lb);
+	}
+
+	Hap::AccessoryInformation ais;
+	TestLb lb;
+};
+
+class BigDb : public Hap::DbStatic<BigAccessories>
+{
+public:
+	BigAcc acc[BigAccessories];
+
+	BigDb()
+	{
+		for (int i = 0; i < BigAccessories; i++)
+		{
+			acc[i].setId(i + 1);
+			AddAcc(&acc[i]);
+		}
+	}
+} bigDb;
+
+// pairing records, keys and config are not persistent
+
+class TestPairings : public Hap::Pairings
+{
+public:
+	void Reset()
+	{
+		init();
+	}
+};
+
+class TestKeys : public Hap::Crypt::Ed25519
+{
+public:
+	void Reset()
+	{
+		init();
+	}
+};
+
+class TestConfig : public Hap::Config
+{
+public:
+	TestPairings pairings;
+	TestKeys keys;
+
+	TestConfig()
+	{
+		name = "LoopbackTest";
+		model = "TestModel";
+		manufacturer = "TestMaker";
+		serialNumber = "0001";
+		firmwareRevision = "0.1";
+		deviceId = "11:22:33:44:55:66";
+		setupCode = "000-11-000";
+	}
+
+private:
+	virtual void _default() override
+	{
+		configNum = 1;
+		categoryId = 5;
+		statusFlags = 0;
+		port = swap_16(7889);
+		BCT = 0;
+
+		pairings.Reset();
+		keys.Reset();
+	}
+
+	virtual void _reset() override {}
+	virtual bool _restore() override { return false; }
+	virtual bool _save() override { return true; }
+
+} testConfig;
+
+Hap::Config* Hap::config = &testConfig;
+
+constexpr uint16_t SessionPoolChunks =
+	Hap::MaxHttpReq / Hap::MaxHttpFrame +
+	Hap::Http::Server::QueueChunks();
+constexpr uint16_t ThreadPoolChunks =
+	Hap::MaxHttpRsp / Hap::MaxHttpFrame + 1 +
+	Hap::Http::Server::MaxSendFrames;
+Hap::Http::PoolStatic<
+	Hap::MaxHttpSessions * SessionPoolChunks +
+	Hap::MaxHttpThreads * ThreadPoolChunks> pool;
+Hap::Http::Server http(pool, db, testConfig.pairings, testConfig.keys);
+Hap::Http::Server bigHttp(pool, bigDb, testConfig.pairings, testConfig.keys);
+
+uint8_t Hap::logLevel = Hap::LogNone;
+
+// random number generator
+extern "C" {
+	void t_stronginitrand()
+	{
+		srand((unsigned)time(NULL));
+	}
+
+	void t_random(unsigned char* data, unsigned size)
+	{
+		for (unsigned i = 0; i < size; i++)
+		{
+			*data++ = rand() & 0xFF;
+		}
+	}
+}
+
+// controller identity
+class Controller : public Hap::Crypt::Ed25519
+{
+public:
+	static constexpr const char* Id = "TestController";
+
+	Controller()
+	{
+		init();
+	}
+} controller;
+
+// controller side of one HTTP session
+class Client
+{
+public:
+	static constexpr int MaxBody = Hap::MaxHttpRsp * 8;
+
+	// received HTTP response or event message
+	struct Message
+	{
+		bool event = false;
+		bool chunked = false;
+		int status = 0;
+		char body[MaxBody];
+		int length = 0;
+
+		bool has(const char* s)
+		{
+			body[length] = 0;
+			return strstr(body, s) != nullptr;
+		}
+	};
+
+	Client(Hap::Loopback& lb) : _lb(lb)
+	{
+		_c = _lb.Connect();
+	}
+
+	~Client()
+	{
+		if (_c >= 0)
+			_lb.Disconnect(_c);
+	}
+
+	bool connected()
+	{
+		return _c >= 0;
+	}
+
+	// server closed the connection, no data must be left unread
+	bool closed()
+	{
+		char b;
+		return _lb.Read(_c, &b, 1) < 0;
+	}
+
+	// send request, when secured it is split into encrypted frames of up to block bytes
+	bool send(const char* data, uint16_t len, uint16_t block = Hap::MaxHttpBlock)
+	{
+		if (!_secured)
+			return write(data, len);
+
+		while (len > 0)
+		{
+			uint8_t frame[Hap::MaxHttpFrame];
+			uint16_t l = len > block ? block : len;
+			uint16_t fl = Hap::Crypt::encryptFrame(frame, _writeKey, _writeSeq++, (const uint8_t*)data, l);
+
+			if (!write((const char*)frame, fl))
+				return false;
+
+			data += l;
+			len -= l;
+		}
+
+		return true;
+	}
+
+	bool request(const char* method, const char* path, const char* contentType = nullptr,
+		const char* body = nullptr, uint16_t bodyLen = 0)
+	{
+		char req[Hap::MaxHttpReq];
+		int l = snprintf(req, sizeof(req), "%s %s HTTP/1.1\r\nHost: LoopbackTest._hap._tcp.local\r\n", method, path);
+
+		if (contentType != nullptr)
+			l += snprintf(req + l, sizeof(req) - l, "Content-Type: %s\r\nContent-Length: %d\r\n", contentType, bodyLen);
+		l += snprintf(req + l, sizeof(req) - l, "\r\n");
+
+		if (l + bodyLen > (int)sizeof(req))
+			return false;
+
+		if (bodyLen > 0)
+			memcpy(req + l, body, bodyLen);
+
+		return send(req, l + bodyLen);
+	}
+
+	// receive next message, events pending in DB are collected when nothing else is there
+	bool recv(Message& m)
+	{
+		bool polled = false;
+
+		while (true)
+		{
+			if (parse(m))
+				return true;
+
+			char buf[Hap::MaxHttpFrame];
+			int l = _lb.Read(_c, buf, sizeof(buf));
+			if (l < 0)
+				return false;
+
+			if (l == 0)
+			{
+				if (polled)
+					return false;
+
+				_lb.Poll();
+				polled = true;
+				continue;
+			}
+
+			if (!received(buf, l))
+				return false;
+		}
+	}
+
+	// pair verify (5.7 Pair Verify), on success the session is secured
+	bool verify()
+	{
+		uint8_t tlv[256];
+		Hap::Tlv::Create tlvo;
+		Message m;
+
+		// M1 - controller public key
+		_curve.Init();
+
+		tlvo.create(tlv, sizeof(tlv));
+		tlvo.add(Hap::Tlv::Type::State, Hap::Tlv::State::M1);
+		tlvo.add(Hap::Tlv::Type::PublicKey, _curve.getPublicKey(), _curve.KeySize);
+
+		if (!request("POST", "/pair-verify", Hap::Http::ContentTypeTlv8, (const char*)tlv, tlvo.length()))
+			return false;
+
+		// M2 - accessory public key and encrypted accessory info
+		if (!recv(m) || m.status != 200)
+			return false;
+
+		Hap::Tlv::Parse<4> tlvi((const uint8_t*)m.body, m.length);
+		Hap::Tlv::State state;
+		Hap::Tlv::Item accKey;
+		Hap::Tlv::Item enc;
+
+		if (!tlvi.get(Hap::Tlv::Type::State, state) || state != Hap::Tlv::State::M2)
+			return false;
+		if (!tlvi.get(Hap::Tlv::Type::PublicKey, accKey) || accKey.len() != _curve.KeySize)
+			return false;
+		if (!tlvi.get(Hap::Tlv::Type::EncryptedData, enc) || enc.len() <= Hap::Crypt::TagSize)
+			return false;
+
+		uint8_t accPub[Hap::Crypt::Curve25519::KeySize];
+		memcpy(accPub, accKey.val(), sizeof(accPub));
+
+		const uint8_t* secret = _curve.getSharedSecret(accPub);
+		uint8_t secretCopy[Hap::Crypt::Curve25519::KeySize];
+		memcpy(secretCopy, secret, sizeof(secretCopy));
+
+		uint8_t key[32];
+		Hap::Crypt::hkdf(Hap::Crypt::PairVerifyEncryptSalt, secretCopy, sizeof(secretCopy),
+			(const uint8_t*)"Pair-Verify-Encrypt-Info", sizeof("Pair-Verify-Encrypt-Info") - 1,
+			key, sizeof(key));
+
+		uint8_t sub[256];
+		uint16_t subLen = (uint16_t)enc.len() - Hap::Crypt::TagSize;
+		uint8_t tag[Hap::Crypt::TagSize];
+		memcpy(tag, enc.val() + subLen, sizeof(tag));
+
+		if (!Hap::Crypt::aead(Hap::Crypt::Decrypt, sub, tag, key,
+			(const uint8_t*)"\x00\x00\x00\x00PV-Msg02", enc.val(), subLen))
+			return false;
+
+		// accessory signature over AccessoryInfo
+		Hap::Tlv::Parse<2> subi(sub, subLen);
+		Hap::Tlv::Item accId;
+		Hap::Tlv::Item accSign;
+
+		if (!subi.get(Hap::Tlv::Type::Identifier, accId) || !subi.get(Hap::Tlv::Type::Signature, accSign))
+			return false;
+
+		uint8_t info[128];
+		uint16_t infoLen = 0;
+		memcpy(info, accPub, sizeof(accPub));
+		infoLen += sizeof(accPub);
+		memcpy(info + infoLen, accId.val(), accId.len());
+		infoLen += (uint16_t)accId.len();
+		memcpy(info + infoLen, _curve.getPublicKey(), _curve.KeySize);
+		infoLen += _curve.KeySize;
+
+		if (!controller.Verify(accSign.val(), info, infoLen, testConfig.keys.PubKey()))
+			return false;
+
+		// M3 - encrypted controller info
+		infoLen = 0;
+		memcpy(info, _curve.getPublicKey(), _curve.KeySize);
+		infoLen += _curve.KeySize;
+		memcpy(info + infoLen, Controller::Id, strlen(Controller::Id));
+		infoLen += (uint16_t)strlen(Controller::Id);
+		memcpy(info + infoLen, accPub, sizeof(accPub));
+		infoLen += sizeof(accPub);
+
+		uint8_t sign[Hap::Crypt::Ed25519::SignSize];
+		controller.Sign(sign, info, infoLen);
+
+		Hap::Tlv::Create subo;
+		subo.create(sub, sizeof(sub));
+		subo.add(Hap::Tlv::Type::Identifier, (const uint8_t*)Controller::Id, (uint16_t)strlen(Controller::Id));
+		subo.add(Hap::Tlv::Type::Signature, sign, sizeof(sign));
+
+		uint8_t encOut[256];
+		Hap::Crypt::aead(Hap::Crypt::Encrypt, encOut, encOut + subo.length(), key,
+			(const uint8_t*)"\x00\x00\x00\x00PV-Msg03", sub, subo.length());
+
+		tlvo.create(tlv, sizeof(tlv));
+		tlvo.add(Hap::Tlv::Type::State, Hap::Tlv::State::M3);
+		tlvo.add(Hap::Tlv::Type::EncryptedData, encOut, subo.length() + Hap::Crypt::TagSize);
+
+		if (!request("POST", "/pair-verify", Hap::Http::ContentTypeTlv8, (const char*)tlv, tlvo.length()))
+			return false;
+
+		// M4 - no error
+		if (!recv(m) || m.status != 200)
+			return false;
+
+		Hap::Tlv::Parse<2> tlvm4((const uint8_t*)m.body, m.length);
+		Hap::Tlv::Error err;
+		if (!tlvm4.get(Hap::Tlv::Type::State, state) || state != Hap::Tlv::State::M4)
+			return false;
+		if (tlvm4.get(Hap::Tlv::Type::Error, err))
+			return false;
+
+		// session keys
+		Hap::Crypt::hkdf(Hap::Crypt::ControlSalt, secretCopy, sizeof(secretCopy),
+			(const uint8_t*)"Control-Read-Encryption-Key", sizeof("Control-Read-Encryption-Key") - 1,
+			_readKey, sizeof(_readKey));
+		Hap::Crypt::hkdf(Hap::Crypt::ControlSalt, secretCopy, sizeof(secretCopy),
+			(const uint8_t*)"Control-Write-Encryption-Key", sizeof("Control-Write-Encryption-Key") - 1,
+			_writeKey, sizeof(_writeKey));
+
+		_secured = true;
+		return true;
+	}
+
+private:
+	Hap::Loopback& _lb;
+	int _c = -1;
+
+	Hap::Crypt::Curve25519 _curve;
+	bool _secured = false;
+	uint8_t _readKey[32];		// accessory to controller
+	uint8_t _writeKey[32];		// controller to accessory
+	uint64_t _readSeq = 0;
+	uint64_t _writeSeq = 0;
+
+	uint8_t _rx[Hap::MaxHttpFrame * 2];		// encrypted data, incomplete frame
+	uint16_t _rxLen = 0;
+	char _msg[MaxBody + Hap::MaxHttpRsp];	// plain text data
+	uint16_t _msgLen = 0;
+
+	// write all data, the server processes it in this thread
+	bool write(const char* data, uint16_t len)
+	{
+		while (len > 0)
+		{
+			int l = _lb.Write(_c, data, len);
+			if (l < 0)
+				return false;
+
+			// pipe is full - server waits for this side to read
+			if (l == 0)
+			{
+				char buf[Hap::MaxHttpFrame];
+				int r = _lb.Read(_c, buf, sizeof(buf));
+				if (r <= 0 || !received(buf, r))
+					return false;
+				continue;
+			}
+
+			data += l;
+			len -= l;
+		}
+
+		return true;
+	}
+
+	// append received data to plain text messages
+	bool received(const char* buf, int len)
+	{
+		if (!_secured)
+		{
+			if (_msgLen + len > (int)sizeof(_msg))
+				return false;
+
+			memcpy(_msg + _msgLen, buf, len);
+			_msgLen += len;
+			return true;
+		}
+
+		if (_rxLen + len > (int)sizeof(_rx))
+			return false;
+
+		memcpy(_rx + _rxLen, buf, len);
+		_rxLen += len;
+
+		while (_rxLen >= 2)
+		{
+			uint16_t l = _rx[0] + ((uint16_t)_rx[1] << 8);
+			if (_rxLen < l + Hap::Crypt::FrameOverhead)
+				break;
+
+			if (_msgLen + l > (int)sizeof(_msg))
+				return false;
+
+			if (!Hap::Crypt::decryptFrame((uint8_t*)_msg + _msgLen, _readKey, _readSeq++, _rx, l))
+				return false;
+
+			_msgLen += l;
+			_rxLen -= l + Hap::Crypt::FrameOverhead;
+			memmove(_rx, _rx + l + Hap::Crypt::FrameOverhead, _rxLen);
+		}
+
+		return true;
+	}
+
+	// extract complete message from plain text data
+	bool parse(Message& m)
+	{
+		const char* end = nullptr;
+		for (uint16_t i = 0; i + 4 <= _msgLen; i++)
+		{
+			if (memcmp(_msg + i, "\r\n\r\n", 4) == 0)
+			{
+				end = _msg + i + 4;
+				break;
+			}
+		}
+
+		if (end == nullptr)
+			return false;
+
+		int used = end - _msg;		// headers and body
+		int length = 0;
+		const char* cl = header(end, "Content-Length:");
+		if (cl != nullptr)
+			length = atoi(cl);
+
+		m.chunked = header(end, "Transfer-Encoding: chunked") != nullptr;
+		if (m.chunked)
+		{
+			// chunks are collected into the body, message is complete after the last chunk
+			const char* p = end;
+			while (true)
+			{
+				const char* d = (const char*)memmem(p, _msg + _msgLen - p, "\r\n", 2);
+				if (d == nullptr)
+					return false;
+				d += 2;
+
+				int n = (int)strtol(p, nullptr, 16);
+				if (d + n + 2 > _msg + _msgLen || length + n >= (int)sizeof(m.body))
+					return false;
+
+				memcpy(m.body + length, d, n);
+				length += n;
+				p = d + n + 2;
+
+				if (n == 0)
+					break;
+			}
+			used = p - _msg;
+		}
+		else if (used + length > _msgLen || length >= (int)sizeof(m.body))
+			return false;
+		else
+		{
+			memcpy(m.body, end, length);
+			used += length;
+		}
+
+		m.event = strncmp(_msg, "EVENT/1.0 ", 10) == 0;
+		m.status = atoi(strchr(_msg, ' ') + 1);
+		m.length = length;
+
+		_msgLen -= used;
+		memmove(_msg, _msg + used, _msgLen);
+
+		return true;
+	}
+
+	// find header in the message headers, returns pointer to its value
+	const char* header(const char* end, const char* name)
+	{
+		size_t l = strlen(name);
+		for (const char* p = _msg; p + 2 + l <= end; p++)
+		{
+			if (p[0] == '\r' && p[1] == '\n' && strncasecmp(p + 2, name, l) == 0)
+				return p + 2 + l;
+		}
+		return nullptr;
+	}
+};
+
+static int put(Client& c, const char* body)
+{
+	Client::Message m;
+
+	if (!c.request("PUT", "/characteristics", Hap::Http::ContentTypeJson, body, (uint16_t)strlen(body)))
+		return -1;
+	if (!c.recv(m) || m.event)
+		return -1;
+
+	return m.status;
+}
+
+// sessions over loopback: pair verify, GET/PUT, events
+static void testSessions(Hap::Loopback& lb)
+{
+	constexpr int Sessions = 4;
+	Client* c[Sessions];
+	Client::Message m;
+	char body[256];
+	Hap::iid_t on = testLb.OnIid();
+
+	for (int i = 0; i < Sessions; i++)
+	{
+		c[i] = new Client(lb);
+		CHECK(c[i]->connected());
+		CHECK(c[i]->verify());
+	}
+
+	// unpaired controller is rejected
+	{
+		Client u(lb);
+		CHECK(u.request("GET", "/accessories"));
+		CHECK(u.recv(m) && m.status == 470);
+	}
+
+	// accessory database
+	CHECK(c[0]->request("GET", "/accessories"));
+	CHECK(c[0]->recv(m) && !m.event && m.status == 200);
+	CHECK(m.has("\"accessories\"") && m.has("\"43\""));
+
+	// enable events on sessions 1..n
+	snprintf(body, sizeof(body), "{\"characteristics\":[{\"aid\":1,\"iid\":%d,\"ev\":true}]}", on);
+	for (int i = 1; i < Sessions; i++)
+		CHECK(put(*c[i], body) == 204);
+
+	// write On and read it back
+	testLb.On(false);
+	snprintf(body, sizeof(body), "{\"characteristics\":[{\"aid\":1,\"iid\":%d,\"value\":true}]}", on);
+	CHECK(put(*c[0], body) == 204);
+	CHECK(testLb.On());
+
+	snprintf(body, sizeof(body), "/characteristics?id=1.%d", on);
+	CHECK(c[0]->request("GET", body));
+	CHECK(c[0]->recv(m) && !m.event && m.status == 200);
+	CHECK(m.has("\"value\":true") || m.has("\"value\":1"));
+
+	// the write is delivered as event to subscribed sessions
+	snprintf(body, sizeof(body), "\"iid\":%d", on);
+	for (int i = 1; i < Sessions; i++)
+	{
+		CHECK(c[i]->recv(m) && m.event && m.status == 200);
+		CHECK(m.has(body));
+	}
+
+	// value changed by the accessory itself
+	testLb.On(false);
+	for (int i = 1; i < Sessions; i++)
+	{
+		CHECK(c[i]->recv(m) && m.event);
+		CHECK(m.has("\"value\":false") || m.has("\"value\":0"));
+	}
+
+	for (int i = 0; i < Sessions; i++)
+		delete c[i];
+}
+
+// characteristics write that takes more than 256 JSON tokens
+//	root object, "characteristics" key and array are tokens 0..2, each write
+//	{"aid","iid","value"} takes 7 tokens; the first one also has "ev" (9 tokens),
+//	so the value of the last write is token 256
+static void testLongWrite(Hap::Loopback& lb)
+{
+	constexpr int Writes = 36;
+	char body[Hap::MaxHttpReq];
+	int l = 0;
+	Hap::iid_t on = testLb.OnIid();
+
+	l += snprintf(body + l, sizeof(body) - l, "{\"characteristics\":[");
+	for (int i = 0; i < Writes; i++)
+	{
+		bool last = i == Writes - 1;
+		l += snprintf(body + l, sizeof(body) - l, "%s{\"aid\":1,\"iid\":%d,%s\"value\":%s}",
+			i == 0 ? "" : ",", on, i == 0 ? "\"ev\":false," : "", last ? "false" : "true");
+	}
+	l += snprintf(body + l, sizeof(body) - l, "]}");
+	CHECK(l < (int)sizeof(body) - 512);
+
+	Client c(lb);
+	CHECK(c.verify());
+
+	testLb.On(true);
+	CHECK(put(c, body) == 204);
+	CHECK(!testLb.On());
+}
+
+// GET and PUT requests sent back to back, in one encrypted frame
+//	and split across frame boundaries, get one response each in order
+static void testPipelining(Hap::Loopback& lb)
+{
+	static const uint16_t blocks[] = { Hap::MaxHttpBlock, 37, 1 };
+	Hap::iid_t on = testLb.OnIid();
+	Client c(lb);
+	Client::Message m;
+	char body[256];
+	char req[Hap::MaxHttpReq * 2];
+
+	CHECK(c.verify());
+
+	for (auto block : blocks)
+	{
+		int l = 0;
+		int bl;
+
+		testLb.On(false);
+
+		for (int i = 0; i < 4; i++)
+		{
+			l += snprintf(req + l, sizeof(req) - l,
+				"GET /characteristics?id=1.%d HTTP/1.1\r\nHost: LoopbackTest._hap._tcp.local\r\n\r\n", on);
+
+			bl = snprintf(body, sizeof(body), "{\"characteristics\":[{\"aid\":1,\"iid\":%d,\"value\":%s}]}",
+				on, i % 2 ? "false" : "true");
+			l += snprintf(req + l, sizeof(req) - l,
+				"PUT /characteristics HTTP/1.1\r\nHost: LoopbackTest._hap._tcp.local\r\n"
+				"Content-Type: %s\r\nContent-Length: %d\r\n\r\n%s", Hap::Http::ContentTypeJson, bl, body);
+		}
+		CHECK(l < (int)sizeof(req));
+		CHECK(block < Hap::MaxHttpBlock || l <= Hap::MaxHttpBlock);
+
+		CHECK(c.send(req, l, block));
+
+		for (int i = 0; i < 4; i++)
+		{
+			CHECK(c.recv(m) && !m.event && m.status == 200);
+			CHECK(m.has(i % 2 ? "\"value\":true" : "\"value\":false") || m.has(i % 2 ? "\"value\":1" : "\"value\":0"));
+
+			CHECK(c.recv(m) && !m.event && m.status == 204);
+		}
+		CHECK(!testLb.On());
+
+		// nothing else was sent
+		CHECK(!c.recv(m));
+	}
+}
+
+// GET /accessories
+//	small database goes with Content-Length, larger one is streamed in chunks;
+//	the pipe holds only a few frames, so the stream stops and resumes several times,
+//	a request sent meanwhile is answered after the stream ends
+static void testStream(Hap::Loopback& lb, Hap::Loopback& blb)
+{
+	Client::Message m;
+	char s[32];
+
+	{
+		Client c(lb);
+		CHECK(c.verify());
+		CHECK(c.request("GET", "/accessories"));
+		CHECK(c.recv(m) && m.status == 200 && !m.chunked);
+		CHECK(m.has("{\"accessories\":[{\"aid\":1,"));
+	}
+
+	Client c(blb);
+	CHECK(c.verify());
+
+	for (int n = 0; n < 2; n++)
+	{
+		CHECK(c.request("GET", "/accessories"));
+		CHECK(c.request("GET", "/characteristics?id=12.9"));
+
+		CHECK(c.recv(m) && !m.event && m.status == 200 && m.chunked);
+		CHECK(m.length > Hap::MaxHttpRsp + Hap::Loopback::PipeSize);
+		CHECK(m.has("{\"accessories\":[{\"aid\":1,") && strstr(m.body, "{\"accessories\"") == m.body);
+		CHECK(m.length > 2 && strncmp(m.body + m.length - 2, "]}", 2) == 0);
+
+		// all accessories in order
+		const char* p = m.body;
+		for (int i = 1; i <= BigAccessories; i++)
+		{
+			snprintf(s, sizeof(s), "{\"aid\":%d,", i);
+			const char* a = strstr(p, s);
+			CHECK(a != nullptr);
+			if (a != nullptr)
+				p = a;
+		}
+
+		CHECK(c.recv(m) && !m.event && m.status == 200 && !m.chunked);
+		CHECK(m.has("\"aid\":12"));
+	}
+
+	// the session is still usable
+	CHECK(c.request("GET", "/characteristics?id=1.9"));
+	CHECK(c.recv(m) && m.status == 200);
+}
+
+// GET /accessories from the serialized database cache
+//	the output matches the uncached one, values and per-session ev flags are current,
+//	the cache is rebuilt when configuration number changes
+static void testCache(Hap::Loopback& lb)
+{
+	static Hap::DbCacheStatic<BigAccessories, BigAccessories * 1024, BigAccessories * 32> cache;
+	static char ref[Client::MaxBody];
+	int refLen;
+	Hap::iid_t on = bigDb.acc[0].lb.OnIid();
+	uint32_t configNum = testConfig.configNum;
+	Client c0(lb);
+	Client c1(lb);
+	Client::Message m;
+	char s[128];
+
+	CHECK(c0.verify());
+	CHECK(c1.verify());
+
+	auto get = [&m](Client& c) -> bool
+	{
+		return c.request("GET", "/accessories") && c.recv(m) && !m.event && m.status == 200;
+	};
+
+	// value of characteristic iid of the first accessory
+	auto value = [&m, &s](Hap::iid_t iid) -> const char*
+	{
+		snprintf(s, sizeof(s), "\"iid\":%d,", iid);
+		const char* p = strstr(m.body, s);
+		p = p != nullptr ? strstr(p, "\"value\":") : nullptr;
+		return p != nullptr ? p + 8 : "";
+	};
+
+	// uncached
+	CHECK(get(c0));
+	memcpy(ref, m.body, m.length);
+	refLen = m.length;
+
+	bigDb.Cache(&cache);
+
+	// same output from the cache, session 1 has events enabled on the last accessory
+	CHECK(get(c0) && m.length == refLen && memcmp(m.body, ref, refLen) == 0);
+
+	snprintf(s, sizeof(s), "{\"characteristics\":[{\"aid\":%d,\"iid\":%d,\"ev\":true}]}", BigAccessories, on);
+	CHECK(put(c1, s) == 204);
+
+	CHECK(get(c1));
+	CHECK(m.has("\"ev\":true") || m.has("\"ev\":1"));
+	CHECK(!memmem(ref, refLen, "\"ev\":true", 9) && !memmem(ref, refLen, "\"ev\":1", 6));
+	CHECK(get(c0) && m.length == refLen && memcmp(m.body, ref, refLen) == 0);
+
+	// value changed after the cache was built
+	bigDb.acc[0].lb.On(true);
+	CHECK(get(c0));
+	CHECK(strncmp(value(on), "true", 4) == 0 || strncmp(value(on), "1", 1) == 0);
+	bigDb.acc[0].lb.On(false);
+	CHECK(get(c0));
+	CHECK(strncmp(value(on), "false", 5) == 0 || strncmp(value(on), "0", 1) == 0);
+	CHECK(m.length == refLen && memcmp(m.body, ref, refLen) == 0);
+
+	// structure change is seen only after configuration number changes
+	bigDb.acc[BigAccessories - 1].setId(99);
+	CHECK(get(c0) && m.has("{\"aid\":12,") && !m.has("{\"aid\":99,"));
+	testConfig.configNum++;
+	CHECK(get(c0) && m.has("{\"aid\":99,") && !m.has("{\"aid\":12,"));
+
+	bigDb.acc[BigAccessories - 1].setId(BigAccessories);
+	testConfig.configNum++;
+	CHECK(get(c0) && m.length == refLen && memcmp(m.body, ref, refLen) == 0);
+
+	bigDb.Cache(nullptr);
+	testConfig.configNum = configNum;
+
+	snprintf(s, sizeof(s), "{\"characteristics\":[{\"aid\":%d,\"iid\":%d,\"ev\":false}]}", BigAccessories, on);
+	CHECK(put(c1, s) == 204);
+}
+
+// responses to pipelined requests fill the pipe while the pool is nearly exhausted,
+//	what the transport does not take must fit into the outbound queue chunks
+//	reserved for the session
+static void testPoolPressure(Hap::Loopback& lb)
+{
+	constexpr uint16_t Reserved = SessionPoolChunks + ThreadPoolChunks;
+	Client c(lb);
+	Client::Message m;
+
+	CHECK(c.verify());
+
+	// leave only the chunks of one session and one network thread
+	Hap::Buf<char*> hold[8];
+	int held = 0;
+	while (pool.Free() > Reserved && held < (int)sizeofarr(hold))
+	{
+		uint16_t n = pool.Free() - Reserved;
+		if (n > 60)
+			n = 60;
+		CHECK(pool.Lease(hold[held], n * Hap::MaxHttpFrame));
+		held++;
+	}
+	CHECK(pool.Free() == Reserved);
+
+	uint32_t noBuffers = bigHttp.stats.noBuffers;
+
+	// short responses are batched with the streamed database, which is several times the pipe size
+	static const char* const paths[] =
+	{
+		"/characteristics?id=1.9",
+		"/characteristics?id=2.9",
+		"/accessories",
+		"/characteristics?id=3.9",
+		"/accessories",
+	};
+	char req[sizeofarr(paths) * 128];
+	int l = 0;
+	for (auto path : paths)
+		l += snprintf(req + l, sizeof(req) - l, "GET %s HTTP/1.1\r\nHost: LoopbackTest._hap._tcp.local\r\n\r\n", path);
+	CHECK(c.send(req, l));
+
+	for (auto path : paths)
+	{
+		bool db = strcmp(path, "/accessories") == 0;
+		CHECK(c.recv(m) && !m.event && m.status == 200);
+		CHECK(m.chunked == db);
+		CHECK(m.has(db ? "\"aid\":12" : "\"iid\":9"));
+	}
+	CHECK(bigHttp.stats.noBuffers == noBuffers);
+
+	// the session is still usable
+	CHECK(c.request("GET", "/characteristics?id=1.9"));
+	CHECK(c.recv(m) && m.status == 200);
+
+	for (int i = 0; i < held; i++)
+		pool.Release(hold[i]);
+}
+
+// requests over the session limit, and requests that find the pool exhausted,
+//	get the precomputed 503 - in an encrypted frame when the session is secured;
+//	the connection is closed afterwards
+static void testReject(Hap::Loopback& lb)
+{
+	Client* c[Hap::MaxHttpSessions];
+	Client::Message m;
+	uint32_t rejected = http.stats.rejected;
+	uint32_t noBuffers = http.stats.noBuffers;
+
+	for (auto& ci : c)
+	{
+		ci = new Client(lb);
+		CHECK(ci->verify());
+	}
+
+	{
+		Client u(lb);
+		CHECK(u.connected());
+		CHECK(u.request("GET", "/accessories"));
+		CHECK(u.recv(m) && !m.event && m.status == 503 && m.length == 0);
+		CHECK(u.closed());
+	}
+	CHECK(http.stats.rejected == rejected + 1);
+
+	// the first session still works, a freed one can be reused
+	CHECK(c[0]->request("GET", "/characteristics?id=1.9"));
+	CHECK(c[0]->recv(m) && m.status == 200);
+
+	delete c[Hap::MaxHttpSessions - 1];
+	c[Hap::MaxHttpSessions - 1] = new Client(lb);
+	CHECK(c[Hap::MaxHttpSessions - 1]->verify());
+
+	// secured session, no buffers for the request
+	Hap::Buf<char*> hold[16];
+	int held = 0;
+	while (pool.Free() > 0 && held < (int)sizeofarr(hold))
+	{
+		uint16_t n = pool.Free();
+		if (n > 60)
+			n = 60;
+		CHECK(pool.Lease(hold[held], n * Hap::MaxHttpFrame));
+		held++;
+	}
+	CHECK(pool.Free() == 0);
+
+	CHECK(c[1]->request("GET", "/characteristics?id=1.9"));
+	CHECK(c[1]->recv(m) && !m.event && m.status == 503 && m.length == 0);
+	CHECK(c[1]->closed());
+	CHECK(http.stats.rejected == rejected + 2);
+	CHECK(http.stats.noBuffers == noBuffers + 1);
+
+	for (int i = 0; i < held; i++)
+		pool.Release(hold[i]);
+
+	CHECK(c[2]->request("GET", "/characteristics?id=1.9"));
+	CHECK(c[2]->recv(m) && m.status == 200);
+
+	for (auto ci : c)
+		delete ci;
+}
+
+// outbound queue on the server API: the transport takes a few bytes at a time,
+//	requests are not read while the queue is not empty, Flush sends the rest
+static void testFlush()
+{
+	static const char req[] = "GET /accessories HTTP/1.1\r\nHost: LoopbackTest._hap._tcp.local\r\n\r\n";
+	char out[256];
+	int outLen = 0;
+	int take = 0;		// bytes the transport takes in next send
+	int reads = 0;
+	const char* in = req;
+	int inLen = sizeof(req) - 1;
+
+	auto recv = [&](Hap::sid_t sid, char* buf, uint16_t size) -> int
+	{
+		reads++;
+		if (inLen == 0)
+			return Hap::Http::Server::RecvAgain;
+
+		int l = inLen < size ? inLen : size;
+		memcpy(buf, in, l);
+		in += l;
+		inLen -= l;
+		return l;
+	};
+
+	auto send = [&](Hap::sid_t sid, char* buf, uint16_t len) -> int
+	{
+		if (buf == nullptr)
+			return 0;
+		if (take == 0)
+			return Hap::Http::Server::SendAgain;
+
+		int l = len < take ? len : take;
+		CHECK(outLen + l <= (int)sizeof(out));
+		if (outLen + l <= (int)sizeof(out))
+			memcpy(out + outLen, buf, l);
+		outLen += l;
+		return l;
+	};
+
+	Hap::sid_t sid = http.Open();
+	CHECK(sid <= Hap::sid_max);
+
+	// unsecured session, the response is sent as is
+	take = 10;
+	CHECK(http.Process(sid, recv, send));
+	CHECK(http.Pending(sid) && outLen == 10);
+
+	// the next request is not read while the queue is not empty
+	in = req;
+	inLen = sizeof(req) - 1;
+	reads = 0;
+	CHECK(http.Process(sid, recv, send));
+	CHECK(reads == 0 && inLen == sizeof(req) - 1);
+
+	// transport is not writable
+	take = 0;
+	CHECK(http.Flush(sid, send));
+	CHECK(http.Pending(sid) && outLen == 10);
+
+	take = 10;
+	int flushes = 0;
+	while (http.Pending(sid) && flushes < 100)
+	{
+		CHECK(http.Flush(sid, send));
+		flushes++;
+	}
+	CHECK(!http.Pending(sid) && flushes > 1);
+
+	out[outLen < (int)sizeof(out) ? outLen : sizeof(out) - 1] = 0;
+	CHECK(strncmp(out, "HTTP/1.1 470 ", 13) == 0);
+	CHECK(outLen > 4 && strcmp(out + outLen - 4, "\r\n\r\n") == 0);
+
+	// the held request is processed now, same response
+	take = 1024;
+	int first = outLen;
+	CHECK(http.Process(sid, recv, send));
+	CHECK(reads > 0 && inLen == 0 && !http.Pending(sid));
+	CHECK(outLen == first * 2 && memcmp(out, out + first, first) == 0);
+
+	CHECK(http.Close(sid));
+}
+
+// events raised while a streamed response is queued are held and coalesced,
+//	they follow the response and the request pipelined behind it
+static void testHeldEvents(Hap::Loopback& lb)
+{
+	Hap::iid_t on = bigDb.acc[0].lb.OnIid();
+	Client c(lb);
+	Client::Message m;
+	char s[128];
+
+	CHECK(c.verify());
+
+	bigDb.acc[0].lb.On(false);
+	snprintf(s, sizeof(s), "{\"characteristics\":[{\"aid\":1,\"iid\":%d,\"ev\":true}]}", on);
+	CHECK(put(c, s) == 204);
+
+	// the response fills the pipe, the rest is queued until the client reads
+	CHECK(c.request("GET", "/accessories"));
+
+	bigDb.acc[0].lb.On(true);
+	bigDb.acc[0].lb.On(false);
+	bigDb.acc[0].lb.On(true);
+	lb.Poll();
+
+	snprintf(s, sizeof(s), "/characteristics?id=1.%d", on);
+	CHECK(c.request("GET", s));
+
+	// complete stream, no event inside
+	CHECK(c.recv(m) && !m.event && m.status == 200 && m.chunked);
+	CHECK(m.has("{\"aid\":12,") && strncmp(m.body + m.length - 2, "]}", 2) == 0);
+
+	CHECK(c.recv(m) && !m.event && m.status == 200);
+	CHECK(m.has("\"value\":true") || m.has("\"value\":1"));
+
+	// one event with the latest value
+	CHECK(c.recv(m) && m.event);
+	CHECK(m.has("\"value\":true") || m.has("\"value\":1"));
+	CHECK(!c.recv(m));
+
+	bigDb.acc[0].lb.On(false);
+	CHECK(c.recv(m) && m.event);
+	CHECK(m.has("\"value\":false") || m.has("\"value\":0"));
+}
+
+// transports add and remove their own event signal hooks in any order,
+//	also while DB threads raise the signal
+static void testSignalHooks()
+{
+	std::atomic<int> signals(0);
+	std::atomic<bool> done(false);
+	Hap::EventSignal::Hook hook = [](void* ctx) -> void
+	{
+		(*(std::atomic<int>*)ctx)++;
+	};
+
+	Hap::Loopback lb1(&http);
+	Hap::Loopback lb2(&http);
+
+	std::thread db([&done]()
+	{
+		while (!done)
+			Hap::eventSignal();
+	});
+
+	for (int i = 0; i < 1000; i++)
+	{
+		CHECK(lb1.Start());
+		CHECK(Hap::eventSignal.Add(hook, &signals));
+		CHECK(lb2.Start());
+
+		// stopped out of the order they were started
+		if (i % 2)
+		{
+			lb1.Stop();
+			Hap::eventSignal.Remove(hook, &signals);
+		}
+		else
+		{
+			Hap::eventSignal.Remove(hook, &signals);
+			lb1.Stop();
+		}
+
+		lb2.Stop();
+	}
+
+	done = true;
+	db.join();
+
+	// nothing is left registered
+	signals = 0;
+	Hap::eventSignal();
+	CHECK(signals == 0);
+
+	// the hook table is bounded, a removed hook frees its slot
+	int n = 0;
+	static std::atomic<int> ctx[Hap::EventSignal::MaxHooks + 1];
+	for (auto& c : ctx)
+		n += Hap::eventSignal.Add(hook, &c) ? 1 : 0;
+	CHECK(n == Hap::EventSignal::MaxHooks);
+	CHECK(!lb1.Start());
+	Hap::eventSignal.Remove(hook, &ctx[0]);
+	CHECK(lb1.Start());
+	lb1.Stop();
+	for (auto& c : ctx)
+		Hap::eventSignal.Remove(hook, &c);
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc > 1)
+		Hap::logLevel = (uint8_t)atoi(argv[1]);
+
+	t_stronginitrand();
+
+	testConfig.Init();
+	testConfig.pairings.Add((const uint8_t*)Controller::Id, strlen(Controller::Id),
+		controller.PubKey(), Hap::Controller::Admin);
+
+	testAcc.setId(1);
+
+	// stands for the event signal hook of TCP transport running next to loopback
+	int signals = 0;
+	Hap::EventSignal::Hook hook = [](void* ctx) -> void
+	{
+		(*(int*)ctx)++;
+	};
+	CHECK(Hap::eventSignal.Add(hook, &signals));
+
+	// small and larger database
+	Hap::Loopback lb(&http);
+	Hap::Loopback blb(&bigHttp);
+	lb.Start();
+	blb.Start();
+
+	testSessions(lb);
+	testLongWrite(lb);
+	testPipelining(lb);
+	testStream(lb, blb);
+	testCache(blb);
+	testPoolPressure(blb);
+	testReject(lb);
+	testFlush();
+	testHeldEvents(blb);
+
+	blb.Stop();
+	lb.Stop();
+
+	// the hook was called while loopback was running and stays after Stop
+	CHECK(signals > 0);
+	signals = 0;
+	Hap::eventSignal();
+	CHECK(signals == 1);
+	Hap::eventSignal.Remove(hook, &signals);
+	Hap::eventSignal();
+	CHECK(signals == 1);
+
+	testSignalHooks();
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+	return failed ? 1 : 0;
+}
@@ -536,14 +536,11 @@ private:
 Hap::Config* Hap::config = &myConfig;
 
 // statically allocated storage for HTTP processing
-//	Our implementation is single-threaded so only one set of buffers.
-//	The http server uses this buffers only during processing a request.
+//	Our implementation is single-threaded so the pool holds one set of buffers.
+//	The http server leases buffers from the pool only during processing a request.
 //	All session-persistend data is kept in Session objects.
-Hap::BufStatic<char, Hap::MaxHttpFrame * 2> http_req;
-Hap::BufStatic<char, Hap::MaxHttpFrame * 4> http_rsp;
-Hap::BufStatic<char, Hap::MaxHttpFrame * 1> http_tmp;
-Hap::Http::Server::Buf buf = { http_req, http_rsp, http_tmp };
-Hap::Http::Server http(buf, db, myConfig.pairings, myConfig.keys);
+Hap::Http::PoolStatic<(Hap::MaxHttpReq + Hap::MaxHttpRsp) / Hap::MaxHttpFrame + 1> pool;
+Hap::Http::Server http(pool, db, myConfig.pairings, myConfig.keys);
 
 template<typename T> bool is_number(int i, T& value)
 {
@@ -567,7 +564,7 @@ bool tst()
 	return false;
 }
 
-bool Hap::debug = true;
+uint8_t Hap::logLevel = Hap::LogDebug;
 
 int main()
 {
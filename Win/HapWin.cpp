@@ -87,10 +87,15 @@ namespace Hap
 
 	void Log(const char* f, ...)
 	{
+		if (logLevel < LogInfo)
+			return;
+
 		va_list arg;
 		va_start(arg, f);
 
 		vprintf(f, arg);
+
+		va_end(arg);
 	}
 }
 